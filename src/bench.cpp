@@ -0,0 +1,250 @@
+// Benchmark: renders every built-in scene headlessly at a fixed resolution, spp and seed,
+// for 1..N threads, and prints the results as JSON. GHDbench_float is the same benchmark
+// built with float geometry (GHD_SINGLE_PRECISION), "precision" in the JSON tells them apart.
+// Usage: GHDbench [--width w] [--height h] [--spp n] [--depth d] [--rr-depth d] [--seed s]
+//                 [--max-threads t] [--tile-size n] [--simd level] [--wavefront 0|1]
+//                 [--sampler name] [--scene name]... [--output file.json]
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "utils/renderer.h"
+
+struct BenchResult {
+    SceneName scene_name;
+    int threads;
+    double setup_ms;
+    double total_ms;
+    double iteration_ms_mean;
+    double iteration_ms_min;
+    double iteration_ms_max;
+    uint64_t rays;
+    double rays_per_sec;
+    double samples_per_sec;
+    double speedup;
+    std::vector<double> utilization;
+    std::vector<WorkerStats> worker_stats;
+};
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --width <pixels>     image width (default: 320)\n"
+        "  --height <pixels>    image height (default: 240)\n"
+        "  --spp <n>            samples per pixel, one progressive iteration each (default: 8)\n"
+        "  --depth <n>          max ray depth (default: 8)\n"
+        "  --rr-depth <n>       bounces before Russian roulette starts, -1 to disable (default: 5)\n"
+        "  --seed <n>           random seed (default: 1)\n"
+        "  --max-threads <n>    thread counts 1, 2, 4, ... up to n (default: hardware threads)\n"
+        "  --tile-size <n>      edge length of the square render tiles in pixels (default: 16)\n"
+        "  --simd <level>       scalar, sse2, avx2 or avx512, capped to what the CPU supports (default: up to avx2)\n"
+        "  --wavefront <0|1>    trace tiles one bounce at a time in ray packets (default: 0)\n"
+        "  --sampler <name>     independent, sobol, halton or bluenoise (default: independent)\n"
+        "  --scene <name>       benchmark only this scene, can be repeated (default: all scenes)\n"
+        "  --output <file>      write the JSON to a file instead of stdout\n",
+        program);
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char** argv) {
+    int width = 320;
+    int height = 240;
+    int samples_per_pixel = 8;
+    int max_depth = 8;
+    int russian_roulette_depth = 5;
+    unsigned long long seed = 1;
+    int max_threads = static_cast<int>(std::thread::hardware_concurrency());
+    int tile_size = 16;
+    bool wavefront = false;
+    sampler_type sampler = sampler_type::independent;
+    std::vector<SceneName> scenes;
+    std::string output;
+
+    // Parse arguments
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", arg.c_str());
+            print_usage(argv[0]);
+            return 1;
+        }
+        const char* value = argv[++i];
+        if (arg == "--scene") {
+            SceneName scene_name;
+            if (!scene_name_from_string(value, scene_name)) {
+                fprintf(stderr, "Unknown scene: %s\n", value);
+                return 1;
+            }
+            scenes.push_back(scene_name);
+        }
+        else if (arg == "--width") width = atoi(value);
+        else if (arg == "--height") height = atoi(value);
+        else if (arg == "--spp") samples_per_pixel = atoi(value);
+        else if (arg == "--depth") max_depth = atoi(value);
+        else if (arg == "--rr-depth") russian_roulette_depth = atoi(value);
+        else if (arg == "--seed") seed = strtoull(value, nullptr, 10);
+        else if (arg == "--max-threads") max_threads = atoi(value);
+        else if (arg == "--tile-size") tile_size = atoi(value);
+        else if (arg == "--simd") {
+            simd_level level;
+            if (!simd_level_from_string(value, level)) {
+                fprintf(stderr, "Unknown SIMD level: %s\n", value);
+                return 1;
+            }
+            set_simd_level(level);
+        }
+        else if (arg == "--wavefront") wavefront = atoi(value) != 0;
+        else if (arg == "--sampler") {
+            if (!sampler_from_string(value, sampler)) {
+                fprintf(stderr, "Unknown sampler: %s\n", value);
+                return 1;
+            }
+        }
+        else if (arg == "--output") output = value;
+        else {
+            fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (width < 2 || height < 2 || samples_per_pixel < 1 || max_depth < 1) {
+        fprintf(stderr, "Invalid resolution, spp or depth\n");
+        return 1;
+    }
+    if (max_threads < 1)
+        max_threads = 1;
+    if (scenes.empty()) {
+        for (int i = 0; i < scene_count; ++i)
+            scenes.push_back(static_cast<SceneName>(i));
+    }
+
+    // 1, 2, 4, ... and max_threads itself
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2)
+        thread_counts.push_back(t);
+    thread_counts.push_back(max_threads);
+
+    std::vector<BenchResult> results;
+    Renderer renderer(width, height, samples_per_pixel, max_depth);
+    renderer.set_verbose(false);
+    renderer.set_seed(seed);
+    renderer.set_russian_roulette_depth(russian_roulette_depth);
+    renderer.set_tile_size(tile_size);
+    renderer.set_wavefront(wavefront);
+    renderer.set_sampler(sampler);
+
+    for (SceneName scene_name : scenes) {
+        double single_thread_ms = 0.0;
+
+        for (int threads : thread_counts) {
+            renderer.set_scene_name(scene_name);
+            renderer.set_thread_count(threads);
+
+            auto setup_start = std::chrono::steady_clock::now();
+            renderer.reset();
+            auto setup_end = std::chrono::steady_clock::now();
+
+            BenchResult result = {};
+            result.scene_name = scene_name;
+            result.threads = threads;
+            result.setup_ms = elapsed_ms(setup_start, setup_end);
+            result.iteration_ms_min = infinity;
+
+            int iterations = 0;
+            for (int iteration = 1; iteration <= samples_per_pixel && !renderer.is_converged(); ++iteration) {
+                renderer.set_current_iteration(iteration);
+                ++iterations;
+                auto start = std::chrono::steady_clock::now();
+                renderer.render();
+                double ms = elapsed_ms(start, std::chrono::steady_clock::now());
+
+                result.total_ms += ms;
+                result.iteration_ms_min = fmin(result.iteration_ms_min, ms);
+                result.iteration_ms_max = fmax(result.iteration_ms_max, ms);
+            }
+
+            double seconds = result.total_ms / 1000.0;
+            result.iteration_ms_mean = result.total_ms / iterations;
+            result.rays = renderer.get_ray_count();
+            result.rays_per_sec = result.rays / seconds;
+            result.samples_per_sec = renderer.get_sample_count() / seconds;
+            if (threads == 1)
+                single_thread_ms = result.total_ms;
+            result.speedup = single_thread_ms > 0.0 ? single_thread_ms / result.total_ms : 1.0;
+            result.utilization = renderer.get_worker_utilization();
+            result.worker_stats = renderer.get_worker_stats();
+            results.push_back(result);
+
+            fprintf(stderr, "%-8s %3d threads: %9.1f ms, %12.0f rays/s\n",
+                scene_name_to_string(scene_name), threads, result.total_ms, result.rays_per_sec);
+        }
+    }
+
+    // Write the results as JSON
+    std::ostringstream json;
+    json.precision(6);
+    json << std::fixed;
+    json << "{\n";
+    json << "  \"config\": {\n";
+    json << "    \"width\": " << width << ",\n";
+    json << "    \"height\": " << height << ",\n";
+    json << "    \"spp\": " << samples_per_pixel << ",\n";
+    json << "    \"max_depth\": " << max_depth << ",\n";
+    json << "    \"rr_depth\": " << russian_roulette_depth << ",\n";
+    json << "    \"seed\": " << seed << ",\n";
+    json << "    \"tile_size\": " << tile_size << ",\n";
+    json << "    \"simd\": \"" << simd_level_name(active_simd_level()) << "\",\n";
+    json << "    \"wavefront\": " << (wavefront ? "true" : "false") << ",\n";
+    json << "    \"sampler\": \"" << sampler_name(sampler) << "\",\n";
+    json << "    \"precision\": \"" << (sizeof(real) == sizeof(float) ? "float" : "double") << "\",\n";
+    json << "    \"hardware_threads\": " << std::thread::hardware_concurrency() << "\n";
+    json << "  },\n";
+    json << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        json << "    {";
+        json << "\"scene\": \"" << scene_name_to_string(r.scene_name) << "\", ";
+        json << "\"threads\": " << r.threads << ", ";
+        json << "\"setup_ms\": " << r.setup_ms << ", ";
+        json << "\"total_ms\": " << r.total_ms << ", ";
+        json << "\"iteration_ms\": {\"mean\": " << r.iteration_ms_mean
+             << ", \"min\": " << r.iteration_ms_min << ", \"max\": " << r.iteration_ms_max << "}, ";
+        json << "\"rays\": " << r.rays << ", ";
+        json << "\"rays_per_sec\": " << r.rays_per_sec << ", ";
+        json << "\"samples_per_sec\": " << r.samples_per_sec << ", ";
+        json << "\"speedup\": " << r.speedup << ", ";
+        json << "\"workers\": [";
+        for (size_t w = 0; w < r.worker_stats.size(); ++w) {
+            json << (w > 0 ? ", " : "") << "{\"utilization\": " << r.utilization[w]
+                 << ", \"tiles\": " << r.worker_stats[w].tasks << ", \"steals\": " << r.worker_stats[w].steals << "}";
+        }
+        json << "]";
+        json << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n";
+    json << "}\n";
+
+    if (output.empty()) {
+        std::cout << json.str();
+    }
+    else {
+        std::ofstream out(output);
+        if (!out) {
+            fprintf(stderr, "Could not open %s for writing\n", output.c_str());
+            return 1;
+        }
+        out << json.str();
+    }
+
+    return 0;
+}
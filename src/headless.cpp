@@ -0,0 +1,312 @@
+// Headless renderer: renders a scene without a window or GL context and writes the result to a file.
+// Usage: GHDcli [--scene name] [--mesh file] [--scene-file file] [--width w] [--height h] [--spp n]
+//               [--depth d] [--rr-depth d] [--threads t] [--tile-size n] [--seed s] [--aperture a]
+//               [--adaptive threshold] [--min-spp n] [--simd level] [--wavefront 0|1] [--material-sort 0|1]
+//               [--tonemap op] [--sampler name] [--light-sampling 0|1]
+//               [--checkpoint file] [--checkpoint-interval s]
+//               [--workers host:port,... [--chunk n]] [--stats file.json] [--trace file.json]
+//               [--output file.ppm]
+//        GHDcli --serve port [--threads t] [--simd level]
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "utils/renderer.h"
+#include "utils/distributed.h"
+
+// Set by SIGINT/SIGTERM: finish the current iteration, write the checkpoint and exit
+static volatile std::sig_atomic_t stop_requested = 0;
+
+static void request_stop(int) {
+    stop_requested = 1;
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --scene <name>     floor, three, three2, three3, fov, random, ghd, lights, mesh, instances (default: random)\n"
+        "  --mesh <file>      OBJ or PLY file shown by the mesh scene instead of its built-in meshes\n"
+        "  --scene-file <file>  text or compiled (GHDscene) scene file rendered instead of --scene, uses its camera\n"
+        "  --width <pixels>   image width (default: 800)\n"
+        "  --height <pixels>  image height (default: 600)\n"
+        "  --spp <n>          samples per pixel (default: 16)\n"
+        "  --depth <n>        max ray depth (default: 8)\n"
+        "  --rr-depth <n>     bounces before Russian roulette starts, -1 to disable (default: 5)\n"
+        "  --threads <n>      render threads, 0 for all hardware threads (default: 0)\n"
+        "  --tile-size <n>    edge length of the square render tiles in pixels (default: 16)\n"
+        "  --seed <n>         random seed (default: 1)\n"
+        "  --aperture <a>     camera aperture (default: 0.1)\n"
+        "  --adaptive <e>     stop sampling tiles once their relative error is below e (default: off)\n"
+        "  --min-spp <n>      samples every pixel gets before adaptive sampling starts (default: 8)\n"
+        "  --simd <level>     scalar, sse2, avx2 or avx512, capped to what the CPU supports (default: up to avx2)\n"
+        "  --wavefront <0|1>  trace tiles one bounce at a time in ray packets (default: 0)\n"
+        "  --material-sort <0|1>  with --wavefront, shade the hits of a bounce in batches of one material type (default: 1)\n"
+        "  --tonemap <op>     gamma2, srgb or aces (default: gamma2)\n"
+        "  --sampler <name>   independent, sobol, halton or bluenoise (default: independent)\n"
+        "  --light-sampling <0|1>  sample emissive spheres directly at diffuse bounces (default: 1)\n"
+        "  --checkpoint <file>  resume from this checkpoint if it exists, and keep it updated\n"
+        "  --checkpoint-interval <s>  seconds between checkpoint writes (default: 60)\n"
+        "  --workers <list>   render on GHDcli --serve workers, comma separated host:port list\n"
+        "  --chunk <n>        iterations handed to a worker at a time (default: 4)\n"
+        "  --serve <port>     run as a worker for a --workers coordinator\n"
+        "  --stats <file>     write per pass counters and stage times as JSON\n"
+        "  --trace <file>     write the spans of every tile as a Chrome trace (chrome://tracing, Perfetto)\n"
+        "  --output <file>    output PPM file (default: render.ppm)\n",
+        program);
+}
+
+int main(int argc, char** argv) {
+    SceneName scene_name = SceneName::RANDOM;
+    std::string mesh_file;
+    std::string scene_file;
+    int width = 800;
+    int height = 600;
+    int samples_per_pixel = 16;
+    int max_depth = 8;
+    int russian_roulette_depth = 5;
+    int thread_count = 0;
+    int tile_size = 16;
+    unsigned long long seed = 1;
+    double aperture = 0.1;
+    bool aperture_given = false;
+    double adaptive_threshold = 0.0;
+    int adaptive_min_samples = 8;
+    bool wavefront = false;
+    bool material_sort = true;
+    tonemapper tonemap = tonemapper::gamma2;
+    sampler_type sampler = sampler_type::independent;
+    bool light_sampling = true;
+    std::string checkpoint;
+    double checkpoint_interval = 60.0;
+    std::string workers;
+    int chunk_size = 4;
+    int serve_port = 0;
+    std::string stats;
+    std::string trace;
+    std::string output = "render.ppm";
+
+    // Parse arguments
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", arg.c_str());
+            print_usage(argv[0]);
+            return 1;
+        }
+        const char* value = argv[++i];
+        if (arg == "--scene") {
+            if (!scene_name_from_string(value, scene_name)) {
+                fprintf(stderr, "Unknown scene: %s\n", value);
+                return 1;
+            }
+        }
+        else if (arg == "--mesh") mesh_file = value;
+        else if (arg == "--scene-file") scene_file = value;
+        else if (arg == "--width") width = atoi(value);
+        else if (arg == "--height") height = atoi(value);
+        else if (arg == "--spp") samples_per_pixel = atoi(value);
+        else if (arg == "--depth") max_depth = atoi(value);
+        else if (arg == "--rr-depth") russian_roulette_depth = atoi(value);
+        else if (arg == "--threads") thread_count = atoi(value);
+        else if (arg == "--tile-size") tile_size = atoi(value);
+        else if (arg == "--simd") {
+            simd_level level;
+            if (!simd_level_from_string(value, level)) {
+                fprintf(stderr, "Unknown SIMD level: %s\n", value);
+                return 1;
+            }
+            set_simd_level(level);
+        }
+        else if (arg == "--seed") seed = strtoull(value, nullptr, 10);
+        else if (arg == "--aperture") {
+            aperture = atof(value);
+            aperture_given = true;
+        }
+        else if (arg == "--adaptive") adaptive_threshold = atof(value);
+        else if (arg == "--min-spp") adaptive_min_samples = atoi(value);
+        else if (arg == "--wavefront") wavefront = atoi(value) != 0;
+        else if (arg == "--material-sort") material_sort = atoi(value) != 0;
+        else if (arg == "--tonemap") {
+            if (!tonemapper_from_string(value, tonemap)) {
+                fprintf(stderr, "Unknown tonemapper: %s\n", value);
+                return 1;
+            }
+        }
+        else if (arg == "--sampler") {
+            if (!sampler_from_string(value, sampler)) {
+                fprintf(stderr, "Unknown sampler: %s\n", value);
+                return 1;
+            }
+        }
+        else if (arg == "--light-sampling") light_sampling = atoi(value) != 0;
+        else if (arg == "--checkpoint") checkpoint = value;
+        else if (arg == "--checkpoint-interval") checkpoint_interval = atof(value);
+        else if (arg == "--workers") workers = value;
+        else if (arg == "--chunk") chunk_size = atoi(value);
+        else if (arg == "--serve") serve_port = atoi(value);
+        else if (arg == "--stats") stats = value;
+        else if (arg == "--trace") trace = value;
+        else if (arg == "--output") output = value;
+        else {
+            fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Worker mode, the job comes from the coordinator
+    if (serve_port > 0)
+        return run_render_server(serve_port, thread_count);
+
+    if (width < 2 || height < 2 || samples_per_pixel < 1 || max_depth < 1) {
+        fprintf(stderr, "Invalid resolution, spp or depth\n");
+        return 1;
+    }
+    if (!workers.empty() && (adaptive_threshold > 0.0 || !checkpoint.empty() || !stats.empty() || !trace.empty() || !mesh_file.empty() || !scene_file.empty())) {
+        fprintf(stderr, "--workers does not support --adaptive, --checkpoint, --stats, --trace, --mesh or --scene-file\n");
+        return 1;
+    }
+
+    Renderer renderer(width, height, samples_per_pixel, max_depth);
+    renderer.set_scene_name(scene_name);
+    if (!renderer.set_mesh_file(mesh_file))
+        return 1;
+    renderer.set_seed(seed);
+    renderer.set_russian_roulette_depth(russian_roulette_depth);
+    renderer.set_thread_count(thread_count);
+    renderer.set_tile_size(tile_size);
+    renderer.set_camera_aperture(aperture);
+    if (!scene_file.empty()) {
+        auto load_start = std::chrono::steady_clock::now();
+        if (!renderer.set_scene_file(scene_file))
+            return 1;
+        auto load_end = std::chrono::steady_clock::now();
+        std::cout << "Loaded " << scene_file << " in "
+                  << std::chrono::duration<double, std::milli>(load_end - load_start).count() << " ms" << std::endl;
+        if (aperture_given)
+            renderer.set_camera_aperture(aperture);
+    }
+    renderer.set_adaptive(adaptive_threshold > 0.0);
+    renderer.set_adaptive_threshold(adaptive_threshold);
+    renderer.set_adaptive_min_samples(adaptive_min_samples);
+    renderer.set_wavefront(wavefront);
+    renderer.set_material_sort(material_sort);
+    renderer.set_tonemapper(tonemap);
+    renderer.set_sampler(sampler);
+    renderer.set_light_sampling(light_sampling);
+    renderer.set_trace(!trace.empty());
+    renderer.reset();
+
+    // Coordinator mode: the workers render, this process merges their samples
+    if (!workers.empty()) {
+        std::vector<std::string> addresses;
+        std::stringstream list(workers);
+        std::string address;
+        while (std::getline(list, address, ','))
+            addresses.push_back(address);
+
+        RenderJob job;
+        job.scene = static_cast<int32_t>(scene_name);
+        job.width = width;
+        job.height = height;
+        job.max_depth = max_depth;
+        job.russian_roulette_depth = russian_roulette_depth;
+        job.tile_size = tile_size;
+        job.wavefront = wavefront ? 1 : 0;
+        job.sampler = static_cast<int32_t>(sampler);
+        job.light_sampling = light_sampling ? 1 : 0;
+        job.seed = seed;
+        job.aperture = aperture;
+
+        RenderCoordinator coordinator(renderer, job, addresses);
+        if (!coordinator.run(samples_per_pixel, chunk_size > 0 ? chunk_size : 1)) {
+            fprintf(stderr, "Every worker failed before the render was finished\n");
+            return 1;
+        }
+
+        std::cout << "Rendered " << scene_name_to_string(scene_name) << " at " << width << "x" << height << ", "
+                  << static_cast<double>(renderer.get_sample_count()) / (width * height) << " spp on " << addresses.size()
+                  << " workers in " << coordinator.get_wall_ms() << " miliseconds, "
+                  << coordinator.get_rays_per_second() << " rays/s" << std::endl;
+        for (const RemoteWorkerStats& stats : coordinator.get_stats()) {
+            std::cout << "  " << stats.address << ": " << stats.chunks << " chunks, " << stats.rays << " rays in "
+                      << stats.busy_ms << " ms" << (stats.failed ? " (failed)" : "") << std::endl;
+        }
+
+        if (!renderer.get_image().write_ppm(output))
+            return 1;
+        std::cout << "Wrote " << output << std::endl;
+        return 0;
+    }
+
+    // Pick up where a previous run of the same job stopped
+    if (!checkpoint.empty()) {
+        if (std::ifstream(checkpoint).good()) {
+            if (!renderer.load_checkpoint(checkpoint))
+                return 1;
+            std::cout << "Resumed from " << checkpoint << " after iteration " << renderer.get_current_iteration() << std::endl;
+        }
+        std::signal(SIGINT, request_stop);
+        std::signal(SIGTERM, request_stop);
+    }
+
+    // Progressive loop, one sample per (unconverged) pixel per iteration
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    for (int iteration = renderer.get_current_iteration() + 1; iteration <= samples_per_pixel && !renderer.is_converged(); ++iteration) {
+        renderer.set_current_iteration(iteration);
+        renderer.render();
+
+        if (checkpoint.empty())
+            continue;
+        auto now = std::chrono::steady_clock::now();
+        if (stop_requested || std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_interval) {
+            if (!renderer.save_checkpoint(checkpoint))
+                return 1;
+            last_checkpoint = now;
+        }
+        if (stop_requested) {
+            std::cout << "Stopped after iteration " << iteration << ", wrote " << checkpoint << std::endl;
+            return 0;
+        }
+    }
+    if (!checkpoint.empty() && !renderer.save_checkpoint(checkpoint))
+        return 1;
+
+    std::cout << "Rendered " << (scene_file.empty() ? std::string(scene_name_to_string(scene_name)) : scene_file)
+              << " at " << width << "x" << height << ", " << static_cast<double>(renderer.get_sample_count()) / (width * height) << " spp on " << renderer.get_thread_count() << " threads in "
+              << renderer.get_render_time() << " miliseconds" << std::endl;
+
+    // Only the passes of this run, a resumed render starts counting at the checkpoint
+    if (!stats.empty()) {
+        std::ofstream out(stats);
+        write_pass_stats_json(out, renderer.get_pass_stats());
+        if (!out) {
+            fprintf(stderr, "Could not write %s\n", stats.c_str());
+            return 1;
+        }
+        std::cout << "Wrote " << stats << std::endl;
+    }
+    if (!trace.empty()) {
+        std::ofstream out(trace);
+        write_chrome_trace(out, renderer.get_trace_events());
+        if (!out) {
+            fprintf(stderr, "Could not write %s\n", trace.c_str());
+            return 1;
+        }
+        std::cout << "Wrote " << trace << std::endl;
+    }
+
+    if (!renderer.get_image().write_ppm(output))
+        return 1;
+    std::cout << "Wrote " << output << std::endl;
+
+    return 0;
+}
@@ -5,7 +5,10 @@
 #include <imgui_impl_glfw.h>
 #include <cstdio>
 #include "utils/renderer.h"
+#include "utils/texture.h"
+#include "utils/render_worker.h"
 #include <thread>
+#include <chrono>
 
 // Forward declaration of callback
 void glfw_error_callback(int error, const char* description);
@@ -53,11 +56,6 @@ int main() {
     ImGui_ImplGlfw_InitForOpenGL(window, true);
     ImGui_ImplOpenGL3_Init("#version 330");
 
-    Renderer renderer(800, 600, 4, 4);
-    renderer.set_scene_name(SceneName::FLOOR_SPHERE);
-
-    // renderer.render();
-
     // Scene Selector
     const char* scene_names[] = {
         "Floor Sphere",
@@ -66,7 +64,10 @@ int main() {
         "Three Spheres 3",
         "FoV",
         "Random",
-        "GHD"
+        "GHD",
+        "Lights",
+        "Mesh",
+        "Instances"
     };
     int scene_selector = 0;
     int gui_width = 800;
@@ -74,6 +75,37 @@ int main() {
     int gui_samples_per_pixel = 4;
     int gui_max_depth = 4;
     float gui_aperture = 0.1;
+    bool gui_adaptive = false;
+    float gui_adaptive_threshold = 0.02f;
+
+    // Render on a background thread, the GUI only picks up finished passes
+    RenderSettings render_settings;
+    render_settings.width = gui_width;
+    render_settings.height = gui_height;
+    render_settings.samples_per_pixel = gui_samples_per_pixel;
+    render_settings.max_depth = gui_max_depth;
+    render_settings.scene_name = static_cast<SceneName>(scene_selector);
+    render_settings.aperture = gui_aperture;
+    render_settings.adaptive = gui_adaptive;
+    render_settings.adaptive_threshold = gui_adaptive_threshold;
+
+    Renderer renderer(gui_width, gui_height, gui_samples_per_pixel, gui_max_depth);
+    RenderWorker render_worker(renderer, render_settings);
+
+    // Texture that displays the renderer's image in the viewport, and the image
+    // version it holds, so only the tiles changed since then are uploaded
+    GHDTexture viewport_texture;
+    uint64_t uploaded_version = 0;
+
+    // Last GUI frame times and texture upload times for the performance panel,
+    // ring buffers written at history_offset
+    const int history_size = 120;
+    float frame_ms_history[history_size] = {};
+    float upload_ms_history[history_size] = {};
+    int history_offset = 0;
+    // Time the upload of the latest frame took
+    float upload_ms = 0.0f;
+
     // Main loop
     while (!glfwWindowShouldClose(window)) {
         // Poll events
@@ -84,27 +116,32 @@ int main() {
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
+        // Pick up the latest finished pass, if there is one
+        float frame_upload_ms = 0.0f;
+        if (render_worker.acquire_frame()) {
+            const RenderFrame& new_frame = render_worker.get_frame();
+            auto upload_start = std::chrono::steady_clock::now();
+            viewport_texture.upload(new_frame.image, new_frame.changed_tiles(uploaded_version));
+            frame_upload_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - upload_start).count();
+            upload_ms = frame_upload_ms;
+            uploaded_version = new_frame.version;
+        }
+        const RenderFrame& frame = render_worker.get_frame();
+        frame_ms_history[history_offset] = io.DeltaTime * 1000.0f;
+        upload_ms_history[history_offset] = frame_upload_ms;
+        history_offset = (history_offset + 1) % history_size;
 
         ImGui::Begin("Settings");
         
         // Render Button
+        bool restart = false;
         if (ImGui::Button("Render")) {
-            // Handle button press (optional)
-            renderer.reset();
-        }
-
-        if(renderer.get_current_iteration() < renderer.get_samples_per_pixel()) {
-            renderer.set_current_iteration(renderer.get_current_iteration() + 1);
-            renderer.render();
-        }
-        else if(renderer.get_current_iteration() == renderer.get_samples_per_pixel()) {
-            std::cout<<"Rendering finished in "<<renderer.get_render_time()<<" miliseconds"<<std::endl;
-            std::cout<<"\n";
-            renderer.set_current_iteration(renderer.get_current_iteration() + 1);
+            restart = true;
         }
 
         // Render time
-        ImGui::Text("Render time: %.0f ms", renderer.get_render_time());
+        ImGui::Text("Render time: %.0f ms", frame.render_time);
+        ImGui::Text("Samples: %d/%d%s", frame.iteration, frame.samples_per_pixel, frame.converged ? " (converged)" : "");
 
         // divider
         ImGui::Separator();
@@ -113,8 +150,6 @@ int main() {
         ImGui::Text("Resolution");
         ImGui::InputInt("Width", &gui_width);
         ImGui::InputInt("Height", &gui_height);
-        renderer.set_image_width(gui_width);
-        renderer.set_image_height(gui_height);
 
         // divider
         ImGui::Separator();
@@ -122,21 +157,21 @@ int main() {
         // samples per pixel input
         ImGui::Text("Samples per Pixel");
         ImGui::InputInt("Samples per Pixel", &gui_samples_per_pixel);
-        renderer.set_samples_per_pixel(gui_samples_per_pixel);
 
         // max depth input
         ImGui::Text("Max Depth");
         ImGui::InputInt("Max Depth", &gui_max_depth);
-        renderer.set_max_depth(gui_max_depth);
+
+        // adaptive sampling
+        ImGui::Checkbox("Adaptive Sampling", &gui_adaptive);
+        ImGui::InputFloat("Error Threshold", &gui_adaptive_threshold);
 
         // divider
         ImGui::Separator();
 
         // scene selector
         ImGui::Text("Select a Scene");
-        if (ImGui::Combo("Scene", &scene_selector, scene_names, IM_ARRAYSIZE(scene_names))) {
-            renderer.set_scene_name(static_cast<SceneName>(scene_selector));
-        }
+        ImGui::Combo("Scene", &scene_selector, scene_names, IM_ARRAYSIZE(scene_names));
 
         // divider
         ImGui::Separator();
@@ -144,14 +179,61 @@ int main() {
         // aperture input
         ImGui::Text("Aperture");
         ImGui::InputFloat("Aperture", &gui_aperture);
-        renderer.set_camera_aperture(gui_aperture);
 
         ImGui::End();
 
+        // Any edit cancels the pass in flight and restarts the render
+        RenderSettings gui_settings;
+        gui_settings.width = gui_width > 1 ? gui_width : 2;
+        gui_settings.height = gui_height > 1 ? gui_height : 2;
+        gui_settings.samples_per_pixel = gui_samples_per_pixel;
+        gui_settings.max_depth = gui_max_depth;
+        gui_settings.scene_name = static_cast<SceneName>(scene_selector);
+        gui_settings.aperture = gui_aperture;
+        gui_settings.adaptive = gui_adaptive;
+        gui_settings.adaptive_threshold = gui_adaptive_threshold;
+        if (restart || gui_settings != render_settings) {
+            render_settings = gui_settings;
+            render_worker.restart(render_settings);
+        }
+
+        // Counters of the last finished pass, and the history of recent passes
+        ImGui::Begin("Performance");
+        ImGui::PlotLines("Frame (ms)", frame_ms_history, history_size, history_offset, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+        ImGui::PlotHistogram("Upload (ms)", upload_ms_history, history_size, history_offset, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+        if (!frame.passes.empty()) {
+            const PassStats& pass = frame.passes.back();
+            const PassCounters& counters = pass.counters;
+            float pass_ms[RenderFrame::max_passes];
+            float pass_rays_per_second[RenderFrame::max_passes];
+            const int pass_count = static_cast<int>(frame.passes.size());
+            for (int p = 0; p < pass_count; ++p) {
+                pass_ms[p] = static_cast<float>(frame.passes[p].wall_ms);
+                pass_rays_per_second[p] = static_cast<float>(frame.passes[p].rays_per_second() / 1e6);
+            }
+            ImGui::PlotHistogram("Pass (ms)", pass_ms, pass_count, 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+            ImGui::PlotLines("Mrays/s", pass_rays_per_second, pass_count, 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+
+            ImGui::Separator();
+            ImGui::Text("Pass %d: %.1f ms, %.2f Mrays/s", pass.iteration, pass.wall_ms, pass.rays_per_second() / 1e6);
+            ImGui::Text("Rays: %llu (%llu shadow)", static_cast<unsigned long long>(counters.rays), static_cast<unsigned long long>(counters.shadow_rays));
+            ImGui::Text("Average path depth: %.2f", counters.average_path_depth());
+            ImGui::Text("BVH nodes per ray: %.1f", counters.nodes_per_ray());
+            ImGui::Text("Primitive tests per ray: %.1f", counters.tests_per_ray());
+
+            // Stage times are summed over the render threads
+            ImGui::Separator();
+            ImGui::Text("Thread time per stage");
+            for (int s = 0; s < render_stage_count; ++s)
+                ImGui::Text("  %-9s %8.1f ms", render_stage_name(static_cast<RenderStage>(s)), counters.stage_ms[s]);
+            ImGui::Text("  %-9s %8.2f ms", "upload", upload_ms);
+        }
+        ImGui::End();
+
         ImGui::Begin("Viewport");
         ImVec2 uv0 = ImVec2(0.0f, 1.0f); // Bottom-left
         ImVec2 uv1 = ImVec2(1.0f, 0.0f); // Top-right (flipped vertically)
-        ImGui::Image(renderer.get_image().get_imgui_texture_id(), ImVec2(renderer.get_width(), renderer.get_height()), uv0, uv1);
+        ImGui::Image(viewport_texture.get_imgui_texture_id(), ImVec2(frame.image.get_width(), frame.image.get_height()), uv0, uv1);
         ImGui::End();
 
         // Render Dear ImGui
@@ -2,15 +2,17 @@
 #define CAMERA_H
 
 #include "../utils/rtweekend.h"
+#include "../utils/sampler.h"
 
-class camera {
+template <typename T>
+class camera_t {
     public:
         // default constructor
-        camera() {}
-        camera(
-            point3 lookfrom,
-            point3 lookat,
-            vec3   vup,
+        camera_t() {}
+        camera_t(
+            vec3_t<T> lookfrom,
+            vec3_t<T> lookat,
+            vec3_t<T> vup,
             double vfov, // vertical field-of-view in degrees
             double aspect_ratio,
             double aperture,
@@ -34,11 +36,11 @@ class camera {
         }
 
 
-        ray get_ray(double s, double t) const {
-            vec3 rd = lens_radius * random_in_unit_disk();
-            vec3 offset = u * rd.x() + v * rd.y();
+        ray_t<T> get_ray(double s, double t) const {
+            vec3_t<T> rd = lens_radius * vec3_t<T>(sample_in_unit_disk());
+            vec3_t<T> offset = u * rd.x() + v * rd.y();
 
-            return ray(
+            return ray_t<T>(
                 origin + offset,
                 lower_left_corner + s*horizontal + t*vertical - origin - offset
             );
@@ -49,11 +51,13 @@ class camera {
         }
 
     private:
-        point3 origin;
-        point3 lower_left_corner;
-        vec3 horizontal;
-        vec3 vertical;
-        vec3 u, v, w;
-        double lens_radius;
+        vec3_t<T> origin;
+        vec3_t<T> lower_left_corner;
+        vec3_t<T> horizontal;
+        vec3_t<T> vertical;
+        vec3_t<T> u, v, w;
+        T lens_radius;
 };
+
+using camera = camera_t<real>;
 #endif
\ No newline at end of file
@@ -0,0 +1,220 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+// Instancing: geometry that is built once (a triangle_mesh, a sphere_soa, a bvh)
+// placed in the world any number of times through an affine transform. The ray is
+// carried into the geometry's own space instead of the geometry into the world, so
+// a copy costs a transform and not a copy of the geometry.
+//
+// instance places one copy and can go into any hittable_list. instance_set is the
+// top level of a two-level hierarchy: a flat array of instances under its own BVH
+// (the TLAS) over shared geometries with their own BVHs (the BLASes). A copy in an
+// instance_set is one matrix and two ids, there is no object per copy.
+
+#include "../utils/rtweekend.h"
+#include "../utils/hittable.h"
+#include "../utils/bvh.h"
+#include "../utils/transform.h"
+
+#include <vector>
+
+// Intersects geometry placed by the inverse of world_to_object. The ray direction is
+// not normalized in object space, so t is the same in both spaces. A non-null
+// mat replaces the geometry's material.
+inline bool hit_transformed(const hittable& geometry, const affine_transform& world_to_object, const material* mat,
+                            const ray& r, real t_min, real t_max, hit_record& rec) {
+    if (!geometry.hit(world_to_object.apply(r), t_min, t_max, rec))
+        return false;
+
+    // The transposed inverse keeps the normal on the side of the ray it was on
+    rec.p = r.at(rec.t);
+    rec.normal = unit_vector(world_to_object.transposed_vector(rec.normal));
+    if (mat)
+        rec.mat_ptr = mat;
+    return true;
+}
+
+class instance : public hittable {
+    public:
+        instance() {}
+        instance(shared_ptr<hittable> geometry, const affine_transform& object_to_world, shared_ptr<material> m = nullptr)
+            : geometry(geometry), world_to_object(object_to_world.inverse()), mat(m) {
+            aabb box;
+            bounded = geometry->bounding_box(box);
+            if (bounded)
+                world_box = object_to_world.apply(box);
+        }
+
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
+            return hit_transformed(*geometry, world_to_object, mat.get(), r, t_min, t_max, rec);
+        }
+
+        virtual bool bounding_box(aabb& output_box) const override {
+            output_box = world_box;
+            return bounded;
+        }
+
+    public:
+        shared_ptr<hittable> geometry;
+        affine_transform world_to_object;
+        // Replaces the geometry's material if set
+        shared_ptr<material> mat;
+
+    private:
+        aabb world_box;
+        bool bounded = false;
+};
+
+class instance_set : public hittable {
+    public:
+        static const int max_leaf_size = 2;
+
+        instance_set() {}
+
+        // Geometry shared by the instances, built and with finite bounds. Returns its id.
+        int add_geometry(shared_ptr<hittable> geometry) {
+            geometries.push_back(geometry);
+            return static_cast<int>(geometries.size() - 1);
+        }
+
+        // Material instances can use instead of the geometry's own. Returns its id.
+        int add_material(shared_ptr<material> m) {
+            materials.push_back(m);
+            return static_cast<int>(materials.size() - 1);
+        }
+
+        // A copy of the geometry, material -1 keeps the geometry's own
+        void add(int geometry, const affine_transform& object_to_world, int material = -1) {
+            instances.push_back({ object_to_world.inverse(), geometry, material });
+            aabb box;
+            geometries[geometry]->bounding_box(box);
+            boxes.push_back(object_to_world.apply(box));
+        }
+
+        // Builds the BVH over the instances and reorders them to leaf order. Call after
+        // the last add().
+        void build();
+
+        size_t size() const { return instances.size(); }
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+        // Walks the top level once for the whole packet. A leaf hands the rays that
+        // reached it, carried into the instance's space, to the geometry as a packet.
+        virtual void hit_packet(const ray* rays, int count, real t_min, const real* t_max,
+                                hit_record* recs, bool* hits) const override;
+
+        virtual bool bounding_box(aabb& output_box) const override;
+
+    public:
+        struct instance_record {
+            affine_transform world_to_object;
+            int geometry;
+            int material;
+        };
+
+        std::vector<shared_ptr<hittable>> geometries;
+        std::vector<shared_ptr<material>> materials;
+        std::vector<instance_record> instances;
+        bvh_tree tree;
+
+    private:
+        // Instance bounds until build()
+        std::vector<aabb> boxes;
+        std::vector<const hittable*> geometry_table;
+        std::vector<const material*> material_table;
+
+        const material* instance_material(const instance_record& record) const {
+            return record.material >= 0 ? material_table[record.material] : nullptr;
+        }
+};
+
+void instance_set::build() {
+    tree.build(boxes, max_leaf_size);
+
+    std::vector<instance_record> ordered;
+    ordered.reserve(instances.size());
+    for (int index : tree.prim_indices)
+        ordered.push_back(instances[index]);
+    instances.swap(ordered);
+    std::vector<aabb>().swap(boxes);
+
+    geometry_table.clear();
+    for (const auto& geometry : geometries)
+        geometry_table.push_back(geometry.get());
+    material_table.clear();
+    for (const auto& m : materials)
+        material_table.push_back(m.get());
+}
+
+bool instance_set::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    real closest_so_far = t_max;
+
+    return tree.traverse(r, t_min, closest_so_far,
+        [&](int first, int leaf_count, real leaf_t_min, real& closest) {
+            bool hit_leaf = false;
+            for (int i = first; i < first + leaf_count; i++) {
+                const instance_record& record = instances[i];
+                if (hit_transformed(*geometry_table[record.geometry], record.world_to_object, instance_material(record),
+                                    r, leaf_t_min, closest, rec)) {
+                    hit_leaf = true;
+                    closest = rec.t;
+                }
+            }
+            return hit_leaf;
+        }
+    );
+}
+
+void instance_set::hit_packet(const ray* rays, int count, real t_min, const real* t_max,
+                              hit_record* recs, bool* hits) const {
+    real closest_so_far[ray_packet_size];
+    for (int k = 0; k < count; k++) {
+        hits[k] = false;
+        closest_so_far[k] = t_max[k];
+    }
+
+    tree.traverse_packet(rays, count, t_min, closest_so_far,
+        [&](int first, int leaf_count, unsigned mask, real leaf_t_min, real* closest) {
+            for (int i = first; i < first + leaf_count; i++) {
+                const instance_record& record = instances[i];
+                ray sub_rays[ray_packet_size];
+                real sub_t_max[ray_packet_size];
+                hit_record sub_recs[ray_packet_size];
+                bool sub_hits[ray_packet_size];
+                int sub_index[ray_packet_size];
+                int sub_count = 0;
+                for (int k = 0; k < count; k++) {
+                    if (mask & (1u << k)) {
+                        sub_rays[sub_count] = record.world_to_object.apply(rays[k]);
+                        sub_t_max[sub_count] = closest[k];
+                        sub_index[sub_count++] = k;
+                    }
+                }
+
+                geometry_table[record.geometry]->hit_packet(sub_rays, sub_count, leaf_t_min, sub_t_max, sub_recs, sub_hits);
+                for (int j = 0; j < sub_count; j++) {
+                    if (!sub_hits[j]) continue;
+                    const int k = sub_index[j];
+                    hit_record& rec = recs[k];
+                    rec = sub_recs[j];
+                    rec.p = rays[k].at(rec.t);
+                    rec.normal = unit_vector(record.world_to_object.transposed_vector(rec.normal));
+                    if (record.material >= 0)
+                        rec.mat_ptr = material_table[record.material];
+                    hits[k] = true;
+                    closest[k] = rec.t;
+                }
+            }
+        }
+    );
+}
+
+bool instance_set::bounding_box(aabb& output_box) const {
+    if (tree.empty()) return false;
+    output_box = tree.bounds();
+    return true;
+}
+
+#endif
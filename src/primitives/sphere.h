@@ -7,20 +7,22 @@
 class sphere : public hittable {
     public:
         sphere() {}
-        sphere(point3 cen, double r, shared_ptr<material> m)
+        sphere(point3 cen, real r, shared_ptr<material> m)
             : center(cen), radius(r), mat_ptr(m) {};
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+        virtual bool bounding_box(aabb& output_box) const override;
 
     public:
         point3 center;
-        double radius;
+        real radius;
         shared_ptr<material> mat_ptr;
 
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -43,8 +45,15 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     rec.normal = (rec.p - center) / radius;
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
+
+    return true;
+}
 
+bool sphere::bounding_box(aabb& output_box) const {
+    // fabs because negative radii are used for hollow glass spheres
+    vec3 extent(fabs(radius), fabs(radius), fabs(radius));
+    output_box = aabb(center - extent, center + extent);
     return true;
 }
 
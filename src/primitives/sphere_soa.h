@@ -0,0 +1,477 @@
+#ifndef SPHERE_SOA_H
+#define SPHERE_SOA_H
+
+// A set of spheres stored as a structure of arrays (centers, radii and material
+// ids in contiguous arrays) under its own BVH. The spheres of a BVH leaf are
+// intersected with one ray at once using SSE2 (2 lanes), AVX2 (4 lanes) or
+// AVX-512 (8 lanes), as picked by active_simd_level(). The arrays and kernels are
+// double whatever real is: in float the quadratic of a large sphere (the r = 1000
+// floor of most scenes) cancels down to noise.
+
+#include "../utils/rtweekend.h"
+#include "../utils/hittable.h"
+#include "../utils/hittable_list.h"
+#include "../utils/bvh.h"
+#include "../utils/simd.h"
+#include "sphere.h"
+
+#include <unordered_map>
+#include <vector>
+
+// Read-only view of the sphere arrays handed to the intersection kernels
+struct sphere_arrays {
+    const double* cx;
+    const double* cy;
+    const double* cz;
+    const double* radius;
+};
+
+// Intersects the ray with spheres [first, first + count). Returns the index of the
+// closest sphere hit with t in [t_min, closest] and lowers closest, or -1.
+typedef int (*sphere_batch_kernel)(const sphere_arrays& s, int first, int count, const ray& r, double t_min, double& closest);
+
+GHD_NO_CONTRACT_BEGIN
+
+// Same arithmetic, in the same order, as sphere::hit
+inline int intersect_spheres_scalar(const sphere_arrays& s, int first, int count, const ray& r, double t_min, double& closest) {
+    const vec3_t<double> o(r.origin());
+    const vec3_t<double> d(r.direction());
+    const double a = d.length_squared();
+    int best = -1;
+
+    for (int i = first; i < first + count; i++) {
+        vec3_t<double> oc = o - vec3_t<double>(s.cx[i], s.cy[i], s.cz[i]);
+        auto half_b = dot(oc, d);
+        auto c = oc.length_squared() - s.radius[i] * s.radius[i];
+
+        auto discriminant = half_b * half_b - a * c;
+        if (discriminant < 0) continue;
+        auto sqrtd = sqrt(discriminant);
+
+        auto root = (-half_b - sqrtd) / a;
+        if (root < t_min || closest < root) {
+            root = (-half_b + sqrtd) / a;
+            if (root < t_min || closest < root)
+                continue;
+        }
+
+        closest = root;
+        best = i;
+    }
+
+    return best;
+}
+
+#if defined(GHD_X86)
+
+GHD_TARGET("sse2")
+inline int intersect_spheres_sse2(const sphere_arrays& s, int first, int count, const ray& r, double t_min, double& closest) {
+    const vec3_t<double> o(r.origin());
+    const vec3_t<double> d(r.direction());
+    const __m128d ox = _mm_set1_pd(o.x()), oy = _mm_set1_pd(o.y()), oz = _mm_set1_pd(o.z());
+    const __m128d dx = _mm_set1_pd(d.x()), dy = _mm_set1_pd(d.y()), dz = _mm_set1_pd(d.z());
+    const __m128d a = _mm_set1_pd(d.length_squared());
+    const __m128d tmin = _mm_set1_pd(t_min);
+    const __m128d inf = _mm_set1_pd(infinity);
+    const __m128d sign = _mm_set1_pd(-0.0);
+    const __m128d lane_offsets = _mm_set_pd(1.0, 0.0);
+    const int end = first + count;
+    const __m128d end_v = _mm_set1_pd(static_cast<double>(end));
+    int best = -1;
+
+    for (int i = first; i < end; i += 2) {
+        __m128d valid = _mm_cmplt_pd(_mm_add_pd(_mm_set1_pd(static_cast<double>(i)), lane_offsets), end_v);
+        __m128d ocx = _mm_sub_pd(ox, _mm_loadu_pd(s.cx + i));
+        __m128d ocy = _mm_sub_pd(oy, _mm_loadu_pd(s.cy + i));
+        __m128d ocz = _mm_sub_pd(oz, _mm_loadu_pd(s.cz + i));
+        __m128d rad = _mm_loadu_pd(s.radius + i);
+
+        __m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz));
+        __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)), _mm_mul_pd(rad, rad));
+        __m128d disc = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(a, c));
+        __m128d hit = _mm_and_pd(valid, _mm_cmpge_pd(disc, _mm_setzero_pd()));
+        __m128d sqrtd = _mm_sqrt_pd(_mm_max_pd(disc, _mm_setzero_pd()));
+
+        __m128d neg_b = _mm_xor_pd(half_b, sign);
+        __m128d t0 = _mm_div_pd(_mm_sub_pd(neg_b, sqrtd), a);
+        __m128d t1 = _mm_div_pd(_mm_add_pd(neg_b, sqrtd), a);
+        __m128d closest_v = _mm_set1_pd(closest);
+        __m128d in0 = _mm_and_pd(_mm_cmpge_pd(t0, tmin), _mm_cmple_pd(t0, closest_v));
+        __m128d in1 = _mm_and_pd(_mm_cmpge_pd(t1, tmin), _mm_cmple_pd(t1, closest_v));
+        hit = _mm_and_pd(hit, _mm_or_pd(in0, in1));
+
+        __m128d t = _mm_or_pd(_mm_and_pd(in0, t0), _mm_andnot_pd(in0, t1));
+        t = _mm_or_pd(_mm_and_pd(hit, t), _mm_andnot_pd(hit, inf));
+
+        int hit_mask = _mm_movemask_pd(hit);
+        if (hit_mask == 0) continue;
+
+        __m128d m = _mm_min_pd(t, _mm_shuffle_pd(t, t, 1));
+        int lane_mask = _mm_movemask_pd(_mm_and_pd(hit, _mm_cmpeq_pd(t, m)));
+        closest = _mm_cvtsd_f64(m);
+        best = i + (lane_mask & 1 ? 0 : 1);
+    }
+
+    return best;
+}
+
+GHD_TARGET("avx2")
+inline int intersect_spheres_avx2(const sphere_arrays& s, int first, int count, const ray& r, double t_min, double& closest) {
+    const vec3_t<double> o(r.origin());
+    const vec3_t<double> d(r.direction());
+    const __m256d ox = _mm256_set1_pd(o.x()), oy = _mm256_set1_pd(o.y()), oz = _mm256_set1_pd(o.z());
+    const __m256d dx = _mm256_set1_pd(d.x()), dy = _mm256_set1_pd(d.y()), dz = _mm256_set1_pd(d.z());
+    const __m256d a = _mm256_set1_pd(d.length_squared());
+    const __m256d tmin = _mm256_set1_pd(t_min);
+    const __m256d inf = _mm256_set1_pd(infinity);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d lane_offsets = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+    const int end = first + count;
+    const __m256d end_v = _mm256_set1_pd(static_cast<double>(end));
+    int best = -1;
+
+    for (int i = first; i < end; i += 4) {
+        __m256d valid = _mm256_cmp_pd(_mm256_add_pd(_mm256_set1_pd(static_cast<double>(i)), lane_offsets), end_v, _CMP_LT_OQ);
+        __m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(s.cx + i));
+        __m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(s.cy + i));
+        __m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(s.cz + i));
+        __m256d rad = _mm256_loadu_pd(s.radius + i);
+
+        __m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+        __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)), _mm256_mul_pd(rad, rad));
+        __m256d disc = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+        __m256d hit = _mm256_and_pd(valid, _mm256_cmp_pd(disc, zero, _CMP_GE_OQ));
+        __m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(disc, zero));
+
+        __m256d neg_b = _mm256_xor_pd(half_b, sign);
+        __m256d t0 = _mm256_div_pd(_mm256_sub_pd(neg_b, sqrtd), a);
+        __m256d t1 = _mm256_div_pd(_mm256_add_pd(neg_b, sqrtd), a);
+        __m256d closest_v = _mm256_set1_pd(closest);
+        __m256d in0 = _mm256_and_pd(_mm256_cmp_pd(t0, tmin, _CMP_GE_OQ), _mm256_cmp_pd(t0, closest_v, _CMP_LE_OQ));
+        __m256d in1 = _mm256_and_pd(_mm256_cmp_pd(t1, tmin, _CMP_GE_OQ), _mm256_cmp_pd(t1, closest_v, _CMP_LE_OQ));
+        hit = _mm256_and_pd(hit, _mm256_or_pd(in0, in1));
+
+        __m256d t = _mm256_blendv_pd(t1, t0, in0);
+        t = _mm256_blendv_pd(inf, t, hit);
+
+        if (_mm256_movemask_pd(hit) == 0) continue;
+
+        // Horizontal minimum and the first lane holding it
+        __m256d m = _mm256_min_pd(t, _mm256_permute2f128_pd(t, t, 1));
+        m = _mm256_min_pd(m, _mm256_shuffle_pd(m, m, 5));
+        int lane_mask = _mm256_movemask_pd(_mm256_and_pd(hit, _mm256_cmp_pd(t, m, _CMP_EQ_OQ)));
+        int lane = 0;
+        while (!(lane_mask & (1 << lane))) lane++;
+        closest = _mm256_cvtsd_f64(m);
+        best = i + lane;
+    }
+
+    return best;
+}
+
+GHD_TARGET("avx512f")
+inline int intersect_spheres_avx512(const sphere_arrays& s, int first, int count, const ray& r, double t_min, double& closest) {
+    const vec3_t<double> o(r.origin());
+    const vec3_t<double> d(r.direction());
+    const __m512d ox = _mm512_set1_pd(o.x()), oy = _mm512_set1_pd(o.y()), oz = _mm512_set1_pd(o.z());
+    const __m512d dx = _mm512_set1_pd(d.x()), dy = _mm512_set1_pd(d.y()), dz = _mm512_set1_pd(d.z());
+    const __m512d a = _mm512_set1_pd(d.length_squared());
+    const __m512d tmin = _mm512_set1_pd(t_min);
+    const __m512d inf = _mm512_set1_pd(infinity);
+    const __m512d zero = _mm512_setzero_pd();
+    const int end = first + count;
+    int best = -1;
+
+    for (int i = first; i < end; i += 8) {
+        int remaining = end - i;
+        __mmask8 valid = static_cast<__mmask8>(remaining >= 8 ? 0xff : (1u << remaining) - 1u);
+        __m512d ocx = _mm512_sub_pd(ox, _mm512_loadu_pd(s.cx + i));
+        __m512d ocy = _mm512_sub_pd(oy, _mm512_loadu_pd(s.cy + i));
+        __m512d ocz = _mm512_sub_pd(oz, _mm512_loadu_pd(s.cz + i));
+        __m512d rad = _mm512_loadu_pd(s.radius + i);
+
+        __m512d half_b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, dx), _mm512_mul_pd(ocy, dy)), _mm512_mul_pd(ocz, dz));
+        __m512d c = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, ocx), _mm512_mul_pd(ocy, ocy)), _mm512_mul_pd(ocz, ocz)), _mm512_mul_pd(rad, rad));
+        __m512d disc = _mm512_sub_pd(_mm512_mul_pd(half_b, half_b), _mm512_mul_pd(a, c));
+        __mmask8 hit = _mm512_mask_cmp_pd_mask(valid, disc, zero, _CMP_GE_OQ);
+        if (hit == 0) continue;
+        __m512d sqrtd = _mm512_sqrt_pd(_mm512_max_pd(disc, zero));
+
+        __m512d neg_b = _mm512_sub_pd(zero, half_b);
+        __m512d t0 = _mm512_div_pd(_mm512_sub_pd(neg_b, sqrtd), a);
+        __m512d t1 = _mm512_div_pd(_mm512_add_pd(neg_b, sqrtd), a);
+        __m512d closest_v = _mm512_set1_pd(closest);
+        __mmask8 in0 = _mm512_cmp_pd_mask(t0, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(t0, closest_v, _CMP_LE_OQ);
+        __mmask8 in1 = _mm512_cmp_pd_mask(t1, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(t1, closest_v, _CMP_LE_OQ);
+        hit = hit & (in0 | in1);
+        if (hit == 0) continue;
+
+        __m512d t = _mm512_mask_blend_pd(in0, t1, t0);
+        t = _mm512_mask_blend_pd(hit, inf, t);
+
+        // Horizontal minimum and the first lane holding it
+        double m = _mm512_reduce_min_pd(t);
+        __mmask8 lane_mask = hit & _mm512_cmp_pd_mask(t, _mm512_set1_pd(m), _CMP_EQ_OQ);
+        int lane = 0;
+        while (!(lane_mask & (1u << lane))) lane++;
+        closest = m;
+        best = i + lane;
+    }
+
+    return best;
+}
+
+#endif
+
+GHD_NO_CONTRACT_END
+
+inline sphere_batch_kernel select_sphere_kernel(simd_level level) {
+#if defined(GHD_X86)
+    switch (level) {
+    case simd_level::avx512: return intersect_spheres_avx512;
+    case simd_level::avx2: return intersect_spheres_avx2;
+    case simd_level::sse2: return intersect_spheres_sse2;
+    default: break;
+    }
+#endif
+    return intersect_spheres_scalar;
+}
+
+class sphere_soa : public hittable {
+    public:
+        // Kernels load whole vectors, so the arrays are padded past the last sphere
+        static const int padding = 8;
+        static const int max_leaf_size = 8;
+
+        sphere_soa() {}
+
+        void add(const point3& center, double radius, shared_ptr<material> m);
+
+        // Builds the BVH and reorders the arrays to leaf order. Call after the last add().
+        void build();
+
+        // Uses spheres and a BVH stored elsewhere, e.g. in a mapped scene file, instead
+        // of add() and build(). The arrays must be in leaf order and padded, material_ids
+        // index materials. storage keeps the memory alive as long as the spheres.
+        void attach(const sphere_arrays& arrays, const int* material_ids, size_t count,
+                    const bvh_node* nodes, size_t node_count,
+                    const std::vector<shared_ptr<material>>& materials, shared_ptr<const void> storage);
+
+        size_t size() const { return count; }
+
+        // The arrays in use, owned or attached. Valid after build() or attach().
+        sphere_arrays arrays() const {
+            if (storage) return external;
+            return { cx.data(), cy.data(), cz.data(), radius.data() };
+        }
+        const material* sphere_material(size_t index) const { return material_table[id_data()[index]]; }
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+        // Walks the tree once for the whole packet, leaves run the batch kernel per ray
+        virtual void hit_packet(const ray* rays, int count, real t_min, const real* t_max,
+                                hit_record* recs, bool* hits) const override;
+
+        virtual bool bounding_box(aabb& output_box) const override;
+
+    public:
+        std::vector<double> cx, cy, cz, radius;
+        std::vector<int> material_ids;
+        // Owning material table, material_ids index into it
+        std::vector<shared_ptr<material>> materials;
+        bvh_tree tree;
+
+    private:
+        size_t count = 0;
+        std::vector<const material*> material_table;
+        // Set by attach()
+        sphere_arrays external = {};
+        const int* external_ids = nullptr;
+        shared_ptr<const void> storage;
+        std::unordered_map<const material*, int> material_lookup;
+        sphere_batch_kernel kernel = intersect_spheres_scalar;
+
+        const int* id_data() const { return storage ? external_ids : material_ids.data(); }
+
+        void fill_record(int index, const ray& r, real t, hit_record& rec) const;
+};
+
+void sphere_soa::add(const point3& center, double r, shared_ptr<material> m) {
+    auto found = material_lookup.find(m.get());
+    int id;
+    if (found == material_lookup.end()) {
+        id = static_cast<int>(materials.size());
+        materials.push_back(m);
+        material_lookup[m.get()] = id;
+    }
+    else {
+        id = found->second;
+    }
+
+    cx.push_back(center.x());
+    cy.push_back(center.y());
+    cz.push_back(center.z());
+    radius.push_back(r);
+    material_ids.push_back(id);
+    count++;
+}
+
+void sphere_soa::build() {
+    cx.resize(count);
+    cy.resize(count);
+    cz.resize(count);
+    radius.resize(count);
+    material_ids.resize(count);
+
+    std::vector<aabb> boxes(count);
+    for (size_t i = 0; i < count; i++) {
+        double r = fabs(radius[i]);
+        boxes[i] = aabb(point3(cx[i] - r, cy[i] - r, cz[i] - r), point3(cx[i] + r, cy[i] + r, cz[i] + r));
+    }
+
+    // A leaf costs about as much as a single scalar sphere test, so prefer big leaves
+    tree.build(boxes, max_leaf_size, 0.25);
+
+    auto reorder = [this](std::vector<double>& values) {
+        std::vector<double> ordered(count + padding, 0.0);
+        for (size_t i = 0; i < count; i++)
+            ordered[i] = values[tree.prim_indices[i]];
+        values.swap(ordered);
+    };
+    reorder(cx);
+    reorder(cy);
+    reorder(cz);
+    reorder(radius);
+
+    std::vector<int> ordered_ids(count + padding, 0);
+    for (size_t i = 0; i < count; i++)
+        ordered_ids[i] = material_ids[tree.prim_indices[i]];
+    material_ids.swap(ordered_ids);
+
+    material_table.clear();
+    for (const auto& m : materials)
+        material_table.push_back(m.get());
+
+    kernel = select_sphere_kernel(active_simd_level());
+}
+
+void sphere_soa::attach(const sphere_arrays& arrays, const int* material_ids, size_t count,
+                        const bvh_node* nodes, size_t node_count,
+                        const std::vector<shared_ptr<material>>& materials, shared_ptr<const void> storage) {
+    cx.clear();
+    cy.clear();
+    cz.clear();
+    radius.clear();
+    this->material_ids.clear();
+    material_lookup.clear();
+
+    external = arrays;
+    external_ids = material_ids;
+    this->count = count;
+    this->storage = storage;
+    tree.attach(nodes, node_count);
+
+    this->materials = materials;
+    material_table.clear();
+    for (const auto& m : materials)
+        material_table.push_back(m.get());
+
+    kernel = select_sphere_kernel(active_simd_level());
+}
+
+bool sphere_soa::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    const sphere_arrays arrays = this->arrays();
+    const sphere_batch_kernel intersect = kernel;
+    int best = -1;
+    real closest_so_far = t_max;
+
+    tree.traverse(r, t_min, closest_so_far,
+        [&](int first, int leaf_count, real leaf_t_min, real& closest) {
+            double t = closest;
+            int index = intersect(arrays, first, leaf_count, r, leaf_t_min, t);
+            if (index < 0) return false;
+            best = index;
+            closest = static_cast<real>(t);
+            return true;
+        }
+    );
+
+    if (best < 0) return false;
+
+    fill_record(best, r, closest_so_far, rec);
+    return true;
+}
+
+void sphere_soa::hit_packet(const ray* rays, int count, real t_min, const real* t_max,
+                            hit_record* recs, bool* hits) const {
+    const sphere_arrays arrays = this->arrays();
+    const sphere_batch_kernel intersect = kernel;
+    int best[ray_packet_size];
+    real closest_so_far[ray_packet_size];
+    for (int k = 0; k < count; k++) {
+        best[k] = -1;
+        closest_so_far[k] = t_max[k];
+    }
+
+    tree.traverse_packet(rays, count, t_min, closest_so_far,
+        [&](int first, int leaf_count, unsigned mask, real leaf_t_min, real* closest) {
+            for (int k = 0; k < count; k++) {
+                if (!(mask & (1u << k))) continue;
+                double t = closest[k];
+                int index = intersect(arrays, first, leaf_count, rays[k], leaf_t_min, t);
+                if (index >= 0) {
+                    best[k] = index;
+                    closest[k] = static_cast<real>(t);
+                }
+            }
+        }
+    );
+
+    for (int k = 0; k < count; k++) {
+        hits[k] = best[k] >= 0;
+        if (hits[k])
+            fill_record(best[k], rays[k], closest_so_far[k], recs[k]);
+    }
+}
+
+void sphere_soa::fill_record(int index, const ray& r, real t, hit_record& rec) const {
+    const sphere_arrays s = arrays();
+    point3 center(s.cx[index], s.cy[index], s.cz[index]);
+    rec.t = t;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / s.radius[index];
+    rec.normal = outward_normal;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = sphere_material(index);
+}
+
+bool sphere_soa::bounding_box(aabb& output_box) const {
+    if (tree.empty()) return false;
+    output_box = tree.bounds();
+    return true;
+}
+
+// Moves every sphere of the list into a single sphere_soa. Other objects are
+// passed through unchanged, so the result can go straight into a bvh.
+hittable_list pack_spheres(const hittable_list& world) {
+    hittable_list packed;
+    auto spheres = make_shared<sphere_soa>();
+
+    for (const auto& object : world.objects) {
+        const sphere* s = dynamic_cast<const sphere*>(object.get());
+        if (s)
+            spheres->add(s->center, s->radius, s->mat_ptr);
+        else
+            packed.add(object);
+    }
+
+    if (spheres->size() > 0) {
+        spheres->build();
+        packed.add(spheres);
+    }
+    return packed;
+}
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+// An indexed triangle mesh under its own BVH. Vertices are stored once and shared
+// by the triangles through an index buffer, there is no object per triangle.
+// Triangles are intersected with the watertight test of Woop, Benthin and Wald
+// (2013): rays through a shared edge or vertex hit one of its triangles, never
+// slip between them. In float the edge functions fall back to double when they
+// come out 0, as the paper prescribes, so the test stays watertight.
+
+#include "../utils/rtweekend.h"
+#include "../utils/hittable.h"
+#include "../utils/bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+// Per ray part of the watertight test: the ray is sheared so it runs along +z
+struct triangle_ray {
+    point3 orig;
+    int kx, ky, kz;
+    real sx, sy, sz;
+
+    triangle_ray() {}
+    explicit triangle_ray(const ray& r) : orig(r.origin()) {
+        const vec3 d = r.direction();
+        kz = 0;
+        if (fabs(d.y()) > fabs(d[kz])) kz = 1;
+        if (fabs(d.z()) > fabs(d[kz])) kz = 2;
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        // Keep the winding of the triangles
+        if (d[kz] < 0)
+            std::swap(kx, ky);
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1 / d[kz];
+    }
+};
+
+// Returns true if the ray hits the triangle with t in (t_min, closest). On a hit
+// closest is lowered to t and b0, b1 are the barycentric weights of v0 and v1.
+inline bool intersect_triangle(const triangle_ray& r, const point3& v0, const point3& v1, const point3& v2,
+                               real t_min, real& closest, real& b0, real& b1) {
+    const vec3 a = v0 - r.orig;
+    const vec3 b = v1 - r.orig;
+    const vec3 c = v2 - r.orig;
+    const real ax = a[r.kx] - r.sx * a[r.kz];
+    const real ay = a[r.ky] - r.sy * a[r.kz];
+    const real bx = b[r.kx] - r.sx * b[r.kz];
+    const real by = b[r.ky] - r.sy * b[r.kz];
+    const real cx = c[r.kx] - r.sx * c[r.kz];
+    const real cy = c[r.ky] - r.sy * c[r.kz];
+
+    // Scaled barycentrics, all of one sign inside the triangle. An edge through the
+    // ray gives exactly 0 on both triangles that share it.
+    real u = cx * by - cy * bx;
+    real v = ax * cy - ay * cx;
+    real w = bx * ay - by * ax;
+    if (sizeof(real) < sizeof(double) && (u == 0 || v == 0 || w == 0)) {
+        // The float products are exact in double, so the edge test is decided exactly
+        u = static_cast<real>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+        v = static_cast<real>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+        w = static_cast<real>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+    }
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        return false;
+    const real det = u + v + w;
+    if (det == 0)
+        return false;
+
+    const real t = (u * r.sz * a[r.kz] + v * r.sz * b[r.kz] + w * r.sz * c[r.kz]) / det;
+    if (!(t > t_min && t < closest))
+        return false;
+
+    closest = t;
+    b0 = u / det;
+    b1 = v / det;
+    return true;
+}
+
+class triangle_mesh : public hittable {
+    public:
+        static const int max_leaf_size = 4;
+
+        triangle_mesh() {}
+
+        // Vertices and, optionally, one normal per vertex for smooth shading
+        uint32_t add_vertex(const point3& p) {
+            vertices.push_back(p);
+            return static_cast<uint32_t>(vertices.size() - 1);
+        }
+        uint32_t add_vertex(const point3& p, const vec3& n) {
+            normals.push_back(n);
+            return add_vertex(p);
+        }
+        // Counter-clockwise seen from the outside
+        void add_triangle(uint32_t i0, uint32_t i1, uint32_t i2) {
+            indices.push_back(i0);
+            indices.push_back(i1);
+            indices.push_back(i2);
+        }
+
+        void set_material(shared_ptr<material> m) { mat = m; }
+
+        // Builds the BVH and reorders the triangles to leaf order. Normals are only
+        // used if every vertex has one. Call after the last add_triangle().
+        void build();
+
+        size_t vertex_count() const { return vertices.size(); }
+        size_t triangle_count() const { return indices.size() / 3; }
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+        virtual void hit_packet(const ray* rays, int count, real t_min, const real* t_max,
+                                hit_record* recs, bool* hits) const override;
+
+        virtual bool bounding_box(aabb& output_box) const override;
+
+    public:
+        std::vector<point3> vertices;
+        std::vector<vec3> normals;
+        // Three vertex indices per triangle, in BVH leaf order after build()
+        std::vector<uint32_t> indices;
+        shared_ptr<material> mat;
+        bvh_tree tree;
+
+    private:
+        // Tests the triangles [first, first + count) and remembers the closest one hit
+        bool intersect_leaf(const triangle_ray& r, int first, int count, real t_min, real& closest,
+                            int& best, real& b0, real& b1) const {
+            bool hit_leaf = false;
+            for (int i = first; i < first + count; i++) {
+                const uint32_t* tri = &indices[3 * i];
+                if (intersect_triangle(r, vertices[tri[0]], vertices[tri[1]], vertices[tri[2]], t_min, closest, b0, b1)) {
+                    best = i;
+                    hit_leaf = true;
+                }
+            }
+            return hit_leaf;
+        }
+
+        void fill_record(int triangle, real b0, real b1, const ray& r, real t, hit_record& rec) const;
+};
+
+void triangle_mesh::build() {
+    if (normals.size() != vertices.size())
+        normals.clear();
+
+    const size_t count = triangle_count();
+    std::vector<aabb> boxes(count);
+    for (size_t i = 0; i < count; i++) {
+        aabb box;
+        for (int k = 0; k < 3; k++)
+            box.expand(vertices[indices[3 * i + k]]);
+        boxes[i] = box;
+    }
+
+    tree.build(boxes, max_leaf_size);
+
+    std::vector<uint32_t> ordered(indices.size());
+    for (size_t i = 0; i < count; i++) {
+        const size_t source = static_cast<size_t>(tree.prim_indices[i]);
+        for (int k = 0; k < 3; k++)
+            ordered[3 * i + k] = indices[3 * source + k];
+    }
+    indices.swap(ordered);
+}
+
+bool triangle_mesh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    const triangle_ray tr(r);
+    int best = -1;
+    real b0 = 0, b1 = 0;
+    real closest_so_far = t_max;
+
+    tree.traverse(r, t_min, closest_so_far,
+        [&](int first, int leaf_count, real leaf_t_min, real& closest) {
+            return intersect_leaf(tr, first, leaf_count, leaf_t_min, closest, best, b0, b1);
+        }
+    );
+
+    if (best < 0) return false;
+
+    fill_record(best, b0, b1, r, closest_so_far, rec);
+    return true;
+}
+
+void triangle_mesh::hit_packet(const ray* rays, int count, real t_min, const real* t_max,
+                               hit_record* recs, bool* hits) const {
+    triangle_ray trs[ray_packet_size];
+    int best[ray_packet_size];
+    real b0[ray_packet_size], b1[ray_packet_size];
+    real closest_so_far[ray_packet_size];
+    for (int k = 0; k < count; k++) {
+        trs[k] = triangle_ray(rays[k]);
+        best[k] = -1;
+        closest_so_far[k] = t_max[k];
+    }
+
+    tree.traverse_packet(rays, count, t_min, closest_so_far,
+        [&](int first, int leaf_count, unsigned mask, real leaf_t_min, real* closest) {
+            for (int k = 0; k < count; k++) {
+                if (mask & (1u << k))
+                    intersect_leaf(trs[k], first, leaf_count, leaf_t_min, closest[k], best[k], b0[k], b1[k]);
+            }
+        }
+    );
+
+    for (int k = 0; k < count; k++) {
+        hits[k] = best[k] >= 0;
+        if (hits[k])
+            fill_record(best[k], b0[k], b1[k], rays[k], closest_so_far[k], recs[k]);
+    }
+}
+
+void triangle_mesh::fill_record(int triangle, real b0, real b1, const ray& r, real t, hit_record& rec) const {
+    const uint32_t* tri = &indices[3 * triangle];
+    const point3& v0 = vertices[tri[0]];
+    const vec3 outward_normal = unit_vector(cross(vertices[tri[1]] - v0, vertices[tri[2]] - v0));
+
+    rec.t = t;
+    rec.p = r.at(t);
+    rec.set_face_normal(r, outward_normal);
+    if (!normals.empty()) {
+        // The face decides the side, the interpolated normal only the shading
+        const vec3 n = unit_vector(b0 * normals[tri[0]] + b1 * normals[tri[1]] + (1.0 - b0 - b1) * normals[tri[2]]);
+        rec.normal = rec.front_face ? n : -n;
+    }
+    rec.mat_ptr = mat.get();
+}
+
+bool triangle_mesh::bounding_box(aabb& output_box) const {
+    if (tree.empty()) return false;
+    output_box = tree.bounds();
+    return true;
+}
+
+#endif
@@ -0,0 +1,39 @@
+// Scene compiler: turns a text scene (see utils/scene_file.h) into the binary form that
+// GHDcli --scene-file memory maps, with the BVH built ahead of time.
+// Usage: GHDscene <scene.txt> <scene.ghdb>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "utils/scene_file.h"
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <scene.txt> <scene.ghdb>\n", argv[0]);
+        return 1;
+    }
+    const std::string input = argv[1];
+    const std::string output = argv[2];
+
+    auto parse_start = std::chrono::steady_clock::now();
+    scene_description scene;
+    if (!parse_scene_text(input, scene))
+        return 1;
+
+    auto compile_start = std::chrono::steady_clock::now();
+    std::vector<char> image = compile_scene(scene);
+
+    auto write_start = std::chrono::steady_clock::now();
+    if (!write_scene_image(output, image))
+        return 1;
+    auto end = std::chrono::steady_clock::now();
+
+    printf("%zu spheres, %zu materials: parsed in %.1f ms, compiled in %.1f ms, wrote %zu bytes in %.1f ms\n",
+           scene.cx.size(), scene.materials.size(), elapsed_ms(parse_start, compile_start),
+           elapsed_ms(compile_start, write_start), image.size(), elapsed_ms(write_start, end));
+    return 0;
+}
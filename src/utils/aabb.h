@@ -0,0 +1,89 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "rtweekend.h"
+
+#include <utility>
+
+// Rounding in the slab test can put the exit distance just before the entry distance
+// for rays that graze a box face, e.g. rays through a mesh vertex on the face. Exit
+// distances are scaled by this bound on the error (Ize 2013), so such boxes are kept.
+// The bound is 2 gamma(3) = 2 * 3u / (1 - 3u), u the unit roundoff of real.
+const real real_unit_roundoff = std::numeric_limits<real>::epsilon() / 2;
+const real slab_exit_scale = 1 + 2 * (3 * real_unit_roundoff / (1 - 3 * real_unit_roundoff));
+
+// Axis-aligned bounding box, used by the BVH to cull whole groups of objects
+class aabb {
+    public:
+        // default constructor creates an empty (inverted) box
+        aabb()
+            : minimum(infinity, infinity, infinity), maximum(-infinity, -infinity, -infinity)
+        {}
+        aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
+
+        point3 min() const { return minimum; }
+        point3 max() const { return maximum; }
+
+        point3 centroid() const { return 0.5 * (minimum + maximum); }
+
+        bool empty() const {
+            return minimum.x() > maximum.x() || minimum.y() > maximum.y() || minimum.z() > maximum.z();
+        }
+
+        void expand(const aabb& box) {
+            for (int a = 0; a < 3; a++) {
+                minimum[a] = fmin(minimum[a], box.minimum[a]);
+                maximum[a] = fmax(maximum[a], box.maximum[a]);
+            }
+        }
+
+        void expand(const point3& p) {
+            for (int a = 0; a < 3; a++) {
+                minimum[a] = fmin(minimum[a], p[a]);
+                maximum[a] = fmax(maximum[a], p[a]);
+            }
+        }
+
+        double surface_area() const {
+            if (empty()) return 0.0;
+            vec3 d = maximum - minimum;
+            return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+        }
+
+        // Slab test. inv_dir is 1/direction, precomputed once per ray by the caller.
+        // On a hit, t_enter is the distance at which the ray enters the box.
+        bool hit(const point3& orig, const vec3& inv_dir, real t_min, real t_max, real& t_enter) const {
+            for (int a = 0; a < 3; a++) {
+                auto t0 = (minimum[a] - orig[a]) * inv_dir[a];
+                auto t1 = (maximum[a] - orig[a]) * inv_dir[a];
+                if (inv_dir[a] < 0)
+                    std::swap(t0, t1);
+                t1 *= slab_exit_scale;
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+                if (t_max < t_min)
+                    return false;
+            }
+            t_enter = t_min;
+            return true;
+        }
+
+        bool hit(const ray& r, real t_min, real t_max) const {
+            vec3 d = r.direction();
+            vec3 inv_dir(1 / d.x(), 1 / d.y(), 1 / d.z());
+            real t_enter;
+            return hit(r.origin(), inv_dir, t_min, t_max, t_enter);
+        }
+
+    public:
+        point3 minimum;
+        point3 maximum;
+};
+
+inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+    aabb box = box0;
+    box.expand(box1);
+    return box;
+}
+
+#endif
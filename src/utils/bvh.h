@@ -0,0 +1,504 @@
+#ifndef BVH_H
+#define BVH_H
+
+// Bounding volume hierarchy
+// bvh_tree is the generic part: it is built from a list of primitive boxes with a
+// binned SAH builder and stored as a flat array of nodes. bvh is a hittable that
+// uses a bvh_tree to accelerate a list of hittables (replacing the linear scan of
+// hittable_list).
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "render_stats.h"
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+struct bvh_node {
+    aabb box;
+    int left_first; // leaf: index of the first primitive, interior: index of the left child (right child follows it)
+    int count;      // number of primitives for leaves, 0 for interior nodes
+    int axis;       // split axis of interior nodes, used to visit the nearer child first
+
+    bool is_leaf() const { return count > 0; }
+};
+
+class bvh_tree {
+    public:
+        static const int max_depth = 64;
+        static const int bin_count = 16;
+
+        bvh_tree() {}
+
+        // Builds the hierarchy over the given primitive boxes. After the build,
+        // prim_indices holds the primitive order, leaves reference ranges of it.
+        // intersection_cost is the cost of one primitive test relative to a node
+        // visit; batch (SIMD) leaves are cheaper per primitive and favour bigger leaves.
+        void build(const std::vector<aabb>& boxes, int max_leaf_size = 4, double intersection_cost = 1.0);
+
+        // Uses nodes built elsewhere, e.g. stored in a scene file, instead of building.
+        // The primitives must already be in leaf order. The nodes are not copied and
+        // have to outlive the tree.
+        void attach(const bvh_node* nodes, size_t count) {
+            this->nodes.clear();
+            prim_indices.clear();
+            external_nodes = nodes;
+            external_count = count;
+        }
+
+        const bvh_node* node_data() const { return external_nodes ? external_nodes : nodes.data(); }
+        size_t node_count() const { return external_nodes ? external_count : nodes.size(); }
+
+        bool empty() const { return node_count() == 0; }
+        aabb bounds() const { return empty() ? aabb() : node_data()[0].box; }
+
+        // Walks the nodes hit by the ray front to back and calls
+        // leaf(first, count, t_min, closest_so_far) for every leaf reached.
+        // The leaf function returns true if it found a closer hit, and updates closest_so_far.
+        // Box tests and primitives reached are added to thread_counters().
+        template <typename LeafFn>
+        bool traverse(const ray& r, real t_min, real& closest_so_far, LeafFn&& leaf) const;
+
+        // Walks the tree once for a packet of up to ray_packet_size rays. A node is
+        // visited if any ray of the packet hits its box; the leaf function is called as
+        // leaf(first, count, mask, t_min, closest) with the bit mask of the rays that
+        // reached the leaf and their per ray closest_so_far array, which it lowers.
+        // Counts one box test per node for the whole packet.
+        template <typename LeafFn>
+        void traverse_packet(const ray* rays, int ray_count, real t_min, real* closest_so_far, LeafFn&& leaf) const;
+
+    public:
+        std::vector<bvh_node> nodes;
+        std::vector<int> prim_indices;
+
+    private:
+        int max_leaf_size = 4;
+        double intersection_cost = 1.0;
+        const bvh_node* external_nodes = nullptr;
+        size_t external_count = 0;
+
+        void subdivide(int node_index, int first, int count, int depth,
+                       const std::vector<aabb>& boxes, const std::vector<point3>& centroids);
+};
+
+void bvh_tree::build(const std::vector<aabb>& boxes, int max_leaf_size, double intersection_cost) {
+    this->max_leaf_size = max_leaf_size;
+    external_nodes = nullptr;
+    external_count = 0;
+    this->intersection_cost = intersection_cost;
+
+    nodes.clear();
+    prim_indices.resize(boxes.size());
+    std::iota(prim_indices.begin(), prim_indices.end(), 0);
+
+    if (boxes.empty()) return;
+
+    std::vector<point3> centroids(boxes.size());
+    for (size_t i = 0; i < boxes.size(); i++)
+        centroids[i] = boxes[i].centroid();
+
+    nodes.reserve(2 * boxes.size());
+    nodes.push_back(bvh_node());
+    subdivide(0, 0, static_cast<int>(boxes.size()), 0, boxes, centroids);
+}
+
+void bvh_tree::subdivide(int node_index, int first, int count, int depth,
+                         const std::vector<aabb>& boxes, const std::vector<point3>& centroids) {
+    // Bounds of the primitives and of their centroids
+    aabb box, centroid_box;
+    for (int i = first; i < first + count; i++) {
+        box.expand(boxes[prim_indices[i]]);
+        centroid_box.expand(centroids[prim_indices[i]]);
+    }
+    nodes[node_index].box = box;
+    nodes[node_index].left_first = first;
+    nodes[node_index].count = count;
+    nodes[node_index].axis = 0;
+
+    if (count <= 1 || depth >= max_depth - 2)
+        return;
+
+    // Binned SAH: sweep bin_count bins on every axis and keep the cheapest split
+    double best_cost = infinity;
+    int best_axis = -1;
+    int best_split = 0;
+
+    for (int axis = 0; axis < 3; axis++) {
+        double lo = centroid_box.minimum[axis];
+        double extent = centroid_box.maximum[axis] - lo;
+        if (extent <= 0.0) continue;
+
+        aabb bin_boxes[bin_count];
+        int bin_counts[bin_count] = {0};
+        double scale = bin_count / extent;
+        for (int i = first; i < first + count; i++) {
+            int b = std::min(bin_count - 1, static_cast<int>((centroids[prim_indices[i]][axis] - lo) * scale));
+            bin_counts[b]++;
+            bin_boxes[b].expand(boxes[prim_indices[i]]);
+        }
+
+        // Right-to-left sweep first, then evaluate the splits left-to-right
+        double right_area[bin_count];
+        int right_count[bin_count];
+        aabb right_box;
+        int right_sum = 0;
+        for (int b = bin_count - 1; b > 0; b--) {
+            right_box.expand(bin_boxes[b]);
+            right_sum += bin_counts[b];
+            right_area[b] = right_box.surface_area();
+            right_count[b] = right_sum;
+        }
+
+        aabb left_box;
+        int left_sum = 0;
+        for (int b = 0; b < bin_count - 1; b++) {
+            left_box.expand(bin_boxes[b]);
+            left_sum += bin_counts[b];
+            if (left_sum == 0 || right_count[b + 1] == 0) continue;
+            double cost = left_sum * left_box.surface_area() + right_count[b + 1] * right_area[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b + 1;
+            }
+        }
+    }
+
+    // All centroids coincide: nothing to split on
+    if (best_axis < 0)
+        return;
+
+    // Traversal cost 1, intersection_cost per primitive
+    double parent_area = box.surface_area();
+    double split_cost = parent_area > 0.0 ? 1.0 + intersection_cost * best_cost / parent_area : infinity;
+    if (split_cost >= intersection_cost * count && count <= max_leaf_size)
+        return;
+
+    double lo = centroid_box.minimum[best_axis];
+    double scale = bin_count / (centroid_box.maximum[best_axis] - lo);
+    auto middle = std::partition(
+        prim_indices.begin() + first,
+        prim_indices.begin() + first + count,
+        [&](int index) {
+            int b = std::min(bin_count - 1, static_cast<int>((centroids[index][best_axis] - lo) * scale));
+            return b < best_split;
+        }
+    );
+    int left_count = static_cast<int>(middle - (prim_indices.begin() + first));
+
+    // Fall back to a median split if binning failed to separate the primitives
+    if (left_count == 0 || left_count == count) {
+        left_count = count / 2;
+        std::nth_element(
+            prim_indices.begin() + first,
+            prim_indices.begin() + first + left_count,
+            prim_indices.begin() + first + count,
+            [&](int a, int b) { return centroids[a][best_axis] < centroids[b][best_axis]; }
+        );
+    }
+
+    int left_index = static_cast<int>(nodes.size());
+    nodes.push_back(bvh_node());
+    nodes.push_back(bvh_node());
+    nodes[node_index].left_first = left_index;
+    nodes[node_index].count = 0;
+    nodes[node_index].axis = best_axis;
+
+    subdivide(left_index, first, left_count, depth + 1, boxes, centroids);
+    subdivide(left_index + 1, first + left_count, count - left_count, depth + 1, boxes, centroids);
+}
+
+template <typename LeafFn>
+bool bvh_tree::traverse(const ray& r, real t_min, real& closest_so_far, LeafFn&& leaf) const {
+    if (empty()) return false;
+    const bvh_node* tree_nodes = node_data();
+
+    const point3 orig = r.origin();
+    const vec3 dir = r.direction();
+    const vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+
+    PassCounters& counters = thread_counters();
+    ++counters.nodes_visited;
+    real t_enter;
+    if (!tree_nodes[0].box.hit(orig, inv_dir, t_min, closest_so_far, t_enter))
+        return false;
+
+    // Counted locally, the leaf function may write to memory the compiler cannot tell apart
+    uint64_t nodes_visited = 0;
+    uint64_t primitive_tests = 0;
+    bool hit_anything = false;
+    int stack[max_depth];
+    int stack_size = 0;
+    int current = 0;
+
+    while (true) {
+        const bvh_node& node = tree_nodes[current];
+
+        if (node.is_leaf()) {
+            primitive_tests += node.count;
+            if (leaf(node.left_first, node.count, t_min, closest_so_far))
+                hit_anything = true;
+        }
+        else {
+            nodes_visited += 2;
+            // Visit the child on the near side of the split plane first
+            int near_child = node.left_first;
+            int far_child = node.left_first + 1;
+            if (dir[node.axis] < 0.0)
+                std::swap(near_child, far_child);
+
+            real t_near, t_far;
+            bool hit_near = tree_nodes[near_child].box.hit(orig, inv_dir, t_min, closest_so_far, t_near);
+            bool hit_far = tree_nodes[far_child].box.hit(orig, inv_dir, t_min, closest_so_far, t_far);
+
+            if (hit_near && hit_far) {
+                if (t_far < t_near)
+                    std::swap(near_child, far_child);
+                stack[stack_size++] = far_child;
+                current = near_child;
+                continue;
+            }
+            if (hit_near) { current = near_child; continue; }
+            if (hit_far) { current = far_child; continue; }
+        }
+
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+
+    counters.nodes_visited += nodes_visited;
+    counters.primitive_tests += primitive_tests;
+    return hit_anything;
+}
+
+template <typename LeafFn>
+void bvh_tree::traverse_packet(const ray* rays, int ray_count, real t_min, real* closest_so_far, LeafFn&& leaf) const {
+    if (empty() || ray_count == 0) return;
+    const bvh_node* tree_nodes = node_data();
+
+    // Packet in structure of arrays layout, so the box test below vectorizes across rays
+    // Unused lanes are zero filled and masked off
+    real orig[3][ray_packet_size] = {};
+    real inv_dir[3][ray_packet_size] = {};
+    for (int k = 0; k < ray_count; k++) {
+        const point3 o = rays[k].origin();
+        const vec3 dir = rays[k].direction();
+        for (int a = 0; a < 3; a++) {
+            orig[a][k] = o[a];
+            inv_dir[a][k] = 1 / dir[a];
+        }
+    }
+
+    // Rays of a packet are coherent, the first one decides the child order
+    const vec3 lead_dir = rays[0].direction();
+
+    // Each stack entry carries the rays that hit its parent, the others can be skipped
+    int stack[2 * max_depth];
+    unsigned stack_masks[2 * max_depth];
+    int stack_size = 0;
+    stack[stack_size] = 0;
+    stack_masks[stack_size++] = (1u << ray_count) - 1u;
+    uint64_t nodes_visited = 0;
+    uint64_t primitive_tests = 0;
+
+    while (stack_size > 0) {
+        --stack_size;
+        ++nodes_visited;
+        const bvh_node& node = tree_nodes[stack[stack_size]];
+        const unsigned parent_mask = stack_masks[stack_size];
+
+        // Same slab test as aabb::hit, for all rays of the packet at once
+        real t_enter[ray_packet_size];
+        real t_exit[ray_packet_size];
+        for (int k = 0; k < ray_packet_size; k++) {
+            t_enter[k] = t_min;
+            t_exit[k] = k < ray_count ? closest_so_far[k] : -infinity;
+        }
+        for (int a = 0; a < 3; a++) {
+            const real lo = node.box.minimum[a];
+            const real hi = node.box.maximum[a];
+            for (int k = 0; k < ray_packet_size; k++) {
+                real t0 = (lo - orig[a][k]) * inv_dir[a][k];
+                real t1 = (hi - orig[a][k]) * inv_dir[a][k];
+                real near_t = inv_dir[a][k] < 0 ? t1 : t0;
+                real far_t = (inv_dir[a][k] < 0 ? t0 : t1) * slab_exit_scale;
+                t_enter[k] = near_t > t_enter[k] ? near_t : t_enter[k];
+                t_exit[k] = far_t < t_exit[k] ? far_t : t_exit[k];
+            }
+        }
+        unsigned mask = 0;
+        for (int k = 0; k < ray_count; k++) {
+            if (!(t_exit[k] < t_enter[k]))
+                mask |= 1u << k;
+        }
+        mask &= parent_mask;
+        if (mask == 0)
+            continue;
+
+        if (node.is_leaf()) {
+            primitive_tests += node.count;
+            leaf(node.left_first, node.count, mask, t_min, closest_so_far);
+            continue;
+        }
+
+        // Push the far child first so the near one is popped next
+        int near_child = node.left_first;
+        int far_child = node.left_first + 1;
+        if (lead_dir[node.axis] < 0.0)
+            std::swap(near_child, far_child);
+        stack[stack_size] = far_child;
+        stack_masks[stack_size++] = mask;
+        stack[stack_size] = near_child;
+        stack_masks[stack_size++] = mask;
+    }
+
+    PassCounters& counters = thread_counters();
+    counters.nodes_visited += nodes_visited;
+    counters.primitive_tests += primitive_tests;
+}
+
+// A hittable that holds a list of objects in a BVH
+class bvh : public hittable {
+    public:
+        bvh() {}
+        bvh(const hittable_list& list, int max_leaf_size = 4) { build(list.objects, max_leaf_size); }
+
+        void build(const std::vector<shared_ptr<hittable>>& src_objects, int max_leaf_size = 4);
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+        virtual void hit_packet(const ray* rays, int count, real t_min, const real* t_max,
+                                hit_record* recs, bool* hits) const override;
+
+        virtual bool bounding_box(aabb& output_box) const override;
+
+    public:
+        bvh_tree tree;
+        // objects in BVH leaf order, owning
+        std::vector<shared_ptr<hittable>> objects;
+        // the same objects as plain pointers, used while tracing
+        std::vector<const hittable*> leaf_objects;
+        // objects without finite bounds, tested against every ray
+        std::vector<shared_ptr<hittable>> unbounded;
+};
+
+void bvh::build(const std::vector<shared_ptr<hittable>>& src_objects, int max_leaf_size) {
+    objects.clear();
+    leaf_objects.clear();
+    unbounded.clear();
+
+    std::vector<shared_ptr<hittable>> bounded;
+    std::vector<aabb> boxes;
+    bounded.reserve(src_objects.size());
+    boxes.reserve(src_objects.size());
+
+    aabb box;
+    for (const auto& object : src_objects) {
+        if (object->bounding_box(box)) {
+            bounded.push_back(object);
+            boxes.push_back(box);
+        }
+        else {
+            unbounded.push_back(object);
+        }
+    }
+
+    tree.build(boxes, max_leaf_size);
+
+    objects.reserve(bounded.size());
+    leaf_objects.reserve(bounded.size());
+    for (int index : tree.prim_indices) {
+        objects.push_back(bounded[index]);
+        leaf_objects.push_back(bounded[index].get());
+    }
+}
+
+bool bvh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    bool hit_anything = false;
+    auto closest_so_far = t_max;
+
+    for (const auto& object : unbounded) {
+        if (object->hit(r, t_min, closest_so_far, rec)) {
+            hit_anything = true;
+            closest_so_far = rec.t;
+        }
+    }
+
+    bool hit_tree = tree.traverse(r, t_min, closest_so_far,
+        [&](int first, int count, real leaf_t_min, real& closest) {
+            bool hit_leaf = false;
+            for (int i = first; i < first + count; i++) {
+                if (leaf_objects[i]->hit(r, leaf_t_min, closest, rec)) {
+                    hit_leaf = true;
+                    closest = rec.t;
+                }
+            }
+            return hit_leaf;
+        }
+    );
+
+    return hit_anything || hit_tree;
+}
+
+void bvh::hit_packet(const ray* rays, int count, real t_min, const real* t_max,
+                     hit_record* recs, bool* hits) const {
+    real closest_so_far[ray_packet_size];
+    for (int k = 0; k < count; k++) {
+        hits[k] = false;
+        closest_so_far[k] = t_max[k];
+    }
+
+    for (const auto& object : unbounded) {
+        for (int k = 0; k < count; k++) {
+            if (object->hit(rays[k], t_min, closest_so_far[k], recs[k])) {
+                hits[k] = true;
+                closest_so_far[k] = recs[k].t;
+            }
+        }
+    }
+
+    // Objects in a leaf get the rays that reached it as a smaller packet
+    tree.traverse_packet(rays, count, t_min, closest_so_far,
+        [&](int first, int leaf_count, unsigned mask, real leaf_t_min, real* closest) {
+            ray sub_rays[ray_packet_size];
+            real sub_t_max[ray_packet_size];
+            hit_record sub_recs[ray_packet_size];
+            bool sub_hits[ray_packet_size];
+            int sub_index[ray_packet_size];
+            int sub_count = 0;
+            for (int k = 0; k < count; k++) {
+                if (mask & (1u << k)) {
+                    sub_rays[sub_count] = rays[k];
+                    sub_index[sub_count++] = k;
+                }
+            }
+
+            for (int i = first; i < first + leaf_count; i++) {
+                for (int j = 0; j < sub_count; j++)
+                    sub_t_max[j] = closest[sub_index[j]];
+                leaf_objects[i]->hit_packet(sub_rays, sub_count, leaf_t_min, sub_t_max, sub_recs, sub_hits);
+                for (int j = 0; j < sub_count; j++) {
+                    if (sub_hits[j]) {
+                        int k = sub_index[j];
+                        recs[k] = sub_recs[j];
+                        hits[k] = true;
+                        closest[k] = sub_recs[j].t;
+                    }
+                }
+            }
+        }
+    );
+}
+
+bool bvh::bounding_box(aabb& output_box) const {
+    if (!unbounded.empty() || tree.empty()) return false;
+    output_box = tree.bounds();
+    return true;
+}
+
+#endif
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "renderer.h"
+#include "net.h"
+
+// Coordinator/worker rendering. Workers are GHDcli processes started with --serve,
+// on this host or another one. The coordinator sends each of them the job, which a
+// worker of an incompatible build rejects, then hands out chunks of progressive
+// iterations on demand. A worker renders its chunk
+// into an empty accumulation buffer and sends the buffer back, the coordinator adds
+// it to its own. Samples are keyed by (seed, pixel, iteration), so the workers'
+// samples are independent and the same ones a single process would take.
+
+// Everything a worker needs to render the same samples as the coordinator
+struct RenderJob {
+	int32_t scene = 0;
+	int32_t width = 0;
+	int32_t height = 0;
+	int32_t max_depth = 0;
+	int32_t russian_roulette_depth = 0;
+	int32_t tile_size = 0;
+	int32_t wavefront = 0;
+	int32_t sampler = 0;
+	int32_t light_sampling = 1;
+	// sizeof(real): float and double builds take different samples, so a worker
+	// only accepts jobs from a build of its own precision
+	int32_t precision = sizeof(real);
+	// Format of the accumulation buffer the worker sends back
+	int32_t accum_bytes = sizeof(accum_t);
+	int32_t accum_stride = accum_pixel_stride;
+	uint64_t seed = 0;
+	double aperture = 0.0;
+
+	// Starts every job on the wire, "GHJ1". Bump the digit when the fields change.
+	static constexpr uint32_t magic = 0x314a4847;
+	// Largest image a worker accepts, 8K UHD fits. Jobs come from the network, this
+	// bounds what a peer can make the worker allocate.
+	static constexpr int64_t max_pixels = int64_t(1) << 25;
+	// Longest reject reason a coordinator reads
+	static constexpr uint64_t max_reason_size = 1024;
+
+	// Field by field with fixed widths, not the struct's bytes, so that the layout
+	// and padding of the struct do not matter
+	bool send(Socket& socket) const {
+		return socket.send_value(magic) && socket.send_value(scene) && socket.send_value(width) &&
+			socket.send_value(height) && socket.send_value(max_depth) && socket.send_value(russian_roulette_depth) &&
+			socket.send_value(tile_size) && socket.send_value(wavefront) && socket.send_value(sampler) &&
+			socket.send_value(light_sampling) && socket.send_value(precision) && socket.send_value(accum_bytes) &&
+			socket.send_value(accum_stride) && socket.send_value(seed) && socket.send_value(aperture);
+	}
+
+	// Returns false if the connection dropped or the sender speaks another protocol
+	bool receive(Socket& socket) {
+		uint32_t sender_magic = 0;
+		return socket.receive_value(sender_magic) && sender_magic == magic && socket.receive_value(scene) &&
+			socket.receive_value(width) && socket.receive_value(height) && socket.receive_value(max_depth) &&
+			socket.receive_value(russian_roulette_depth) && socket.receive_value(tile_size) &&
+			socket.receive_value(wavefront) && socket.receive_value(sampler) && socket.receive_value(light_sampling) &&
+			socket.receive_value(precision) && socket.receive_value(accum_bytes) && socket.receive_value(accum_stride) &&
+			socket.receive_value(seed) && socket.receive_value(aperture);
+	}
+
+	// Why this build cannot render the job, empty if it can. Every field that indexes
+	// a table or sizes a buffer is checked, the job comes from the network.
+	std::string incompatibility() const {
+		if (precision != static_cast<int32_t>(sizeof(real)))
+			return precision == static_cast<int32_t>(sizeof(float)) ? "sent by a float precision build" : "sent by a double precision build";
+		if (accum_bytes != static_cast<int32_t>(sizeof(accum_t)) || accum_stride != accum_pixel_stride)
+			return "sent by a build with another accumulation buffer format";
+		if (scene < 0 || scene >= scene_count)
+			return "unknown scene";
+		if (sampler < 0 || sampler >= sampler_type_count)
+			return "unknown sampler";
+		if (width <= 0 || height <= 0 || static_cast<int64_t>(width) * height > max_pixels)
+			return "invalid resolution";
+		if (tile_size <= 0 || max_depth <= 0)
+			return "invalid tile size or depth";
+		return std::string();
+	}
+
+	// Size of the accumulation buffer a worker sends back
+	uint64_t result_size() const {
+		return static_cast<uint64_t>(width) * static_cast<uint64_t>(height) * RawImage::pixel_bytes();
+	}
+
+	void apply(Renderer& renderer) const {
+		renderer.set_scene_name(static_cast<SceneName>(scene));
+		renderer.set_image_width(width);
+		renderer.set_image_height(height);
+		renderer.set_max_depth(max_depth);
+		renderer.set_russian_roulette_depth(russian_roulette_depth);
+		renderer.set_tile_size(tile_size);
+		renderer.set_wavefront(wavefront != 0);
+		renderer.set_sampler(static_cast<sampler_type>(sampler));
+		renderer.set_light_sampling(light_sampling != 0);
+		renderer.set_seed(seed);
+		renderer.set_camera_aperture(aperture);
+	}
+};
+
+// Message tags
+static const char job_message = 'J';
+static const char accept_message = 'A';
+static const char reject_message = 'X';
+static const char chunk_message = 'C';
+static const char result_message = 'R';
+static const char quit_message = 'Q';
+
+// Worker side: serves one coordinator at a time, forever. Returns only if the
+// port cannot be opened.
+inline int run_render_server(int port, int thread_count) {
+	Socket server = Socket::listen(port);
+	if (!server.is_open()) {
+		fprintf(stderr, "Could not listen on port %d\n", port);
+		return 1;
+	}
+	std::cout << "Listening on port " << port << std::endl;
+
+	while (true) {
+		Socket connection = server.accept();
+		if (!connection.is_open())
+			continue;
+
+		char tag = 0;
+		RenderJob job;
+		if (!connection.receive_value(tag) || tag != job_message || !job.receive(connection)) {
+			fprintf(stderr, "Dropped a connection that did not send a job this build understands\n");
+			continue;
+		}
+		const std::string incompatibility = job.incompatibility();
+		if (!incompatibility.empty()) {
+			fprintf(stderr, "Rejected a job: %s\n", incompatibility.c_str());
+			connection.send_value(reject_message);
+			connection.send_string(incompatibility);
+			continue;
+		}
+		if (!connection.send_value(accept_message))
+			continue;
+
+		// Only the accumulation buffer goes back, the 8-bit image is never looked at
+		Renderer renderer(job.width, job.height, 1, job.max_depth);
+		renderer.set_verbose(false);
+		renderer.set_thread_count(thread_count);
+		renderer.set_resolve(false);
+		job.apply(renderer);
+		renderer.reset();
+		std::cout << "Job: " << scene_name_to_string(static_cast<SceneName>(job.scene)) << " at "
+		          << job.width << "x" << job.height << std::endl;
+
+		while (connection.receive_value(tag) && tag == chunk_message) {
+			int32_t first = 0, last = 0;
+			if (!connection.receive_value(first) || !connection.receive_value(last))
+				break;
+
+			auto start = std::chrono::steady_clock::now();
+			renderer.clear_samples();
+			for (int iteration = first; iteration <= last; ++iteration) {
+				renderer.set_current_iteration(iteration);
+				renderer.render();
+			}
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			std::ostringstream buffer;
+			renderer.get_raw_image().write(buffer);
+			uint64_t sample_count = renderer.get_sample_count();
+			uint64_t ray_count = renderer.get_ray_count();
+			if (!connection.send_value(result_message) || !connection.send_value(sample_count) ||
+				!connection.send_value(ray_count) || !connection.send_value(ms) || !connection.send_string(buffer.str()))
+				break;
+			std::cout << "Iterations " << first << "-" << last << " in " << ms << " ms" << std::endl;
+		}
+	}
+}
+
+// Per worker counters of a distributed render
+struct RemoteWorkerStats {
+	std::string address;
+	int chunks = 0;
+	uint64_t rays = 0;
+	double busy_ms = 0.0;
+	bool failed = false;
+};
+
+// Coordinator side. Iterations 1..samples_per_pixel are handed out in chunks of
+// chunk_size; a chunk whose worker disconnects goes back to the queue, so the
+// render finishes as long as one worker stays up.
+class RenderCoordinator {
+public:
+	RenderCoordinator(Renderer& renderer, const RenderJob& job, const std::vector<std::string>& addresses)
+		: m_renderer(renderer), m_job(job) {
+		for (const auto& address : addresses) {
+			RemoteWorkerStats stats;
+			stats.address = address;
+			m_stats.push_back(stats);
+		}
+	}
+
+	// Returns false if the workers went away before every iteration was rendered
+	bool run(int samples_per_pixel, int chunk_size) {
+		m_pending.clear();
+		m_in_flight = 0;
+		for (int first = 1; first <= samples_per_pixel; first += chunk_size)
+			m_pending.push_back({ first, std::min(first + chunk_size - 1, samples_per_pixel) });
+
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for (size_t w = 0; w < m_stats.size(); ++w)
+			threads.emplace_back([this, w]() { this->serve_worker(static_cast<int>(w)); });
+		for (auto& thread : threads)
+			thread.join();
+		m_wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		return m_pending.empty();
+	}
+
+	const std::vector<RemoteWorkerStats>& get_stats() const { return m_stats; }
+	double get_wall_ms() const { return m_wall_ms; }
+	// Aggregate over every worker
+	double get_rays_per_second() const { return m_wall_ms > 0.0 ? m_renderer.get_ray_count() / (m_wall_ms / 1000.0) : 0.0; }
+
+private:
+	struct Chunk {
+		int first, last;
+	};
+
+	Renderer& m_renderer;
+	RenderJob m_job;
+	std::vector<RemoteWorkerStats> m_stats;
+	std::vector<Chunk> m_pending;
+	int m_in_flight = 0;
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+	double m_wall_ms = 0.0;
+
+	void serve_worker(int w) {
+		RemoteWorkerStats& stats = m_stats[w];
+		std::string host = stats.address;
+		int port = 0;
+		size_t colon = host.rfind(':');
+		if (colon != std::string::npos) {
+			port = atoi(host.c_str() + colon + 1);
+			host = host.substr(0, colon);
+		}
+
+		Socket connection = Socket::connect(host, port);
+		char reply = 0;
+		if (!connection.is_open() || !connection.send_value(job_message) || !m_job.send(connection) ||
+			!connection.receive_value(reply)) {
+			fprintf(stderr, "Could not reach worker %s\n", stats.address.c_str());
+			stats.failed = true;
+			return;
+		}
+		if (reply != accept_message) {
+			std::string reason = "unknown reply";
+			if (reply == reject_message)
+				connection.receive_string(reason, RenderJob::max_reason_size);
+			fprintf(stderr, "Worker %s rejected the job: %s\n", stats.address.c_str(), reason.c_str());
+			stats.failed = true;
+			return;
+		}
+
+		RawImage samples(m_job.width, m_job.height);
+		std::string buffer;
+		while (true) {
+			// Wait while other workers still hold chunks, they may give them back
+			Chunk chunk;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_changed.wait(lock, [this]() { return !m_pending.empty() || m_in_flight == 0; });
+				if (m_pending.empty())
+					break;
+				chunk = m_pending.front();
+				m_pending.erase(m_pending.begin());
+				m_in_flight++;
+			}
+
+			char tag = 0;
+			uint64_t sample_count = 0, ray_count = 0;
+			double ms = 0.0;
+			int32_t first = chunk.first, last = chunk.last;
+			bool ok = connection.send_value(chunk_message) && connection.send_value(first) && connection.send_value(last) &&
+				connection.receive_value(tag) && tag == result_message && connection.receive_value(sample_count) &&
+				connection.receive_value(ray_count) && connection.receive_value(ms) && connection.receive_string(buffer, m_job.result_size());
+			std::istringstream in(buffer);
+			if (!ok || !samples.read(in)) {
+				fprintf(stderr, "Lost worker %s, its iterations %d-%d are handed out again\n", stats.address.c_str(), first, last);
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_pending.push_back(chunk);
+				m_in_flight--;
+				stats.failed = true;
+				m_changed.notify_all();
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_renderer.merge_samples(samples, sample_count, ray_count);
+			m_in_flight--;
+			stats.chunks++;
+			stats.rays += ray_count;
+			stats.busy_ms += ms;
+			m_changed.notify_all();
+		}
+
+		connection.send_value(quit_message);
+	}
+};
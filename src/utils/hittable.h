@@ -3,14 +3,15 @@
 
 #include "ray.h"
 #include "rtweekend.h"
+#include "aabb.h"
 
 class material;
 
 struct hit_record {
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
-    double t;
+    const material* mat_ptr; // non-owning, the scene owns its materials
+    real t;
     bool front_face;
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
@@ -19,9 +20,24 @@ struct hit_record {
     }
 };
 
+// Largest number of rays handed to hittable::hit_packet at once
+const int ray_packet_size = 8;
+
 class hittable {
     public:
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
+
+        // Intersects a packet of up to ray_packet_size rays. t_max is per ray, hits[k]
+        // tells whether rays[k] hit anything closer, recs[k] is only written if it did.
+        // Objects that can share work between coherent rays override this.
+        virtual void hit_packet(const ray* rays, int count, real t_min, const real* t_max,
+                                hit_record* recs, bool* hits) const {
+            for (int k = 0; k < count; k++)
+                hits[k] = hit(rays[k], t_min, t_max[k], recs[k]);
+        }
+
+        // Returns false for objects that have no finite bounds
+        virtual bool bounding_box(aabb& output_box) const = 0;
 };
 
 #endif
\ No newline at end of file
@@ -18,13 +18,15 @@ class hittable_list : public hittable {
         void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+        virtual bool bounding_box(aabb& output_box) const override;
 
     public:
         std::vector<shared_ptr<hittable>> objects;
 };
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool hittable_list::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     hit_record temp_rec;
     bool hit_anything = false;
     auto closest_so_far = t_max;
@@ -40,4 +42,18 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
     return hit_anything;
 }
 
+bool hittable_list::bounding_box(aabb& output_box) const {
+    if (objects.empty()) return false;
+
+    aabb temp_box;
+    output_box = aabb();
+
+    for (const auto& object : objects) {
+        if (!object->bounding_box(temp_box)) return false;
+        output_box.expand(temp_box);
+    }
+
+    return true;
+}
+
 #endif
\ No newline at end of file
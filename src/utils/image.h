@@ -1,23 +1,35 @@
 #pragma once
 
 #include <vector>
-#include <glad/glad.h>
+#include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <string>
 
+// Screen-space block of pixels [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// 8-bit RGBA image the renderer resolves into. Has no GL dependency,
+// see texture.h for displaying it.
 class GHDImage {
 private:
-    int width, height;
+    int width = 0, height = 0;
     std::vector<unsigned char> pixels; // Flat array to store RGBA pixels
-    GLuint textureId;
-    bool textureInitialized;
 
 public:
     // default constructor
     GHDImage() {}
-    GHDImage(int w, int h) : width(w), height(h), textureInitialized(false) {
+    GHDImage(int w, int h) : width(w), height(h) {
         pixels.resize(width * height * 4, 255); // Initialize with white (RGBA)
     }
 
+    // Resets every pixel to white, keeping the allocation
+    void clear() {
+        std::fill(pixels.begin(), pixels.end(), static_cast<unsigned char>(255));
+    }
+
     void set_pixel(int i, int j, unsigned char r, unsigned char g, unsigned char b, unsigned char a = 255) {
         if (i < 0 || i >= height || j < 0 || j >= width) {
             std::cerr << "Pixel coordinates out of bounds: (" << i << ", " << j << ")\n";
@@ -31,41 +43,35 @@ public:
         pixels[index + 3] = a;
     }
 
-    void bind_texture() {
-        if (!textureInitialized) {
-            glGenTextures(1, &textureId);
-            glBindTexture(GL_TEXTURE_2D, textureId);
-
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-            textureInitialized = true;
+    // Writes a binary PPM (P6). Row 0 is the bottom of the image, so rows are written in reverse.
+    bool write_ppm(const std::string& path) const {
+        std::ofstream out(path, std::ios::binary);
+        if (!out) {
+            std::cerr << "Could not open " << path << " for writing\n";
+            return false;
         }
 
-        glBindTexture(GL_TEXTURE_2D, textureId);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
-    }
-
-    GLuint get_texture_id() const {
-        return textureId;
-    }
-
-    void* get_imgui_texture_id() const {
-        return reinterpret_cast<void*>(static_cast<intptr_t>(textureId));
+        out << "P6\n" << width << ' ' << height << "\n255\n";
+        std::vector<unsigned char> row(width * 3);
+        for (int i = height - 1; i >= 0; --i) {
+            for (int j = 0; j < width; ++j) {
+                int index = (i * width + j) * 4;
+                row[j * 3] = pixels[index];
+                row[j * 3 + 1] = pixels[index + 1];
+                row[j * 3 + 2] = pixels[index + 2];
+            }
+            out.write(reinterpret_cast<const char*>(row.data()), row.size());
+        }
+        return static_cast<bool>(out);
     }
 
+    const unsigned char* data() const { return pixels.data(); }
+    unsigned char* data() { return pixels.data(); }
     int get_width() const { return width; }
     int get_height() const { return height; }
-
-    ~GHDImage() {
-        if (textureInitialized) {
-            glDeleteTextures(1, &textureId);
-        }
-    }
 };
 
 // Example usage:
-// Image img(256, 256);
+// GHDImage img(256, 256);
 // img.set_pixel(10, 10, 255, 0, 0); // Set pixel (10, 10) to red
-// img.bind_texture();
-// ImGui::Image(img.get_imgui_texture_id(), ImVec2(img.get_width(), img.get_height()));
+// img.write_ppm("out.ppm");
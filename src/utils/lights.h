@@ -0,0 +1,126 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+// Emissive spheres of a scene, for sampling light directly (next event estimation).
+// A light is picked uniformly and a direction toward it uniformly inside the cone
+// the sphere subtends from the shading point, which never misses the light and
+// keeps the density finite however small the sphere is.
+
+#include "rtweekend.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "../primitives/sphere.h"
+#include "../primitives/sphere_soa.h"
+
+#include <vector>
+
+struct sphere_light {
+    point3 center;
+    double radius;
+    const material* mat_ptr;
+};
+
+// Orthonormal basis around the unit vector n, without branches (Duff et al. 2017)
+inline void orthonormal_basis(const vec3& n, vec3& b1, vec3& b2) {
+    const double sign = std::copysign(1.0, n.z());
+    const double a = -1.0 / (sign + n.z());
+    const double b = n.x() * n.y() * a;
+    b1 = vec3(1.0 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+    b2 = vec3(b, sign + n.y() * n.y() * a, -n.y());
+}
+
+class light_list {
+    public:
+        // Every sphere of the world whose material gives off light, packed spheres
+        // (e.g. from a scene file) included
+        void build(const hittable_list& world) {
+            lights.clear();
+            for (const auto& object : world.objects) {
+                const sphere* s = dynamic_cast<const sphere*>(object.get());
+                if (s && s->mat_ptr->type == material_type::diffuse_light)
+                    lights.push_back({ s->center, fabs(s->radius), s->mat_ptr.get() });
+
+                const sphere_soa* packed = dynamic_cast<const sphere_soa*>(object.get());
+                if (packed && has_light(packed->materials)) {
+                    const sphere_arrays arrays = packed->arrays();
+                    for (size_t i = 0; i < packed->size(); i++) {
+                        const material* m = packed->sphere_material(i);
+                        if (m->type == material_type::diffuse_light)
+                            lights.push_back({ point3(arrays.cx[i], arrays.cy[i], arrays.cz[i]), fabs(arrays.radius[i]), m });
+                    }
+                }
+            }
+        }
+
+        bool empty() const { return lights.empty(); }
+        int size() const { return static_cast<int>(lights.size()); }
+        const sphere_light& operator[](int index) const { return lights[index]; }
+
+        // Picks a light with pick and a direction toward it from p with (u, v), all in
+        // [0,1). pdf is the density of the direction per solid angle, including the
+        // choice of the light. Returns false if p is inside the light.
+        bool sample(const point3& p, double pick, double u, double v, int& index, vec3& direction, double& pdf) const {
+            index = static_cast<int>(pick * lights.size());
+            index = index < size() ? index : size() - 1;
+            const sphere_light& light = lights[index];
+
+            double one_minus_cos_max;
+            if (!cone(light, p, one_minus_cos_max))
+                return false;
+
+            // z is uniform in [cos_max, 1], 1 - z and 1 - z^2 without cancellation
+            const double one_minus_z = v * one_minus_cos_max;
+            const double sin_theta = sqrt(fmax(0.0, one_minus_z * (2 - one_minus_z)));
+            double s, c;
+            sincos_turns(u, s, c);
+
+            const vec3 w = unit_vector(light.center - p);
+            vec3 b1, b2;
+            orthonormal_basis(w, b1, b2);
+            direction = (c * sin_theta) * b1 + (s * sin_theta) * b2 + (1 - one_minus_z) * w;
+            pdf = 1.0 / (lights.size() * 2 * pi * one_minus_cos_max);
+            return true;
+        }
+
+        // Density of sample() picking the direction from p that hit rec, 0 if rec is
+        // not on one of the lights
+        double pdf(const point3& p, const hit_record& rec) const {
+            for (const sphere_light& light : lights) {
+                if (light.mat_ptr != rec.mat_ptr || !on_surface(light, rec.p))
+                    continue;
+                double one_minus_cos_max;
+                if (!cone(light, p, one_minus_cos_max))
+                    return 0;
+                return 1.0 / (lights.size() * 2 * pi * one_minus_cos_max);
+            }
+            return 0;
+        }
+
+        static bool on_surface(const sphere_light& light, const point3& p) {
+            return fabs((p - light.center).length() - light.radius) <= 1e-6 * (1 + light.radius);
+        }
+
+    private:
+        std::vector<sphere_light> lights;
+
+        // Skips scanning the spheres of a packed set without any light material
+        static bool has_light(const std::vector<shared_ptr<material>>& materials) {
+            for (const auto& m : materials)
+                if (m->type == material_type::diffuse_light)
+                    return true;
+            return false;
+        }
+
+        // 1 - cos of the half angle of the cone the light subtends from p, computed as
+        // sin^2 / (1 + cos) so that small, far lights keep their precision
+        static bool cone(const sphere_light& light, const point3& p, double& one_minus_cos_max) {
+            const double distance_squared = (light.center - p).length_squared();
+            const double sin2_max = light.radius * light.radius / distance_squared;
+            if (sin2_max >= 1)
+                return false;
+            one_minus_cos_max = sin2_max / (1 + sqrt(1 - sin2_max));
+            return true;
+        }
+};
+
+#endif
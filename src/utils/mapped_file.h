@@ -0,0 +1,120 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+// Read-only memory mapping of a whole file. Pages are read in by the OS when they
+// are first touched, so opening a large file costs about the same as a small one.
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class mapped_file {
+    public:
+        mapped_file() {}
+        ~mapped_file() { close(); }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        // Returns false and prints why if the file cannot be mapped
+        bool open(const std::string& path);
+        void close();
+
+        const char* data() const { return static_cast<const char*>(address); }
+        size_t size() const { return length; }
+
+    private:
+        const void* address = nullptr;
+        size_t length = 0;
+#if defined(_WIN32)
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = NULL;
+#endif
+};
+
+#if defined(_WIN32)
+
+inline bool mapped_file::open(const std::string& path) {
+    close();
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        std::cerr << "Could not open " << path << "\n";
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        std::cerr << "Could not map " << path << ": empty file\n";
+        close();
+        return false;
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping != NULL)
+        address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!address) {
+        std::cerr << "Could not map " << path << "\n";
+        close();
+        return false;
+    }
+    length = static_cast<size_t>(file_size.QuadPart);
+    return true;
+}
+
+inline void mapped_file::close() {
+    if (address) UnmapViewOfFile(address);
+    if (mapping != NULL) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    address = nullptr;
+    length = 0;
+    mapping = NULL;
+    file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+inline bool mapped_file::open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Could not open " << path << "\n";
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        std::cerr << "Could not map " << path << ": empty file\n";
+        ::close(fd);
+        return false;
+    }
+    void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Could not map " << path << "\n";
+        return false;
+    }
+    address = mapped;
+    length = static_cast<size_t>(info.st_size);
+    return true;
+}
+
+inline void mapped_file::close() {
+    if (address)
+        munmap(const_cast<void*>(address), length);
+    address = nullptr;
+    length = 0;
+}
+
+#endif
+
+#endif
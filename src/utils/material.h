@@ -1,84 +1,83 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+// Materials are a type tag and that type's parameters in one small class, not a
+// class hierarchy. Calls dispatch with a switch over the tag, which the compiler can
+// inline, and the wavefront renderer shades all hits of one type as a batch with the
+// type known at compile time (the *_as<type> functions). lambertian, metal,
+// dielectric and diffuse_light only set the tag and the parameters.
+
 #include "rtweekend.h"
+#include "hittable.h"
+#include "sampler.h"
 
-struct hit_record;
+#include <type_traits>
 
-class material {
-    public:
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const = 0;
+enum class material_type : int {
+    lambertian,
+    metal,
+    dielectric,
+    diffuse_light
 };
 
-class lambertian : public material {
-    public:
-        lambertian(const color& a) : albedo(a) {}
+static const int material_type_count = 4;
 
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const override {
-            auto scatter_direction = rec.normal + random_unit_vector();
+// Calls f(std::integral_constant<material_type, type>()), so that f sees the type as a
+// constant and can call the *_as<type> functions
+template <typename F>
+inline auto dispatch_material(material_type type, F&& f) {
+    switch (type) {
+    case material_type::metal: return f(std::integral_constant<material_type, material_type::metal>());
+    case material_type::dielectric: return f(std::integral_constant<material_type, material_type::dielectric>());
+    case material_type::diffuse_light: return f(std::integral_constant<material_type, material_type::diffuse_light>());
+    default: return f(std::integral_constant<material_type, material_type::lambertian>());
+    }
+}
 
-            // Catch degenerate scatter direction
-            if (scatter_direction.near_zero())
-                scatter_direction = rec.normal;
+class material {
+    public:
+        // Picks the direction the path continues in. attenuation is the BRDF times the
+        // cosine divided by the density of that choice. Returns false if the path ends.
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
+            return dispatch_material(type, [&](auto t) {
+                return scatter_as<decltype(t)::value>(r_in, rec, attenuation, scattered);
+            });
+        }
 
-            scattered = ray(rec.p, scatter_direction);
-            attenuation = albedo;
-            return true;
+        // Light given off by the surface
+        color emitted() const {
+            return type == material_type::diffuse_light ? albedo : color(0, 0, 0);
         }
 
-    public:
-        color albedo;
-};
+        // Density per solid angle of scatter() picking direction, and the BRDF times
+        // the cosine for it. Both stay 0 for materials that scatter in a few discrete
+        // directions (or that we cannot evaluate), the renderer does not sample
+        // lights from those.
+        double scattering_pdf(const hit_record& rec, const vec3& direction) const {
+            return type == material_type::lambertian ? scattering_pdf_as<material_type::lambertian>(rec, direction) : 0;
+        }
 
-class metal : public material {
-    public:
-        metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
-
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const override {
-            vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
-            attenuation = albedo;
-            return (dot(scattered.direction(), rec.normal) > 0);
+        color scattering(const hit_record& rec, const vec3& direction) const {
+            return type == material_type::lambertian ? albedo * scattering_pdf_as<material_type::lambertian>(rec, direction) : color(0, 0, 0);
         }
 
+        // scatter() for a material known to be of type T
+        template <material_type T>
+        bool scatter_as(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const;
+
+        template <material_type T>
+        double scattering_pdf_as(const hit_record& rec, const vec3& direction) const;
+
     public:
+        material_type type;
+        // lambertian and metal: reflectance, diffuse_light: the light given off
         color albedo;
-        double fuzz;
-};
+        double fuzz; // metal
+        double ir;   // dielectric, index of refraction
 
-class dielectric : public material {
-    public:
-        dielectric(double index_of_refraction) : ir(index_of_refraction) {}
-
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const override {
-            attenuation = color(1.0, 1.0, 1.0);
-            double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
-
-            vec3 unit_direction = unit_vector(r_in.direction());
-            double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-            double sin_theta = sqrt(1.0 - cos_theta*cos_theta);
-
-            bool cannot_refract = refraction_ratio * sin_theta > 1.0;
-            vec3 direction;
-            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
-                direction = reflect(unit_direction, rec.normal);
-            else
-                direction = refract(unit_direction, rec.normal, refraction_ratio);
-
-            scattered = ray(rec.p, direction);
-            return true;
-        }
+    protected:
+        material(material_type type, const color& albedo, double fuzz, double ir) : type(type), albedo(albedo), fuzz(fuzz), ir(ir) {}
 
-    public:
-        double ir; // Index of Refraction
     private:
         static double reflectance(double cosine, double ref_idx) {
             // Use Schlick's approximation for reflectance.
@@ -88,4 +87,82 @@ class dielectric : public material {
         }
 };
 
-#endif
\ No newline at end of file
+// Lights use none of the parameters, so they are [[maybe_unused]] for compilers
+// that warn per instantiation
+template <material_type T>
+inline bool material::scatter_as([[maybe_unused]] const ray& r_in, [[maybe_unused]] const hit_record& rec,
+                                 [[maybe_unused]] color& attenuation, [[maybe_unused]] ray& scattered) const {
+    if constexpr (T == material_type::lambertian) {
+        auto scatter_direction = rec.normal + sample_unit_vector();
+
+        // Catch degenerate scatter direction
+        if (scatter_direction.near_zero())
+            scatter_direction = rec.normal;
+
+        scattered = ray(rec.p, scatter_direction);
+        attenuation = albedo;
+        return true;
+    }
+    else if constexpr (T == material_type::metal) {
+        vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+        scattered = ray(rec.p, reflected + fuzz*sample_in_unit_sphere());
+        attenuation = albedo;
+        return (dot(scattered.direction(), rec.normal) > 0);
+    }
+    else if constexpr (T == material_type::dielectric) {
+        attenuation = color(1.0, 1.0, 1.0);
+        double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
+
+        vec3 unit_direction = unit_vector(r_in.direction());
+        double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+        double sin_theta = sqrt(1.0 - cos_theta*cos_theta);
+
+        bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+        vec3 direction;
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > sample_1d())
+            direction = reflect(unit_direction, rec.normal);
+        else
+            direction = refract(unit_direction, rec.normal, refraction_ratio);
+
+        scattered = ray(rec.p, direction);
+        return true;
+    }
+    else {
+        // Lights end the path
+        return false;
+    }
+}
+
+template <material_type T>
+inline double material::scattering_pdf_as(const hit_record& rec, const vec3& direction) const {
+    if constexpr (T == material_type::lambertian) {
+        // normal + a uniform unit vector is cosine distributed around the normal
+        double cosine = dot(rec.normal, unit_vector(direction));
+        return cosine > 0 ? cosine / pi : 0;
+    }
+    else {
+        return 0;
+    }
+}
+
+class lambertian : public material {
+    public:
+        lambertian(const color& a) : material(material_type::lambertian, a, 0, 1) {}
+};
+
+class metal : public material {
+    public:
+        metal(const color& a, double f) : material(material_type::metal, a, f < 1 ? f : 1, 1) {}
+};
+
+class dielectric : public material {
+    public:
+        dielectric(double index_of_refraction) : material(material_type::dielectric, color(1, 1, 1), 0, index_of_refraction) {}
+};
+
+class diffuse_light : public material {
+    public:
+        diffuse_light(const color& c) : material(material_type::diffuse_light, c, 0, 1) {}
+};
+
+#endif
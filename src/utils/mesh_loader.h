@@ -0,0 +1,394 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+// Streaming OBJ and PLY readers that fill a triangle_mesh. Files are read one line
+// (OBJ, ASCII PLY) or one value (binary PLY) at a time straight into the mesh's
+// vertex and index buffers, polygons are split into triangle fans. Only positions,
+// normals and faces are read, texture coordinates and materials are skipped.
+// The mesh is not built, set its material and call build() afterwards.
+
+#include "rtweekend.h"
+#include "../primitives/triangle_mesh.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Fan triangulation of a polygon fed one corner at a time
+class polygon_fan {
+    public:
+        void start() { corners = 0; }
+
+        void add(triangle_mesh& mesh, uint32_t vertex) {
+            if (corners == 0) first = vertex;
+            else if (corners >= 2) mesh.add_triangle(first, previous, vertex);
+            previous = vertex;
+            corners++;
+        }
+
+    private:
+        int corners = 0;
+        uint32_t first = 0;
+        uint32_t previous = 0;
+};
+
+// Wavefront OBJ: v, vn and f records. Face corners are v, v/vt, v//vn or v/vt/vn,
+// negative indices count back from the last vertex.
+inline bool load_obj(const std::string& path, triangle_mesh& mesh) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Could not open " << path << "\n";
+        return false;
+    }
+
+    // OBJ indexes positions and normals separately. A mesh vertex is made for every
+    // (position, normal) pair in use, the first pair of a position is kept next to
+    // it and only the others need the map.
+    std::vector<point3> positions;
+    std::vector<vec3> obj_normals;
+    std::vector<uint32_t> position_vertex;
+    std::vector<int64_t> position_normal;
+    std::unordered_map<uint64_t, uint32_t> other_pairs;
+    const uint32_t unset = ~0u;
+    bool missing_normal = false;
+
+    auto corner_vertex = [&](int64_t p, int64_t n) {
+        if (position_vertex[p] != unset && position_normal[p] == n)
+            return position_vertex[p];
+        const uint64_t key = (static_cast<uint64_t>(p) << 32) | static_cast<uint64_t>(n + 1);
+        if (position_vertex[p] != unset) {
+            auto found = other_pairs.find(key);
+            if (found != other_pairs.end())
+                return found->second;
+        }
+
+        uint32_t vertex;
+        if (n >= 0) {
+            vertex = mesh.add_vertex(positions[p], obj_normals[n]);
+        }
+        else {
+            vertex = mesh.add_vertex(positions[p], vec3(0, 0, 0));
+            missing_normal = true;
+        }
+        if (position_vertex[p] == unset) {
+            position_vertex[p] = vertex;
+            position_normal[p] = n;
+        }
+        else {
+            other_pairs[key] = vertex;
+        }
+        return vertex;
+    };
+
+    // 1-based, negative is relative to the end, -1 for an invalid index
+    auto resolve = [](long index, size_t count) -> int64_t {
+        int64_t resolved = index > 0 ? index - 1 : static_cast<int64_t>(count) + index;
+        return resolved >= 0 && resolved < static_cast<int64_t>(count) ? resolved : -1;
+    };
+
+    std::string line;
+    polygon_fan fan;
+    size_t line_number = 0;
+    while (std::getline(in, line)) {
+        line_number++;
+        const char* c = line.c_str();
+        while (*c == ' ' || *c == '\t') c++;
+
+        if (c[0] == 'v' && (c[1] == ' ' || c[1] == '\t')) {
+            char* end;
+            double x = strtod(c + 2, &end);
+            double y = strtod(end, &end);
+            double z = strtod(end, &end);
+            positions.push_back(point3(x, y, z));
+            position_vertex.push_back(unset);
+            position_normal.push_back(-1);
+        }
+        else if (c[0] == 'v' && c[1] == 'n' && (c[2] == ' ' || c[2] == '\t')) {
+            char* end;
+            double x = strtod(c + 3, &end);
+            double y = strtod(end, &end);
+            double z = strtod(end, &end);
+            obj_normals.push_back(vec3(x, y, z));
+        }
+        else if (c[0] == 'f' && (c[1] == ' ' || c[1] == '\t')) {
+            fan.start();
+            char* p = const_cast<char*>(c + 2);
+            while (true) {
+                while (*p == ' ' || *p == '\t') p++;
+                if (*p == '\0' || *p == '\r' || *p == '#') break;
+
+                char* end;
+                const int64_t position = resolve(strtol(p, &end, 10), positions.size());
+                int64_t normal = -1;
+                if (end == p || position < 0) {
+                    std::cerr << path << ":" << line_number << ": invalid face\n";
+                    return false;
+                }
+                p = end;
+                if (*p == '/') {
+                    p++;
+                    if (*p != '/') strtol(p, &p, 10); // texture coordinate
+                    if (*p == '/') {
+                        p++;
+                        normal = resolve(strtol(p, &end, 10), obj_normals.size());
+                        if (end == p || normal < 0) {
+                            std::cerr << path << ":" << line_number << ": invalid face\n";
+                            return false;
+                        }
+                        p = end;
+                    }
+                }
+                fan.add(mesh, corner_vertex(position, normal));
+            }
+        }
+    }
+
+    if (missing_normal)
+        mesh.normals.clear();
+    return true;
+}
+
+enum class ply_type { int8, uint8, int16, uint16, int32, uint32, float32, float64, invalid };
+
+inline ply_type ply_type_from_string(const std::string& name) {
+    if (name == "char" || name == "int8") return ply_type::int8;
+    if (name == "uchar" || name == "uint8") return ply_type::uint8;
+    if (name == "short" || name == "int16") return ply_type::int16;
+    if (name == "ushort" || name == "uint16") return ply_type::uint16;
+    if (name == "int" || name == "int32") return ply_type::int32;
+    if (name == "uint" || name == "uint32") return ply_type::uint32;
+    if (name == "float" || name == "float32") return ply_type::float32;
+    if (name == "double" || name == "float64") return ply_type::float64;
+    return ply_type::invalid;
+}
+
+struct ply_property {
+    std::string name;
+    ply_type type;
+    bool list;
+    ply_type count_type; // lists only
+};
+
+struct ply_element {
+    std::string name;
+    size_t count;
+    std::vector<ply_property> properties;
+};
+
+// Reads one value of a PLY body in any of the three formats
+class ply_reader {
+    public:
+        enum class format { ascii, binary_little_endian, binary_big_endian };
+
+        ply_reader(std::istream& in, format f) : in(in), body_format(f) {
+            const uint16_t probe = 1;
+            swap_bytes = (f == format::binary_big_endian) == (*reinterpret_cast<const uint8_t*>(&probe) == 1);
+        }
+
+        double read(ply_type type) {
+            if (body_format == format::ascii) {
+                double value = 0.0;
+                in >> value;
+                return value;
+            }
+            switch (type) {
+            case ply_type::int8: return read_binary<int8_t>();
+            case ply_type::uint8: return read_binary<uint8_t>();
+            case ply_type::int16: return read_binary<int16_t>();
+            case ply_type::uint16: return read_binary<uint16_t>();
+            case ply_type::int32: return read_binary<int32_t>();
+            case ply_type::uint32: return read_binary<uint32_t>();
+            case ply_type::float32: return read_binary<float>();
+            case ply_type::float64: return read_binary<double>();
+            default: return 0.0;
+            }
+        }
+
+        bool good() const { return static_cast<bool>(in); }
+
+    private:
+        std::istream& in;
+        format body_format;
+        bool swap_bytes;
+
+        template <typename T>
+        T read_binary() {
+            unsigned char bytes[sizeof(T)];
+            in.read(reinterpret_cast<char*>(bytes), sizeof(T));
+            if (swap_bytes) {
+                for (size_t i = 0; i < sizeof(T) / 2; i++)
+                    std::swap(bytes[i], bytes[sizeof(T) - 1 - i]);
+            }
+            T value;
+            std::memcpy(&value, bytes, sizeof(T));
+            return value;
+        }
+};
+
+// Stanford PLY, ASCII or binary. Reads x, y, z and nx, ny, nz of the vertex element
+// and the vertex_indices (or vertex_index) list of the face element.
+inline bool load_ply(const std::string& path, triangle_mesh& mesh) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Could not open " << path << "\n";
+        return false;
+    }
+
+    std::string line;
+    std::getline(in, line);
+    if (line.compare(0, 3, "ply") != 0) {
+        std::cerr << path << " is not a PLY file\n";
+        return false;
+    }
+
+    ply_reader::format body_format = ply_reader::format::ascii;
+    std::vector<ply_element> elements;
+    bool header_done = false;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        std::istringstream words(line);
+        std::string keyword;
+        words >> keyword;
+        if (keyword == "format") {
+            std::string name;
+            words >> name;
+            if (name == "ascii") body_format = ply_reader::format::ascii;
+            else if (name == "binary_little_endian") body_format = ply_reader::format::binary_little_endian;
+            else if (name == "binary_big_endian") body_format = ply_reader::format::binary_big_endian;
+            else {
+                std::cerr << path << ": unknown PLY format " << name << "\n";
+                return false;
+            }
+        }
+        else if (keyword == "element") {
+            ply_element element;
+            words >> element.name >> element.count;
+            elements.push_back(element);
+        }
+        else if (keyword == "property" && !elements.empty()) {
+            ply_property property;
+            std::string type;
+            words >> type;
+            property.list = type == "list";
+            if (property.list) {
+                std::string count_type;
+                words >> count_type >> type;
+                property.count_type = ply_type_from_string(count_type);
+            }
+            else {
+                property.count_type = ply_type::invalid;
+            }
+            property.type = ply_type_from_string(type);
+            words >> property.name;
+            if (property.type == ply_type::invalid || (property.list && property.count_type == ply_type::invalid)) {
+                std::cerr << path << ": unknown PLY type in \"" << line << "\"\n";
+                return false;
+            }
+            elements.back().properties.push_back(property);
+        }
+        else if (keyword == "end_header") {
+            header_done = true;
+            break;
+        }
+    }
+    if (!header_done) {
+        std::cerr << path << ": PLY header has no end_header\n";
+        return false;
+    }
+
+    // Faces may come before the vertices they index, so the count is taken from the
+    // header rather than from the vertex element read so far
+    size_t vertex_count = 0;
+    for (const ply_element& element : elements) {
+        if (element.name == "vertex")
+            vertex_count = element.count;
+    }
+
+    ply_reader reader(in, body_format);
+    const uint32_t first_vertex = static_cast<uint32_t>(mesh.vertex_count());
+    polygon_fan fan;
+    for (const ply_element& element : elements) {
+        // Where each property goes: 0-2 position, 3-5 normal, 6 face indices, -1 skipped
+        std::vector<int> targets;
+        bool has_normals = false;
+        for (const ply_property& property : element.properties) {
+            int target = -1;
+            if (element.name == "vertex") {
+                const char* names[] = { "x", "y", "z", "nx", "ny", "nz" };
+                for (int n = 0; n < 6; n++) {
+                    if (property.name == names[n] && !property.list)
+                        target = n;
+                }
+                has_normals = has_normals || target >= 3;
+            }
+            else if (element.name == "face" && property.list &&
+                     (property.name == "vertex_indices" || property.name == "vertex_index")) {
+                target = 6;
+            }
+            targets.push_back(target);
+        }
+
+        for (size_t item = 0; item < element.count; item++) {
+            double values[6] = {};
+            for (size_t p = 0; p < element.properties.size(); p++) {
+                const ply_property& property = element.properties[p];
+                if (!property.list) {
+                    const double value = reader.read(property.type);
+                    if (targets[p] >= 0)
+                        values[targets[p]] = value;
+                    continue;
+                }
+
+                const size_t count = static_cast<size_t>(reader.read(property.count_type));
+                fan.start();
+                for (size_t i = 0; i < count; i++) {
+                    const double index = reader.read(property.type);
+                    if (targets[p] != 6)
+                        continue;
+                    if (index < 0 || index >= static_cast<double>(vertex_count)) {
+                        std::cerr << path << ": face " << item << " has an invalid vertex index\n";
+                        return false;
+                    }
+                    fan.add(mesh, first_vertex + static_cast<uint32_t>(index));
+                }
+            }
+
+            if (element.name == "vertex") {
+                const point3 position(values[0], values[1], values[2]);
+                if (has_normals)
+                    mesh.add_vertex(position, vec3(values[3], values[4], values[5]));
+                else
+                    mesh.add_vertex(position);
+            }
+        }
+
+        if (!reader.good()) {
+            std::cerr << path << " is truncated\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Picks the reader by the file extension
+inline bool load_mesh(const std::string& path, triangle_mesh& mesh) {
+    const size_t dot = path.find_last_of('.');
+    std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+    for (char& c : extension)
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    if (extension == "obj")
+        return load_obj(path, mesh);
+    if (extension == "ply")
+        return load_ply(path, mesh);
+    std::cerr << path << ": unknown mesh format, expected .obj or .ply\n";
+    return false;
+}
+
+#endif
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socket_handle;
+static const socket_handle invalid_socket_handle = INVALID_SOCKET;
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int socket_handle;
+static const socket_handle invalid_socket_handle = -1;
+#endif
+
+// Blocking TCP socket, just enough for the render coordinator and its workers.
+// Sends and receives whole buffers; every call returns false once the connection
+// is gone. Values go over the wire in host byte order, so both ends must share
+// the same endianness.
+class Socket {
+public:
+	Socket() {}
+	explicit Socket(socket_handle handle) : m_handle(handle) {}
+	Socket(Socket&& other) noexcept : m_handle(other.m_handle) { other.m_handle = invalid_socket_handle; }
+	Socket& operator=(Socket&& other) noexcept {
+		if (this != &other) {
+			close();
+			m_handle = other.m_handle;
+			other.m_handle = invalid_socket_handle;
+		}
+		return *this;
+	}
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+	~Socket() { close(); }
+
+	bool is_open() const { return m_handle != invalid_socket_handle; }
+
+	void close() {
+		if (!is_open())
+			return;
+#ifdef _WIN32
+		closesocket(m_handle);
+#else
+		::close(m_handle);
+#endif
+		m_handle = invalid_socket_handle;
+	}
+
+	// Connects to host:port, returns a closed socket on failure
+	static Socket connect(const std::string& host, int port) {
+		if (!startup())
+			return Socket();
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* result = nullptr;
+		if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0)
+			return Socket();
+
+		Socket socket;
+		for (addrinfo* a = result; a && !socket.is_open(); a = a->ai_next) {
+			Socket candidate(::socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+			if (candidate.is_open() && ::connect(candidate.m_handle, a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0)
+				socket = std::move(candidate);
+		}
+		freeaddrinfo(result);
+		socket.set_no_delay();
+		return socket;
+	}
+
+	// Listens on every interface, returns a closed socket on failure
+	static Socket listen(int port) {
+		if (!startup())
+			return Socket();
+		Socket socket(::socket(AF_INET, SOCK_STREAM, 0));
+		if (!socket.is_open())
+			return socket;
+
+		int reuse = 1;
+		setsockopt(socket.m_handle, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(static_cast<uint16_t>(port));
+		if (bind(socket.m_handle, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+			::listen(socket.m_handle, 4) != 0)
+			socket.close();
+		return socket;
+	}
+
+	Socket accept() const {
+		Socket socket(::accept(m_handle, nullptr, nullptr));
+		socket.set_no_delay();
+		return socket;
+	}
+
+	bool send_all(const void* data, size_t size) {
+		const char* bytes = static_cast<const char*>(data);
+		while (size > 0 && is_open()) {
+			int chunk = static_cast<int>(size < (1u << 30) ? size : (1u << 30));
+			int sent = static_cast<int>(::send(m_handle, bytes, chunk, send_flags));
+			if (sent <= 0) {
+				close();
+				return false;
+			}
+			bytes += sent;
+			size -= sent;
+		}
+		return is_open();
+	}
+
+	bool receive_all(void* data, size_t size) {
+		char* bytes = static_cast<char*>(data);
+		while (size > 0 && is_open()) {
+			int chunk = static_cast<int>(size < (1u << 30) ? size : (1u << 30));
+			int received = static_cast<int>(::recv(m_handle, bytes, chunk, 0));
+			if (received <= 0) {
+				close();
+				return false;
+			}
+			bytes += received;
+			size -= received;
+		}
+		return is_open();
+	}
+
+	template <typename T>
+	bool send_value(const T& value) { return send_all(&value, sizeof(T)); }
+
+	template <typename T>
+	bool receive_value(T& value) { return receive_all(&value, sizeof(T)); }
+
+	// Length prefixed byte string
+	bool send_string(const std::string& value) {
+		uint64_t size = value.size();
+		return send_value(size) && send_all(value.data(), value.size());
+	}
+
+	// The size comes from the peer, a string longer than max_size closes the
+	// connection before anything is allocated
+	bool receive_string(std::string& value, uint64_t max_size) {
+		uint64_t size = 0;
+		if (!receive_value(size))
+			return false;
+		if (size > max_size) {
+			close();
+			return false;
+		}
+		value.resize(static_cast<size_t>(size));
+		return receive_all(&value[0], value.size());
+	}
+
+private:
+	socket_handle m_handle = invalid_socket_handle;
+
+	// A peer that went away must not kill the process with SIGPIPE
+#ifdef MSG_NOSIGNAL
+	static const int send_flags = MSG_NOSIGNAL;
+#else
+	static const int send_flags = 0;
+#endif
+
+	void set_no_delay() {
+		if (!is_open())
+			return;
+		int no_delay = 1;
+		setsockopt(m_handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&no_delay), sizeof(no_delay));
+	}
+
+	// Winsock has to be initialized once per process
+	static bool startup() {
+#ifdef _WIN32
+		static bool started = [] {
+			WSADATA data;
+			return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+		}();
+		return started;
+#else
+		return true;
+#endif
+	}
+};
@@ -1,53 +1,138 @@
 #pragma once
 
 #include <vector>
-#include <glad/glad.h>
 #include <iostream>
+#include <algorithm>
 #include "color.h"
 
+// Accumulation buffer precision and layout, picked at build time:
+// GHD_ACCUM_DOUBLE accumulates in float64 instead of float32, GHD_ACCUM_PLANAR
+// stores one plane per channel instead of interleaved RGB.
+#ifdef GHD_ACCUM_DOUBLE
+typedef double accum_t;
+#else
+typedef float accum_t;
+#endif
+
+#ifdef GHD_ACCUM_PLANAR
+const int accum_pixel_stride = 1; // distance between two pixels of the same channel
+#else
+const int accum_pixel_stride = 3;
+#endif
+
+// Per pixel sums of the samples (RGB, no alpha), their luminance second moment
+// and their count. The hot path addresses pixels by their flat index
+// (row * width + column) without bounds checks.
 class RawImage {
 private:
-    int width, height;
-    std::vector<double> pixels; // Flat array to store RGBA pixels
-    friend class Renderer;
-    friend class GHDImage;
+    int width = 0, height = 0;
+    std::vector<accum_t> sums;
+    std::vector<accum_t> moments; // Sum of the squared luminance of every sample, per pixel
+    std::vector<int> sample_counts; // Samples accumulated per pixel
 
 public:
     // default constructor
     RawImage() {}
     RawImage(int w, int h) : width(w), height(h) {
-        pixels.resize(width * height * 4, 0.0); // Initialize with white (RGBA)
+        sums.resize(static_cast<size_t>(width) * height * 3, accum_t(0));
+        moments.resize(static_cast<size_t>(width) * height, accum_t(0));
+        sample_counts.resize(static_cast<size_t>(width) * height, 0);
+    }
+
+    // Drops every sample, keeping the allocation
+    void clear() {
+        std::fill(sums.begin(), sums.end(), accum_t(0));
+        std::fill(moments.begin(), moments.end(), accum_t(0));
+        std::fill(sample_counts.begin(), sample_counts.end(), 0);
+    }
+
+    int pixel_index(int i, int j) const { return i * width + j; }
+
+    // Channel c (0 red, 1 green, 2 blue) of the pixel, the same channel of the next
+    // pixel is accum_pixel_stride elements further
+    const accum_t* channel(int c, int index) const {
+#ifdef GHD_ACCUM_PLANAR
+        return &sums[static_cast<size_t>(c) * width * height + index];
+#else
+        return &sums[static_cast<size_t>(index) * 3 + c];
+#endif
     }
+    accum_t* channel(int c, int index) {
+        return const_cast<accum_t*>(static_cast<const RawImage*>(this)->channel(c, index));
+    }
+
+    const int* counts(int index) const { return &sample_counts[index]; }
 
     //get pixel
-    color get_pixel(int i, int j) {
+    color get_pixel(int i, int j) const {
         if (i < 0 || i >= height || j < 0 || j >= width) {
             std::cerr << "Pixel coordinates out of bounds: (" << i << ", " << j << ")\n";
             return color(0, 0, 0);
         }
 
-        int index = (i * width + j) * 4;
-        return color(pixels[index], pixels[index + 1], pixels[index + 2]);
+        int index = pixel_index(i, j);
+        return color(*channel(0, index), *channel(1, index), *channel(2, index));
     }
 
-    void set_pixel(int i, int j, double r, double g, double b, double a = 1.0) {
-        if (i < 0 || i >= height || j < 0 || j >= width) {
-            std::cerr << "Pixel coordinates out of bounds: (" << i << ", " << j << ")\n";
-            return;
-        }
+    // Accumulates one sample into the pixel sum and the luminance second moment
+    void add_sample(int index, const color& sample) {
+        *channel(0, index) += static_cast<accum_t>(sample.x());
+        *channel(1, index) += static_cast<accum_t>(sample.y());
+        *channel(2, index) += static_cast<accum_t>(sample.z());
 
-        int index = (i * width + j) * 4;
-        pixels[index] = r;
-        pixels[index + 1] = g;
-        pixels[index + 2] = b;
-        pixels[index + 3] = a;
+        double y = luminance(sample);
+        moments[index] += static_cast<accum_t>(y * y);
+        sample_counts[index]++;
     }
+
+    void add_sample(int i, int j, const color& sample) { add_sample(pixel_index(i, j), sample); }
+
+    int get_sample_count(int i, int j) const { return sample_counts[pixel_index(i, j)]; }
+
+    // Standard error of the pixel's mean luminance, relative to the mean.
+    // The 0.05 floor keeps near-black pixels from needing an unbounded number of samples.
+    double relative_error(int i, int j) const {
+        int index = pixel_index(i, j);
+        int n = sample_counts[index];
+        if (n < 2) return infinity;
+
+        double mean = luminance(color(*channel(0, index), *channel(1, index), *channel(2, index))) / n;
+        double variance = fmax(0.0, (moments[index] / n - mean * mean) * n / (n - 1));
+        return sqrt(variance / n) / (mean + 0.05);
+    }
+
+    static double luminance(const color& c) {
+        return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+    }
+
     int get_width() const { return width; }
     int get_height() const { return height; }
 
+    // Adds the samples of another buffer of the same size
+    void add(const RawImage& other) {
+        for (size_t k = 0; k < sums.size(); k++)
+            sums[k] += other.sums[k];
+        for (size_t k = 0; k < moments.size(); k++) {
+            moments[k] += other.moments[k];
+            sample_counts[k] += other.sample_counts[k];
+        }
+    }
+
+    // Raw dump of the buffers, the reader must have been created with the same size
+    bool write(std::ostream& out) const {
+        out.write(reinterpret_cast<const char*>(sums.data()), sums.size() * sizeof(accum_t));
+        out.write(reinterpret_cast<const char*>(moments.data()), moments.size() * sizeof(accum_t));
+        out.write(reinterpret_cast<const char*>(sample_counts.data()), sample_counts.size() * sizeof(int));
+        return static_cast<bool>(out);
+    }
+
+    bool read(std::istream& in) {
+        in.read(reinterpret_cast<char*>(sums.data()), sums.size() * sizeof(accum_t));
+        in.read(reinterpret_cast<char*>(moments.data()), moments.size() * sizeof(accum_t));
+        in.read(reinterpret_cast<char*>(sample_counts.data()), sample_counts.size() * sizeof(int));
+        return static_cast<bool>(in);
+    }
+
+    // Bytes per pixel of the buffer
+    static size_t pixel_bytes() { return 3 * sizeof(accum_t) + sizeof(accum_t) + sizeof(int); }
 };
-// Example usage:
-// Image img(256, 256);
-// img.set_pixel(10, 10, 255, 0, 0); // Set pixel (10, 10) to red
-// img.bind_texture();
-// ImGui::Image(img.get_imgui_texture_id(), ImVec2(img.get_width(), img.get_height()));
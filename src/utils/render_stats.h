@@ -0,0 +1,123 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Stages of a pass that are timed. In wavefront mode each stage runs on its own
+// over a whole tile. The per path tracer interleaves them for every pixel, so there
+// everything but the resolve counts as Trace.
+enum class RenderStage {
+	Generate, // camera rays
+	Trace,    // intersections
+	Shade,    // scattering and light sampling
+	Resolve,  // accumulation buffer to 8-bit image
+	Count
+};
+
+inline const char* render_stage_name(RenderStage stage) {
+	switch (stage) {
+	case RenderStage::Generate: return "generate";
+	case RenderStage::Trace: return "trace";
+	case RenderStage::Shade: return "shade";
+	case RenderStage::Resolve: return "resolve";
+	default: return "unknown";
+	}
+}
+
+static const int render_stage_count = static_cast<int>(RenderStage::Count);
+
+// Counters of one render thread, or their sum over a pass. Every thread writes only
+// its own copy, padded to a cache line so the copies never share one.
+struct alignas(64) PassCounters {
+	uint64_t rays = 0;            // every ray traced, shadow rays included
+	uint64_t shadow_rays = 0;     // of which were traced toward a sampled light
+	uint64_t paths = 0;           // camera samples
+	uint64_t nodes_visited = 0;   // BVH nodes whose box was tested
+	uint64_t primitive_tests = 0; // primitives tested in the leaves reached
+	double stage_ms[render_stage_count] = {};
+
+	void add(const PassCounters& other) {
+		rays += other.rays;
+		shadow_rays += other.shadow_rays;
+		paths += other.paths;
+		nodes_visited += other.nodes_visited;
+		primitive_tests += other.primitive_tests;
+		for (int s = 0; s < render_stage_count; ++s)
+			stage_ms[s] += other.stage_ms[s];
+	}
+
+	// Segments per path, the camera ray included
+	double average_path_depth() const { return paths > 0 ? static_cast<double>(rays - shadow_rays) / paths : 0.0; }
+	double nodes_per_ray() const { return rays > 0 ? static_cast<double>(nodes_visited) / rays : 0.0; }
+	double tests_per_ray() const { return rays > 0 ? static_cast<double>(primitive_tests) / rays : 0.0; }
+};
+
+// Counters of the tile the calling thread is working on, like thread_rng(). The BVH
+// adds to them while it traverses, the renderer folds them into its per thread copy
+// after every tile and starts over.
+inline PassCounters& thread_counters() {
+	thread_local PassCounters counters;
+	return counters;
+}
+
+// One finished pass. Stage times are summed over the render threads, the wall time is not.
+struct PassStats {
+	int iteration = 0;
+	double start_ms = 0.0; // since the reset
+	double wall_ms = 0.0;
+	PassCounters counters;
+
+	double rays_per_second() const { return wall_ms > 0.0 ? counters.rays / (wall_ms / 1000.0) : 0.0; }
+};
+
+// A span on one render thread, for the Chrome trace
+struct TraceEvent {
+	const char* name;
+	int thread;
+	double start_us; // since the reset
+	double duration_us;
+};
+
+inline void write_pass_stats_json(std::ostream& out, const std::vector<PassStats>& passes) {
+	PassCounters total;
+	double wall_ms = 0.0;
+	for (const PassStats& pass : passes) {
+		total.add(pass.counters);
+		wall_ms += pass.wall_ms;
+	}
+
+	auto write_counters = [&out](const PassCounters& c) {
+		out << "\"rays\": " << c.rays << ", \"shadow_rays\": " << c.shadow_rays << ", \"paths\": " << c.paths
+			<< ", \"nodes_visited\": " << c.nodes_visited << ", \"primitive_tests\": " << c.primitive_tests
+			<< ", \"average_path_depth\": " << c.average_path_depth() << ", \"stage_ms\": {";
+		for (int s = 0; s < render_stage_count; ++s)
+			out << (s ? ", " : "") << "\"" << render_stage_name(static_cast<RenderStage>(s)) << "\": " << c.stage_ms[s];
+		out << "}";
+	};
+
+	out << "{\n  \"passes\": [\n";
+	for (size_t p = 0; p < passes.size(); ++p) {
+		const PassStats& pass = passes[p];
+		out << "    {\"iteration\": " << pass.iteration << ", \"start_ms\": " << pass.start_ms << ", \"wall_ms\": " << pass.wall_ms
+			<< ", \"rays_per_sec\": " << pass.rays_per_second() << ", ";
+		write_counters(pass.counters);
+		out << "}" << (p + 1 < passes.size() ? "," : "") << "\n";
+	}
+	out << "  ],\n  \"total\": {\"passes\": " << passes.size() << ", \"wall_ms\": " << wall_ms << ", ";
+	write_counters(total);
+	out << "}\n}\n";
+}
+
+// Chrome trace event format, opens in chrome://tracing or Perfetto
+inline void write_chrome_trace(std::ostream& out, const std::vector<TraceEvent>& events) {
+	out << "{\"traceEvents\": [\n";
+	for (size_t e = 0; e < events.size(); ++e) {
+		const TraceEvent& event = events[e];
+		out << "  {\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+			<< ", \"ts\": " << event.start_us << ", \"dur\": " << event.duration_us << "}"
+			<< (e + 1 < events.size() ? "," : "") << "\n";
+	}
+	out << "], \"displayTimeUnit\": \"ms\"}\n";
+}
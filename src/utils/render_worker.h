@@ -0,0 +1,200 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "renderer.h"
+#include "image.h"
+
+// Lock-free single producer / single consumer triple buffer.
+// The producer fills back_buffer() and publishes it, the consumer picks up the
+// most recently published buffer with acquire(). Neither side ever waits.
+template <typename T>
+class TripleBuffer {
+public:
+	T& back_buffer() { return m_buffers[m_back]; }
+	const T& front_buffer() const { return m_buffers[m_front]; }
+
+	// Producer: swap the back buffer with the middle one and mark it fresh
+	void publish() {
+		m_back = m_middle.exchange(m_back | fresh_bit, std::memory_order_acq_rel) & index_mask;
+	}
+
+	// Consumer: returns true if a new buffer was published since the last call
+	bool acquire() {
+		if (!(m_middle.load(std::memory_order_relaxed) & fresh_bit))
+			return false;
+		m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & index_mask;
+		return true;
+	}
+
+private:
+	static const int fresh_bit = 4;
+	static const int index_mask = 3;
+
+	T m_buffers[3];
+	int m_back = 0;
+	std::atomic<int> m_middle{1};
+	int m_front = 2;
+};
+
+// Everything the GUI can change. A change restarts the render.
+struct RenderSettings {
+	int width = 800;
+	int height = 600;
+	int samples_per_pixel = 4;
+	int max_depth = 4;
+	SceneName scene_name = SceneName::FLOOR_SPHERE;
+	double aperture = 0.1;
+	bool adaptive = false;
+	double adaptive_threshold = 0.02;
+
+	bool operator==(const RenderSettings& other) const {
+		return width == other.width && height == other.height && samples_per_pixel == other.samples_per_pixel &&
+			max_depth == other.max_depth && scene_name == other.scene_name && aperture == other.aperture &&
+			adaptive == other.adaptive && adaptive_threshold == other.adaptive_threshold;
+	}
+	bool operator!=(const RenderSettings& other) const { return !(*this == other); }
+};
+
+// A frame handed from the render thread to the GUI
+struct RenderFrame {
+	GHDImage image;
+	int iteration = 0;
+	int samples_per_pixel = 0;
+	float render_time = 0.0f;
+	bool converged = false;
+	// See Renderer::get_image_version()
+	uint64_t version = 0;
+	std::vector<Tile> tiles;
+	std::vector<uint64_t> tile_versions;
+	// The most recent passes, oldest first, at most max_passes of them
+	std::vector<PassStats> passes;
+	static const int max_passes = 120;
+
+	// Tiles that changed after the given version was published
+	std::vector<Tile> changed_tiles(uint64_t since_version) const {
+		std::vector<Tile> changed;
+		for (size_t t = 0; t < tiles.size(); ++t) {
+			if (tile_versions[t] > since_version)
+				changed.push_back(tiles[t]);
+		}
+		return changed;
+	}
+};
+
+// Runs progressive passes of a Renderer on a background thread so the GUI never
+// blocks on a pass. Finished passes are published through a triple buffer that the
+// GUI picks up once per frame. restart() cancels the pass in flight.
+class RenderWorker {
+public:
+	RenderWorker(Renderer& renderer, const RenderSettings& settings)
+		: m_renderer(renderer), m_settings(settings), m_restart_pending(true), m_stop(false) {
+		m_thread = std::thread([this]() { this->run(); });
+	}
+
+	RenderWorker(const RenderWorker&) = delete;
+	RenderWorker& operator=(const RenderWorker&) = delete;
+
+	~RenderWorker() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_renderer.cancel();
+		m_wake.notify_one();
+		m_thread.join();
+	}
+
+	// Cancels the current pass and starts over with the new settings. The cancel is
+	// requested under the lock, so it always lands before the render thread takes the
+	// restart, and reset() clears it for the new settings.
+	void restart(const RenderSettings& settings) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_settings = settings;
+			m_restart_pending = true;
+			m_renderer.cancel();
+		}
+		m_wake.notify_one();
+	}
+
+	// Returns true if a new frame was published since the last call
+	bool acquire_frame() { return m_frames.acquire(); }
+	const RenderFrame& get_frame() const { return m_frames.front_buffer(); }
+
+private:
+	Renderer& m_renderer;
+	RenderSettings m_settings;
+	bool m_restart_pending;
+	bool m_stop;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::thread m_thread;
+	TripleBuffer<RenderFrame> m_frames;
+
+	void run() {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+
+				// Sleep once every sample has been taken, until the settings change
+				m_wake.wait(lock, [this]() {
+					return m_stop || m_restart_pending || !finished();
+				});
+				if (m_stop)
+					return;
+
+				if (m_restart_pending) {
+					m_restart_pending = false;
+					m_renderer.set_image_width(m_settings.width);
+					m_renderer.set_image_height(m_settings.height);
+					m_renderer.set_samples_per_pixel(m_settings.samples_per_pixel);
+					m_renderer.set_max_depth(m_settings.max_depth);
+					m_renderer.set_scene_name(m_settings.scene_name);
+					m_renderer.set_camera_aperture(m_settings.aperture);
+					m_renderer.set_adaptive(m_settings.adaptive);
+					m_renderer.set_adaptive_threshold(m_settings.adaptive_threshold);
+					m_renderer.reset();
+					publish();
+				}
+			}
+
+			// A cancelled pass does not count, the restart starts over anyway
+			const int iteration = m_renderer.get_current_iteration();
+			m_renderer.set_current_iteration(iteration + 1);
+			if (!m_renderer.render()) {
+				m_renderer.set_current_iteration(iteration);
+				continue;
+			}
+			publish();
+
+			if (finished()) {
+				std::cout << "Rendering finished in " << m_renderer.get_render_time() << " miliseconds" << std::endl;
+				std::cout << "\n";
+			}
+		}
+	}
+
+	bool finished() const {
+		return m_renderer.is_converged() || m_renderer.get_current_iteration() >= m_renderer.get_samples_per_pixel();
+	}
+
+	void publish() {
+		RenderFrame& frame = m_frames.back_buffer();
+		frame.image = m_renderer.get_image();
+		frame.iteration = m_renderer.get_current_iteration();
+		frame.samples_per_pixel = m_renderer.get_samples_per_pixel();
+		frame.render_time = m_renderer.get_render_time();
+		frame.converged = m_renderer.is_converged();
+		frame.version = m_renderer.get_image_version();
+		frame.tiles = m_renderer.get_tiles();
+		frame.tile_versions = m_renderer.get_tile_versions();
+		const std::vector<PassStats>& passes = m_renderer.get_pass_stats();
+		const size_t first_pass = passes.size() > RenderFrame::max_passes ? passes.size() - RenderFrame::max_passes : 0;
+		frame.passes.assign(passes.begin() + first_pass, passes.end());
+		m_frames.publish();
+	}
+};
@@ -1,11 +1,17 @@
+#pragma once
+
 #include <utils/rtweekend.h>
 
 #include "utils/color.h"
 #include "utils/hittable_list.h"
+#include "utils/bvh.h"
 #include "primitives/sphere.h"
+#include "primitives/sphere_soa.h"
 #include "primitives/camera.h"
 #include "utils/material.h"
 #include "scenes.h"
+#include "scene_file.h"
+#include "lights.h"
 #include "image.h"
 
 // time
@@ -16,10 +22,18 @@
 #include <algorithm>
 
 #include <iostream>
+#include <fstream>
+#include <cstdio>
 #include <vector>
+#include <utility>
 #include <string>
-#include <execution>
+#include <cstring>
+#include <thread>
+#include <atomic>
 #include "raw_image.h"
+#include "thread_pool.h"
+#include "tonemap.h"
+#include "render_stats.h"
 
 using std::cout;
 using std::endl;
@@ -35,13 +49,59 @@ enum class SceneName {
 	THREE_SPHERES3,
 	FOV,
 	RANDOM,
-	GHD
+	GHD,
+	LIGHTS,
+	MESH,
+	INSTANCES
 };
 
+// Short names used on the command line
+static const char* scene_short_names[] = { "floor", "three", "three2", "three3", "fov", "random", "ghd", "lights", "mesh", "instances" };
+static const int scene_count = sizeof(scene_short_names) / sizeof(scene_short_names[0]);
+
+inline const char* scene_name_to_string(SceneName scene_name) {
+	return scene_short_names[static_cast<int>(scene_name)];
+}
+
+// Returns false if the name is unknown
+inline bool scene_name_from_string(const std::string& name, SceneName& scene_name) {
+	for (int i = 0; i < scene_count; ++i) {
+		if (name == scene_short_names[i]) {
+			scene_name = static_cast<SceneName>(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+// One path of a wavefront pass, everything needed to continue it at the next bounce
+struct PathState {
+	ray r;
+	color throughput;
+	rng_engine rng; // the path's own random stream, swapped in while it is shaded
+	pixel_sampler sampler; // and its sampler
+	double scatter_pdf;    // density the last bounce picked r with, see Renderer::emission
+	int pixel;      // index of the pixel in its tile
+};
+
+// Interleaves the bits of x and y, tiles sorted by this code follow a Z-order curve
+inline uint32_t morton_code(uint32_t x, uint32_t y) {
+	auto spread = [](uint32_t v) {
+		v &= 0x0000ffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+	return spread(x) | (spread(y) << 1);
+}
+
 class Renderer {
 public:
-	Renderer(int width, int height, int samples_per_pixel, int max_depth) : m_iteration_count(0), m_samples_per_pixel(samples_per_pixel), m_max_depth(max_depth), m_image_width(width), m_image_height(height), m_scene_name(SceneName::FLOOR_SPHERE) {
-		srand(time(NULL));
+	Renderer(int width, int height, int samples_per_pixel, int max_depth) : m_iteration_count(0), m_samples_per_pixel(samples_per_pixel), m_max_depth(max_depth), m_image_width(width), m_image_height(height), m_scene_name(SceneName::FLOOR_SPHERE), m_thread_count(0), m_verbose(true), m_ray_count(0), m_cancel_requested(false), m_tile_size(16), m_russian_roulette_depth(5),
+		m_adaptive(false), m_adaptive_threshold(0.02), m_adaptive_min_samples(8), m_converged(false), m_sample_count(0), m_wavefront(false) {
+		m_seed = static_cast<uint64_t>(time(NULL));
 
 		// // Camera
 		// point3 lookfrom(13, 2, 3);
@@ -58,7 +118,51 @@ public:
 	int get_width() const { return m_image_width; }
 	int get_height() const { return m_image_height; }
 	GHDImage& get_image() { return m_image; }
+	const RawImage& get_raw_image() const { return m_image_raw; }
 	void set_scene_name(SceneName scene_name) { m_scene_name = scene_name; }
+	// OBJ or PLY file shown by the mesh scene instead of its built-in meshes, empty for
+	// none. Loaded here, on failure prints why, returns false and keeps the built-in
+	// meshes. Applied on reset().
+	bool set_mesh_file(const std::string& mesh_file) {
+		m_mesh_file.clear();
+		m_mesh = nullptr;
+		m_mesh_hash = 0;
+		if (mesh_file.empty()) return true;
+
+		shared_ptr<triangle_mesh> mesh = load_scene_mesh(mesh_file);
+		if (!mesh)
+			return false;
+		m_mesh_file = mesh_file;
+		m_mesh = mesh;
+		return true;
+	}
+
+	// Text or compiled scene file (see scene_file.h) rendered instead of the named scene,
+	// empty for none. Loaded here, a camera in the file replaces the current one. On
+	// failure prints why, returns false and keeps the named scene. Applied on reset().
+	bool set_scene_file(const std::string& scene_file) {
+		m_scene_file.clear();
+		m_file_scene = loaded_scene();
+		m_scene_file_hash = 0;
+		if (scene_file.empty()) return true;
+
+		loaded_scene scene;
+		if (!load_scene_file(scene_file, scene))
+			return false;
+		m_scene_file = scene_file;
+		m_file_scene = scene;
+		if (scene.has_camera) {
+			const scene_camera& c = scene.camera;
+			lookfrom = point3(c.lookfrom[0], c.lookfrom[1], c.lookfrom[2]);
+			lookat = point3(c.lookat[0], c.lookat[1], c.lookat[2]);
+			vup = vec3(c.vup[0], c.vup[1], c.vup[2]);
+			vfov = c.vfov;
+			aperture = c.aperture;
+			dist_to_focus = c.focus_dist;
+		}
+		return true;
+	}
+	const std::string& get_scene_file() const { return m_scene_file; }
 	float get_render_time() const { return m_render_time; }
 	void set_iteration_count(int iteration_count) { m_iteration_count = iteration_count; }
 	void set_samples_per_pixel(int samples_per_pixel) { m_samples_per_pixel = samples_per_pixel; }
@@ -71,13 +175,98 @@ public:
 	void set_camera_vup(vec3 vup) { this->vup = vup; }
 	void set_camera_vfov(double vfov) { this->vfov = vfov; }
 	void set_camera_dist_to_focus(double dist_to_focus) { this->dist_to_focus = dist_to_focus; }
-	int get_current_iteration() { return m_current_iteration; }
+	int get_current_iteration() const { return m_current_iteration; }
 	void set_current_iteration(int current_iteration) { m_current_iteration = current_iteration; }
-	int get_samples_per_pixel() { return m_samples_per_pixel; }
+	int get_samples_per_pixel() const { return m_samples_per_pixel; }
+	void set_seed(uint64_t seed) { m_seed = seed; }
+	uint64_t get_seed() const { return m_seed; }
+	// 0 uses every hardware thread
+	void set_thread_count(int thread_count) { m_thread_count = thread_count; }
+	void set_verbose(bool verbose) { m_verbose = verbose; }
+	// Rays traced (camera and scattered) since the last reset
+	uint64_t get_ray_count() const { return m_ray_count; }
+	// Edge length of the square tiles a pass is split into, applied on reset()
+	void set_tile_size(int tile_size) { m_tile_size = tile_size > 0 ? tile_size : 1; }
+	int get_tile_size() const { return m_tile_size; }
+	// Per render thread counters since the last reset, empty before the first pass
+	std::vector<WorkerStats> get_worker_stats() const {
+		return m_pool ? m_pool->get_stats() : std::vector<WorkerStats>();
+	}
+	// Fraction of the pass wall time each render thread spent rendering tiles, since the last reset
+	std::vector<double> get_worker_utilization() const {
+		std::vector<double> utilization;
+		for (int w = 0; m_pool && w < m_pool->get_thread_count(); ++w)
+			utilization.push_back(m_pool->get_utilization(w));
+		return utilization;
+	}
+	// Counters and stage times of every finished pass since the last reset
+	const std::vector<PassStats>& get_pass_stats() const { return m_pass_stats; }
+	// Records a span for every tile rendered and resolved, see get_trace_events().
+	// Off by default, the events grow with every pass.
+	void set_trace(bool trace) { m_trace = trace; }
+	// Spans recorded since the last reset, sorted by start time
+	std::vector<TraceEvent> get_trace_events() const {
+		std::vector<TraceEvent> events;
+		for (const auto& thread_events : m_thread_events)
+			events.insert(events.end(), thread_events.begin(), thread_events.end());
+		std::sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+			return a.start_us < b.start_us;
+		});
+		return events;
+	}
+	// Adaptive sampling: after min_samples, tiles whose pixels all have a relative
+	// error below the threshold stop receiving samples
+	void set_adaptive(bool adaptive) { m_adaptive = adaptive; }
+	void set_adaptive_threshold(double threshold) { m_adaptive_threshold = threshold; }
+	void set_adaptive_min_samples(int min_samples) { m_adaptive_min_samples = min_samples > 2 ? min_samples : 2; }
+	// True once adaptive sampling has no tile left to sample
+	bool is_converged() const { return m_converged; }
+	// Camera samples taken since the last reset
+	uint64_t get_sample_count() const { return m_sample_count; }
+	int get_active_tile_count() const { return static_cast<int>(m_active_tiles.size()); }
+	// Tiles of the image, in the order they are scheduled
+	const std::vector<Tile>& get_tiles() const { return m_tiles; }
+	// Counter bumped by every reset and every finished pass, it never goes back.
+	// get_tile_versions()[t] is its value when tile t last changed, so a viewer that
+	// remembers the version it displayed only has to upload the newer tiles.
+	uint64_t get_image_version() const { return m_image_version; }
+	const std::vector<uint64_t>& get_tile_versions() const { return m_tile_versions; }
+	// Bounces before Russian roulette may terminate a path, -1 disables it
+	void set_russian_roulette_depth(int depth) { m_russian_roulette_depth = depth; }
+	// Wavefront mode traces a tile one bounce at a time for all of its paths (see
+	// render_tile_wavefront) instead of one path at a time. The image is the same.
+	void set_wavefront(bool wavefront) { m_wavefront = wavefront; }
+	bool get_wavefront() const { return m_wavefront; }
+	// Wavefront mode only: sorts the hits of a bounce by material type and shades each
+	// type as one batch, instead of in the order they were traced. Same image either way.
+	void set_material_sort(bool material_sort) { m_material_sort = material_sort; }
+	bool get_material_sort() const { return m_material_sort; }
+	// Tonemapper applied when the accumulated samples are resolved to the 8-bit image
+	void set_tonemapper(tonemapper op) { m_tonemapper = op; }
+	tonemapper get_tonemapper() const { return m_tonemapper; }
+	// Where the random numbers of a path come from, low discrepancy samplers converge
+	// faster (see sampler.h). Applied on the next pass, keep it for a whole render.
+	void set_sampler(sampler_type sampler) { m_sampler = sampler; }
+	sampler_type get_sampler() const { return m_sampler; }
+	// Next event estimation: every diffuse bounce also samples a direction toward one of
+	// the scene's emissive spheres, combined with the scattered ray by multiple
+	// importance sampling. No effect on scenes without lights.
+	void set_light_sampling(bool light_sampling) { m_light_sampling = light_sampling; }
+	bool get_light_sampling() const { return m_light_sampling; }
+	// Whether render() resolves the tiles it sampled into the 8-bit image. Workers of a
+	// distributed render only send back the accumulation buffer and turn it off.
+	void set_resolve(bool resolve) { m_resolve = resolve; }
+	// Makes the pass in flight return early, safe to call from any thread. Cleared by reset().
+	void cancel() { m_cancel_requested = true; }
+	int get_thread_count() const {
+		if (m_thread_count > 0) return m_thread_count;
+		int hardware_threads = static_cast<int>(std::thread::hardware_concurrency());
+		return hardware_threads > 0 ? hardware_threads : 1;
+	}
 
 	void reset() {
-		// Set random seed
-		srand(time(NULL));
+		// Key the scene generation (random materials and positions) by the seed
+		seed_random(m_seed, scene_random_key, 0);
 
 		// Image
 		const int image_width = m_image_width;
@@ -90,37 +279,80 @@ public:
 		m_camera = camera (lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus);
 
 		// World
-		switch (m_scene_name) {
+		built_scene scene;
+		if (!m_scene_file.empty()) {
+			scene = built_scene(m_file_scene.world, m_file_scene.sky);
+		}
+		else switch (m_scene_name) {
 		case SceneName::FLOOR_SPHERE:
-			m_world = floor_sphere_scene();
+			scene = floor_sphere_scene();
 			break;
 		case SceneName::THREE_SPHERES:
-			m_world = three_spheres_scene();
+			scene = three_spheres_scene();
 			break;
 		case SceneName::THREE_SPHERES2:
-			m_world = three_spheres_scene2();
+			scene = three_spheres_scene2();
 			break;
 		case SceneName::THREE_SPHERES3:
-			m_world = three_spheres_scene3();
+			scene = three_spheres_scene3();
 			break;
 		case SceneName::FOV:
-			m_world = fov_scene();
+			scene = fov_scene();
 			break;
 		case SceneName::RANDOM:
-			m_world = random_scene();
+			scene = random_scene();
 			break;
 		case SceneName::GHD:
-			m_world = GHD_scene();
+			scene = GHD_scene();
+			break;
+		case SceneName::LIGHTS:
+			scene = lights_scene();
+			break;
+		case SceneName::MESH:
+			scene = mesh_scene(m_mesh);
+			break;
+		case SceneName::INSTANCES:
+			scene = instances_scene();
 			break;
 		default:
-			m_world = floor_sphere_scene();
+			scene = floor_sphere_scene();
 			break;
 		}
 
+		m_world = scene.world;
+		m_sky = scene.sky;
+
+		// Acceleration structure over the scene, built once per reset.
+		// Spheres are packed into one SIMD-friendly sphere_soa with its own BVH.
+		m_bvh = bvh(pack_spheres(m_world));
+		m_lights.build(m_world);
+
+		clear_samples();
+	}
+
+	// Drops every sample and starts over at iteration 0, keeping the scene
+	void clear_samples() {
 		// Create an empty image
-		m_image = GHDImage(m_image_width, m_image_height);
-		m_image.bind_texture();
-		m_image_raw = RawImage(m_image_width, m_image_height);
+		if (m_image.get_width() == m_image_width && m_image.get_height() == m_image_height)
+			m_image.clear();
+		else
+			m_image = GHDImage(m_image_width, m_image_height);
+		if (m_image_raw.get_width() == m_image_width && m_image_raw.get_height() == m_image_height)
+			m_image_raw.clear();
+		else
+			m_image_raw = RawImage(m_image_width, m_image_height);
+		build_tiles();
+		m_tile_active.assign(m_tiles.size(), 1);
+		// The cleared image differs from whatever was displayed before in every tile
+		++m_image_version;
+		m_tile_versions.assign(m_tiles.size(), m_image_version);
+		m_active_tiles.clear();
+		m_converged = false;
+		m_sample_count = 0;
+		if (m_pool)
+			m_pool->reset_stats();
+		m_pass_stats.clear();
+		m_thread_events.clear();
 
 		// reset the timer
 		// m_start_time = system_clock::now();
@@ -129,67 +361,457 @@ public:
 
 		// Reset the current iteration count
 		m_current_iteration = 0;
+		m_ray_count = 0;
+		m_cancel_requested = false;
 	}
 
-	void render_row(int row) {
+	void render_tile(const Tile& tile) {
+		const auto start_time = std::chrono::high_resolution_clock::now();
+		uint64_t ray_count = 0;
+		uint64_t sample_count = 0;
+
 		// Loop over pixels
-		for (int i = 0; i < m_image_width; ++i)
+		for (int row = tile.y0; row < tile.y1; ++row)
 		{
+			for (int i = tile.x0; i < tile.x1; ++i)
+			{
+				// Every (pixel, sample) pair gets its own random stream
+				start_sample(i, row);
+
+				// Screen UV coordinates
+				double jitter_u, jitter_v;
+				thread_sampler().get_2d(jitter_u, jitter_v);
+				auto u = (i + jitter_u) / (m_image_width - 1);
+				auto v = (row + jitter_v) / (m_image_height - 1);
+				ray r = m_camera.get_ray(u, v);
+
+				// Add the color of every sample to current pixels color
+				color pixel_color = ray_color(r, m_bvh, m_max_depth, ray_count);
+
+				// Accumulate the sample, the resolve divides by the pixel's sample count
+				m_image_raw.add_sample(row, i, pixel_color);
+				++sample_count;
+			}
+		}
+
+		m_ray_count += ray_count;
+		m_sample_count += sample_count;
+
+		PassCounters& counters = thread_counters();
+		counters.rays += ray_count;
+		counters.paths += sample_count;
+		counters.stage_ms[static_cast<int>(RenderStage::Trace)] += elapsed_ms(start_time);
+	}
+
+	// Wavefront version of render_tile. Every stage runs over all live paths of the
+	// tile before the next one starts: camera rays are generated in scanline order
+	// and intersected in packets, hits are shaded in batches of one material type
+	// (see set_material_sort), and the scattered rays are grouped by direction octant
+	// so the next packets stay coherent.
+	// Each path carries its own random stream, so the result does not depend on the
+	// order paths are processed in and matches render_tile.
+	void render_tile_wavefront(const Tile& tile) {
+		const int tile_width = tile.x1 - tile.x0;
+		const int pixel_count = tile_width * (tile.y1 - tile.y0);
+		const bool sample_lights = m_light_sampling && !m_lights.empty();
+		uint64_t ray_count = 0;
+		PassCounters& counters = thread_counters();
+		auto stage_start = std::chrono::high_resolution_clock::now();
+
+		std::vector<color> radiance(pixel_count, color(0, 0, 0));
+		std::vector<PathState> paths;
+		std::vector<PathState> next_paths;
+		std::vector<hit_record> recs(pixel_count);
+		std::vector<char> hits(pixel_count);
+		std::vector<int> order;
+		std::vector<int> sorted;
+		paths.reserve(pixel_count);
+		next_paths.reserve(pixel_count);
+		order.reserve(pixel_count);
+
+		// Generate the camera rays
+		for (int row = tile.y0; row < tile.y1; ++row) {
+			for (int i = tile.x0; i < tile.x1; ++i) {
+				start_sample(i, row);
+				double jitter_u, jitter_v;
+				thread_sampler().get_2d(jitter_u, jitter_v);
+				auto u = (i + jitter_u) / (m_image_width - 1);
+				auto v = (row + jitter_v) / (m_image_height - 1);
+
+				PathState path;
+				path.r = m_camera.get_ray(u, v);
+				path.throughput = color(1.0, 1.0, 1.0);
+				path.rng = thread_rng();
+				path.sampler = thread_sampler();
+				path.scatter_pdf = 0;
+				path.pixel = (row - tile.y0) * tile_width + (i - tile.x0);
+				paths.push_back(path);
+			}
+		}
+		add_stage_time(counters, RenderStage::Generate, stage_start);
+
+		for (int depth = 0; depth < m_max_depth && !paths.empty(); ++depth) {
+			const int path_count = static_cast<int>(paths.size());
 
-			// Screen UV coordinates
-			auto u = (i + random_double()) / (m_image_width - 1);
-			auto v = (row + random_double()) / (m_image_height - 1);
-			ray r = m_camera.get_ray(u, v);
+			// Intersect. Camera rays are coherent and go in packets, scattered rays
+			// diverge too much for a shared traversal to pay off.
+			for (int first = 0; depth > 0 && first < path_count; ++first)
+				hits[first] = m_bvh.hit(paths[first].r, 0.001, infinity, recs[first]);
+			for (int first = 0; depth == 0 && first < path_count; first += ray_packet_size) {
+				int count = std::min(ray_packet_size, path_count - first);
+				ray rays[ray_packet_size];
+				real t_max[ray_packet_size];
+				bool packet_hits[ray_packet_size];
+				for (int k = 0; k < count; ++k) {
+					rays[k] = paths[first + k].r;
+					t_max[k] = infinity;
+				}
+				m_bvh.hit_packet(rays, count, 0.001, t_max, &recs[first], packet_hits);
+				for (int k = 0; k < count; ++k)
+					hits[first + k] = packet_hits[k];
+			}
+			ray_count += path_count;
+			add_stage_time(counters, RenderStage::Trace, stage_start);
 
-			// Add the color of every sample to current pixels color
-			color pixel_color = ray_color(r, m_world, m_max_depth);
+			// Paths that escaped pick up the sky, the others what they hit gives off and
+			// are shaded one material at a time
+			order.clear();
+			for (int p = 0; p < path_count; ++p) {
+				if (hits[p]) {
+					radiance[paths[p].pixel] += paths[p].throughput * emission(recs[p], paths[p].r.origin(), paths[p].scatter_pdf);
+					order.push_back(p);
+					continue;
+				}
+				radiance[paths[p].pixel] += paths[p].throughput * sky(paths[p].r);
+			}
+			// Scattering after the last bounce cannot add light
+			if (depth + 1 == m_max_depth) {
+				add_stage_time(counters, RenderStage::Shade, stage_start);
+				break;
+			}
+
+			// Shade. t is the material type as a constant, the scatter calls inline.
+			next_paths.clear();
+			auto shade = [&](int p, auto t) {
+				constexpr material_type type = decltype(t)::value;
+				PathState& path = paths[p];
+				std::swap(thread_rng(), path.rng);
+				std::swap(thread_sampler(), path.sampler);
+				thread_sampler().start_bounce(depth);
+
+				ray scattered;
+				color attenuation;
+				bool alive = recs[p].mat_ptr->scatter_as<type>(path.r, recs[p], attenuation, scattered);
+				if (alive) {
+					path.scatter_pdf = sample_lights ? recs[p].mat_ptr->scattering_pdf_as<type>(recs[p], scattered.direction()) : 0;
+					if (path.scatter_pdf > 0)
+						radiance[path.pixel] += path.throughput * sample_direct_light(m_bvh, recs[p], depth, ray_count);
+					path.throughput = path.throughput * attenuation;
+					path.r = scattered;
+
+					// Russian roulette
+					if (m_russian_roulette_depth >= 0 && depth + 1 >= m_russian_roulette_depth) {
+						double survival = fmin(0.95, fmax(path.throughput.x(), fmax(path.throughput.y(), path.throughput.z())));
+						thread_sampler().start_roulette(depth);
+						if (sample_1d() >= survival)
+							alive = false;
+						else
+							path.throughput /= survival;
+					}
+				}
 
-			// this function averages the pixel_color based on the number of samples per pixel
-			// write_color(m_image, row, i, pixel_color, m_samples_per_pixel);
-			color current_color = m_image_raw.get_pixel(row, i);
-			m_image_raw.set_pixel(row, i, 
-				current_color.x() + pixel_color.x(), 
-				current_color.y() + pixel_color.y(), 
-				current_color.z() + pixel_color.z()
-			);
+				std::swap(thread_rng(), path.rng);
+				std::swap(thread_sampler(), path.sampler);
+				if (alive)
+					next_paths.push_back(path);
+			};
+
+			if (m_material_sort) {
+				// Counting sort of the hits by material type, then one batch per type
+				int offsets[material_type_count + 1] = {};
+				for (int p : order)
+					++offsets[static_cast<int>(recs[p].mat_ptr->type) + 1];
+				for (int m = 0; m < material_type_count; ++m)
+					offsets[m + 1] += offsets[m];
+				sorted.resize(order.size());
+				int next[material_type_count];
+				std::copy(offsets, offsets + material_type_count, next);
+				for (int p : order)
+					sorted[next[static_cast<int>(recs[p].mat_ptr->type)]++] = p;
+
+				for (int m = 0; m < material_type_count; ++m) {
+					dispatch_material(static_cast<material_type>(m), [&](auto t) {
+						for (int i = offsets[m]; i < offsets[m + 1]; ++i)
+							shade(sorted[i], t);
+					});
+				}
+			}
+			else {
+				for (int p : order)
+					dispatch_material(recs[p].mat_ptr->type, [&](auto t) { shade(p, t); });
+			}
+
+			// Group the scattered rays by direction octant (counting sort, stable)
+			auto octant = [](const PathState& path) {
+				const vec3 d = path.r.direction();
+				return (d.x() < 0.0 ? 1 : 0) | (d.y() < 0.0 ? 2 : 0) | (d.z() < 0.0 ? 4 : 0);
+			};
+			int offsets[9] = {};
+			for (const PathState& path : next_paths)
+				++offsets[octant(path) + 1];
+			for (int o = 0; o < 8; ++o)
+				offsets[o + 1] += offsets[o];
+			paths.resize(next_paths.size());
+			for (const PathState& path : next_paths)
+				paths[offsets[octant(path)]++] = path;
+			add_stage_time(counters, RenderStage::Shade, stage_start);
+		}
+
+		for (int row = tile.y0; row < tile.y1; ++row) {
+			for (int i = tile.x0; i < tile.x1; ++i)
+				m_image_raw.add_sample(row, i, radiance[(row - tile.y0) * tile_width + (i - tile.x0)]);
 		}
+
+		m_ray_count += ray_count;
+		m_sample_count += pixel_count;
+		counters.rays += ray_count;
+		counters.paths += pixel_count;
+		add_stage_time(counters, RenderStage::Shade, stage_start);
 	}
 
-	void render() {
+	// Adds one sample to every pixel and resolves the tiles that were sampled.
+	// Returns false if the pass was cancelled, the image is then partly resolved.
+	bool render() {
+
+		// Only tiles that have not converged yet get another sample
+		update_active_tiles();
+		if (m_active_tiles.empty()) {
+			if (m_verbose)
+				std::cout << "Converged after " << m_current_iteration - 1 << " iterations" << std::endl;
+			m_converged = true;
+			return true;
+		}
 
 		// Render
-		std::cout << "Rendering iteration " << m_current_iteration << "/" << m_samples_per_pixel << std::endl;
+		if (m_verbose)
+			std::cout << "Rendering iteration " << m_current_iteration << "/" << m_samples_per_pixel << std::endl;
 
 		// auto start_time = std::chrono::high_resolution_clock::now();
 		
-		// Create a vector of rows in reverse order using iota
-		std::vector<int> rows(m_image_height);
-		std::iota(rows.rbegin(), rows.rend(), 0);
-
-		// for(int iteration = 0; iteration < m_samples_per_pixel; ++iteration) {
-			std::for_each(
-				std::execution::par,
-				rows.begin(),
-				rows.end(), 
-				[this](int row) { 
-					this->render_row(row); 
-				}
-			);
-		// }
+		// (Re)create the thread pool if the thread count changed
+		if (!m_pool || m_pool->get_thread_count() != get_thread_count())
+			m_pool.reset(new ThreadPool(get_thread_count()));
+
+		// Every render thread gets its own counters, and its own trace events
+		const int thread_count = m_pool->get_thread_count();
+		m_thread_counters.assign(thread_count, PassCounters());
+		if (static_cast<int>(m_thread_events.size()) < thread_count)
+			m_thread_events.resize(thread_count);
+		const auto pass_start = std::chrono::high_resolution_clock::now();
+
+		// Tiles are in Morton order, the pool balances them with work-stealing.
+		// Each tile is resolved right after it is sampled.
+		const resolve_kernel resolve = select_resolve_kernel(m_tonemapper, active_simd_level());
+		m_pool->parallel_for(static_cast<int>(m_active_tiles.size()), [this, resolve](int tile, int worker) {
+			if (m_cancel_requested.load(std::memory_order_relaxed))
+				return;
+			const Tile& t = m_tiles[m_active_tiles[tile]];
+			const auto tile_start = std::chrono::high_resolution_clock::now();
+			thread_counters() = PassCounters();
+			if (m_wavefront)
+				this->render_tile_wavefront(t);
+			else
+				this->render_tile(t);
+			const auto resolve_start = std::chrono::high_resolution_clock::now();
+			if (m_resolve)
+				this->resolve_tile(t, resolve);
+
+			const auto end_time = std::chrono::high_resolution_clock::now();
 
-		// convert the raw double image to a uint8 image
-		for (int i = 0; i < m_image_width; ++i) {
-			for (int j = 0; j < m_image_height; ++j) {
-				write_color(m_image, j, i, m_image_raw.get_pixel(j, i), m_current_iteration);
+			PassCounters& counters = thread_counters();
+			counters.stage_ms[static_cast<int>(RenderStage::Resolve)] += elapsed_us(resolve_start, end_time) / 1000.0;
+			m_thread_counters[worker].add(counters);
+			if (m_trace) {
+				m_thread_events[worker].push_back({ "render", worker, since_reset_us(tile_start), elapsed_us(tile_start, resolve_start) });
+				m_thread_events[worker].push_back({ "resolve", worker, since_reset_us(resolve_start), elapsed_us(resolve_start, end_time) });
 			}
-		}
+		});
+
+		if (m_cancel_requested)
+			return false;
+
+		PassStats pass;
+		pass.iteration = m_current_iteration;
+		pass.start_ms = since_reset_us(pass_start) / 1000.0;
+		pass.wall_ms = elapsed_ms(pass_start);
+		for (const PassCounters& counters : m_thread_counters)
+			pass.counters.add(counters);
+		m_pass_stats.push_back(pass);
+
+		++m_image_version;
+		for (int t : m_active_tiles)
+			m_tile_versions[t] = m_image_version;
 
 		std::chrono::time_point<std::chrono::high_resolution_clock> end_time = std::chrono::high_resolution_clock::now();
         m_render_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - m_start_time).count();
-
-		// bind the texture to the image
-		m_image.bind_texture();
 		// std::cout << "Done in " << m_render_time << " seconds" << std::endl;
+		return true;
+	}
+
+	// Adds samples rendered elsewhere, e.g. by a worker process, to the accumulation
+	// buffer and resolves the whole image. samples must have the image's size.
+	void merge_samples(const RawImage& samples, uint64_t sample_count, uint64_t ray_count) {
+		m_image_raw.add(samples);
+		m_sample_count += sample_count;
+		m_ray_count += ray_count;
+
+		const resolve_kernel resolve = select_resolve_kernel(m_tonemapper, active_simd_level());
+		for (const Tile& tile : m_tiles)
+			resolve_tile(tile, resolve);
+		++m_image_version;
+		m_tile_versions.assign(m_tiles.size(), m_image_version);
+	}
+
+	// Writes the progress of the render to a checkpoint: the settings the samples
+	// depend on, the iteration and sample counters, the adaptive sampling state and
+	// the accumulation buffer. Samples are keyed by (seed, pixel, iteration), so there
+	// is no RNG state to store. Call between passes. The file is written next to the
+	// target and renamed over it, a crash never leaves a truncated checkpoint.
+	bool save_checkpoint(const std::string& path) const {
+		if (!hash_input_files())
+			return false;
+		const std::string temp_path = path + ".tmp";
+		{
+			std::ofstream out(temp_path, std::ios::binary);
+			if (!out) {
+				std::cerr << "Could not open " << temp_path << " for writing\n";
+				return false;
+			}
+
+			const std::vector<uint64_t> int_settings = checkpoint_int_settings();
+			const std::vector<double> real_settings = checkpoint_real_settings();
+			const uint32_t int_count = static_cast<uint32_t>(int_settings.size());
+			const uint32_t real_count = static_cast<uint32_t>(real_settings.size());
+			const int32_t iteration = m_current_iteration;
+			const uint64_t sample_count = m_sample_count;
+			const uint64_t ray_count = m_ray_count;
+			const float render_time = m_render_time;
+			const uint8_t converged = m_converged ? 1 : 0;
+			const uint32_t tile_count = static_cast<uint32_t>(m_tile_active.size());
+
+			out.write(checkpoint_magic, sizeof(checkpoint_magic));
+			write_value(out, int_count);
+			out.write(reinterpret_cast<const char*>(int_settings.data()), int_count * sizeof(uint64_t));
+			write_value(out, real_count);
+			out.write(reinterpret_cast<const char*>(real_settings.data()), real_count * sizeof(double));
+			write_value(out, iteration);
+			write_value(out, sample_count);
+			write_value(out, ray_count);
+			write_value(out, render_time);
+			write_value(out, converged);
+			write_value(out, tile_count);
+			out.write(m_tile_active.data(), tile_count);
+			if (!m_image_raw.write(out)) {
+				std::cerr << "Could not write " << temp_path << "\n";
+				return false;
+			}
+		}
+
+		// rename() does not replace an existing file on every platform
+		std::remove(path.c_str());
+		if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+			std::cerr << "Could not rename " << temp_path << " to " << path << "\n";
+			return false;
+		}
+		return true;
+	}
+
+	// Continues the render from a checkpoint. Call after reset() with the settings
+	// the checkpoint was written with, only the samples per pixel may differ. The
+	// next pass is iteration get_current_iteration() + 1.
+	bool load_checkpoint(const std::string& path) {
+		std::ifstream in(path, std::ios::binary);
+		if (!in) {
+			std::cerr << "Could not open " << path << "\n";
+			return false;
+		}
+
+		char magic[sizeof(checkpoint_magic)];
+		uint32_t int_count = 0, real_count = 0;
+		in.read(magic, sizeof(magic));
+		if (!in || std::memcmp(magic, checkpoint_magic, sizeof(magic)) != 0) {
+			std::cerr << path << " is not a checkpoint\n";
+			return false;
+		}
+		// The counts come from the file, they are checked before anything is allocated
+		if (!hash_input_files())
+			return false;
+		const std::vector<uint64_t> expected_int_settings = checkpoint_int_settings();
+		const std::vector<double> expected_real_settings = checkpoint_real_settings();
+		read_value(in, int_count);
+		if (!in || int_count != expected_int_settings.size()) {
+			std::cerr << path << (in ? " was written with different render settings\n" : " is not a checkpoint\n");
+			return false;
+		}
+		std::vector<uint64_t> int_settings(int_count);
+		in.read(reinterpret_cast<char*>(int_settings.data()), int_count * sizeof(uint64_t));
+		read_value(in, real_count);
+		if (!in || real_count != expected_real_settings.size()) {
+			std::cerr << path << (in ? " was written with different render settings\n" : " is not a checkpoint\n");
+			return false;
+		}
+		std::vector<double> real_settings(real_count);
+		in.read(reinterpret_cast<char*>(real_settings.data()), real_count * sizeof(double));
+		if (!in || int_settings != expected_int_settings || real_settings != expected_real_settings) {
+			std::cerr << path << " was written with different render settings\n";
+			return false;
+		}
+
+		int32_t iteration = 0;
+		uint64_t sample_count = 0, ray_count = 0;
+		float render_time = 0.0f;
+		uint8_t converged = 0;
+		uint32_t tile_count = 0;
+		read_value(in, iteration);
+		read_value(in, sample_count);
+		read_value(in, ray_count);
+		read_value(in, render_time);
+		read_value(in, converged);
+		read_value(in, tile_count);
+		if (!in) {
+			std::cerr << path << " is truncated\n";
+			return false;
+		}
+		if (tile_count != m_tiles.size()) {
+			std::cerr << path << " was written with a different tile layout (" << tile_count << " tiles, this render has "
+			          << m_tiles.size() << ")\n";
+			return false;
+		}
+		// Read into copies, a checkpoint that turns out truncated leaves the render as it was
+		std::vector<char> tile_active(tile_count);
+		in.read(tile_active.data(), tile_count);
+		RawImage image_raw(m_image_width, m_image_height);
+		if (!in || !image_raw.read(in)) {
+			std::cerr << path << " is truncated\n";
+			return false;
+		}
+
+		m_image_raw = std::move(image_raw);
+		m_current_iteration = iteration;
+		m_sample_count = sample_count;
+		m_ray_count = ray_count;
+		m_converged = converged != 0;
+		m_tile_active = tile_active;
+		m_render_time = render_time;
+		m_start_time = std::chrono::high_resolution_clock::now() - std::chrono::milliseconds(static_cast<int64_t>(render_time));
+
+		// Show what was accumulated so far
+		const resolve_kernel resolve = select_resolve_kernel(m_tonemapper, active_simd_level());
+		for (const Tile& tile : m_tiles)
+			resolve_tile(tile, resolve);
+		++m_image_version;
+		m_tile_versions.assign(m_tiles.size(), m_image_version);
+		return true;
 	}
 
 private:
@@ -202,8 +824,46 @@ private:
 	float m_render_time;
 	int m_current_iteration=0;
 	SceneName m_scene_name;
+	std::string m_mesh_file;
+	shared_ptr<triangle_mesh> m_mesh;
+	mutable uint64_t m_mesh_hash = 0; // see hash_input_files()
+	std::string m_scene_file;
+	loaded_scene m_file_scene;
+	mutable uint64_t m_scene_file_hash = 0;
+	uint64_t m_seed;
+	int m_thread_count;
+	bool m_verbose;
+	std::atomic<uint64_t> m_ray_count;
+	std::atomic<bool> m_cancel_requested;
+	int m_tile_size;
+	int m_russian_roulette_depth;
+	std::vector<Tile> m_tiles;
+	std::vector<uint64_t> m_tile_versions;
+	uint64_t m_image_version = 0;
+	tonemapper m_tonemapper = tonemapper::gamma2;
+	sampler_type m_sampler = sampler_type::independent;
+	bool m_light_sampling = true;
+	light_list m_lights;
+	bool m_sky = true;
+	std::unique_ptr<ThreadPool> m_pool;
+	std::vector<PassCounters> m_thread_counters;
+	std::vector<std::vector<TraceEvent>> m_thread_events;
+	std::vector<PassStats> m_pass_stats;
+	bool m_trace = false;
+	bool m_resolve = true;
+	bool m_adaptive;
+	double m_adaptive_threshold;
+	int m_adaptive_min_samples;
+	std::vector<char> m_tile_active;
+	std::vector<int> m_active_tiles;
+	bool m_converged;
+	std::atomic<uint64_t> m_sample_count;
+	bool m_wavefront;
+	bool m_material_sort = true;
+	static const uint64_t scene_random_key = ~0ULL;
 	camera m_camera;
 	hittable_list m_world;
+	bvh m_bvh;
 	GHDImage m_image;
 	RawImage m_image_raw;
 
@@ -215,26 +875,251 @@ private:
 	double dist_to_focus = 12.0;
 	double aperture = 0.7;
 
-	// Returns a color for a given ray r
-	color ray_color(const ray &r, const hittable &world, int depth)
+	static constexpr char checkpoint_magic[8] = { 'G', 'H', 'D', 'C', 'K', 'P', 'T', '1' };
+
+	// Everything a sample depends on, a checkpoint only resumes if these match
+	std::vector<uint64_t> checkpoint_int_settings() const {
+		return {
+			static_cast<uint64_t>(m_image_width), static_cast<uint64_t>(m_image_height),
+			static_cast<uint64_t>(m_scene_name), m_seed, static_cast<uint64_t>(m_max_depth),
+			static_cast<uint64_t>(static_cast<int64_t>(m_russian_roulette_depth)), static_cast<uint64_t>(m_tile_size),
+			static_cast<uint64_t>(m_adaptive), static_cast<uint64_t>(m_adaptive_min_samples),
+			sizeof(accum_t), static_cast<uint64_t>(accum_pixel_stride), sizeof(rng_engine), static_cast<uint64_t>(m_sampler),
+			static_cast<uint64_t>(m_light_sampling), m_scene_name == SceneName::MESH ? m_mesh_hash : 0,
+			m_scene_file.empty() ? 0 : m_scene_file_hash, sizeof(real)
+		};
+	}
+
+	std::vector<double> checkpoint_real_settings() const {
+		return {
+			aperture, m_adaptive_threshold, vfov, dist_to_focus,
+			lookfrom.x(), lookfrom.y(), lookfrom.z(), lookat.x(), lookat.y(), lookat.z(), vup.x(), vup.y(), vup.z()
+		};
+	}
+
+	// FNV-1a
+	static uint64_t hash_bytes(const char* data, size_t size) {
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		for (size_t i = 0; i < size; ++i)
+			hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ULL;
+		return hash;
+	}
+
+	// Hashes the contents of the mesh and scene files for the checkpoint settings, so
+	// a checkpoint does not resume over an edited file that kept its path. Reading a
+	// large file costs far more than mapping it, so this waits for the first checkpoint
+	// and the result is kept until the file is set again (0 means not hashed yet).
+	// Prints why and returns false if a file cannot be read.
+	bool hash_input_files() const {
+		if (m_scene_name == SceneName::MESH && !m_mesh_file.empty() && m_mesh_hash == 0 && !hash_file(m_mesh_file, m_mesh_hash))
+			return false;
+		if (!m_scene_file.empty() && m_scene_file_hash == 0 && !hash_file(m_scene_file, m_scene_file_hash))
+			return false;
+		return true;
+	}
+
+	static bool hash_file(const std::string& path, uint64_t& hash) {
+		mapped_file file;
+		if (!file.open(path))
+			return false;
+		hash = hash_bytes(file.data(), file.size());
+		return true;
+	}
+
+	template <typename T>
+	static void write_value(std::ostream& out, const T& value) {
+		out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	template <typename T>
+	static void read_value(std::istream& in, T& value) {
+		in.read(reinterpret_cast<char*>(&value), sizeof(T));
+	}
+
+	typedef std::chrono::high_resolution_clock::time_point time_point;
+
+	static double elapsed_us(time_point start, time_point end) {
+		return std::chrono::duration<double, std::micro>(end - start).count();
+	}
+
+	static double elapsed_ms(time_point start) {
+		return elapsed_us(start, std::chrono::high_resolution_clock::now()) / 1000.0;
+	}
+
+	double since_reset_us(time_point time) const { return elapsed_us(m_start_time, time); }
+
+	// Adds the time since start to the stage and restarts the clock for the next stage
+	static void add_stage_time(PassCounters& counters, RenderStage stage, time_point& start) {
+		const auto now = std::chrono::high_resolution_clock::now();
+		counters.stage_ms[static_cast<int>(stage)] += elapsed_us(start, now) / 1000.0;
+		start = now;
+	}
+
+	// Splits the image into square tiles and sorts them along a Z-order curve
+	void build_tiles() {
+		m_tiles.clear();
+		int tiles_x = (m_image_width + m_tile_size - 1) / m_tile_size;
+		int tiles_y = (m_image_height + m_tile_size - 1) / m_tile_size;
+		std::vector<std::pair<uint32_t, Tile>> ordered;
+		for (int ty = 0; ty < tiles_y; ++ty) {
+			for (int tx = 0; tx < tiles_x; ++tx) {
+				Tile tile;
+				tile.x0 = tx * m_tile_size;
+				tile.y0 = ty * m_tile_size;
+				tile.x1 = std::min(tile.x0 + m_tile_size, m_image_width);
+				tile.y1 = std::min(tile.y0 + m_tile_size, m_image_height);
+				ordered.push_back({ morton_code(tx, ty), tile });
+			}
+		}
+		std::sort(ordered.begin(), ordered.end(), [](const std::pair<uint32_t, Tile>& a, const std::pair<uint32_t, Tile>& b) {
+			return a.first < b.first;
+		});
+		for (const auto& entry : ordered)
+			m_tiles.push_back(entry.second);
+	}
+
+	// Keys the calling thread's generator and sampler to the pixel's sample of the
+	// current iteration. The sampler counts samples from 0.
+	void start_sample(int i, int row) {
+		seed_random(m_seed, static_cast<uint64_t>(row) * m_image_width + i, m_current_iteration);
+		thread_sampler().start(m_sampler, m_seed, i, row, m_image_width, std::max(m_current_iteration - 1, 0));
+	}
+
+	// Drops tiles whose every pixel is below the adaptive error threshold
+	void update_active_tiles() {
+		m_active_tiles.clear();
+		bool check_convergence = m_adaptive && m_current_iteration > m_adaptive_min_samples;
+		for (size_t t = 0; t < m_tiles.size(); ++t) {
+			if (m_tile_active[t] && check_convergence && tile_converged(m_tiles[t]))
+				m_tile_active[t] = 0;
+			if (m_tile_active[t])
+				m_active_tiles.push_back(static_cast<int>(t));
+		}
+	}
+
+	// Converts the tile's accumulated samples to the uint8 image, one row span at a time
+	void resolve_tile(const Tile& tile, resolve_kernel resolve) {
+		for (int row = tile.y0; row < tile.y1; ++row) {
+			const int index = row * m_image_width + tile.x0;
+			resolve(m_image_raw.channel(0, index), m_image_raw.channel(1, index), m_image_raw.channel(2, index),
+				m_image_raw.counts(index), m_image.data() + index * 4, tile.x1 - tile.x0);
+		}
+	}
+
+	bool tile_converged(const Tile& tile) const {
+		for (int row = tile.y0; row < tile.y1; ++row) {
+			for (int i = tile.x0; i < tile.x1; ++i) {
+				if (m_image_raw.relative_error(row, i) > m_adaptive_threshold)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	// Returns a color for a given ray r.
+	// Iterative path tracer: the path throughput is carried along and the light it
+	// picks up (sky, emitters it hits, lights sampled at diffuse bounces) is added to
+	// the radiance. After m_russian_roulette_depth bounces, paths are terminated with
+	// probability 1 - max(throughput) and the survivors are reweighted, which keeps
+	// the estimate unbiased.
+	color ray_color(const ray &r_in, const hittable &world, int max_depth, uint64_t &ray_count)
 	{
-		hit_record rec;
+		const bool sample_lights = m_light_sampling && !m_lights.empty();
+		ray r = r_in;
+		color throughput(1.0, 1.0, 1.0);
+		color radiance(0, 0, 0);
+		double scatter_pdf = 0;
 
 		// If we've exceeded the ray bounce limit, no more light is gathered.
-		if (depth <= 0)
-			return color(0, 0, 0);
-
-		if (world.hit(r, 0.001, infinity, rec))
+		for (int depth = 0; depth < max_depth; ++depth)
 		{
+			hit_record rec;
+			++ray_count;
+
+			if (!world.hit(r, 0.001, infinity, rec))
+				return radiance + throughput * sky(r);
+
+			radiance += throughput * emission(rec, r.origin(), scatter_pdf);
+			if (depth + 1 == max_depth)
+				break;
+
 			ray scattered;
 			color attenuation;
-			if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-				return attenuation * ray_color(scattered, world, depth - 1);
-			return color(0, 0, 0);
+			thread_sampler().start_bounce(depth);
+			if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+				return radiance;
+
+			scatter_pdf = sample_lights ? rec.mat_ptr->scattering_pdf(rec, scattered.direction()) : 0;
+			if (scatter_pdf > 0)
+				radiance += throughput * sample_direct_light(world, rec, depth, ray_count);
+
+			throughput = throughput * attenuation;
+			r = scattered;
+
+			// Russian roulette
+			if (m_russian_roulette_depth >= 0 && depth + 1 >= m_russian_roulette_depth)
+			{
+				double survival = fmin(0.95, fmax(throughput.x(), fmax(throughput.y(), throughput.z())));
+				thread_sampler().start_roulette(depth);
+				if (sample_1d() >= survival)
+					return radiance;
+				throughput /= survival;
+			}
 		}
+
+		return radiance;
+	}
+
+	// Sky gradient seen by rays that leave the scene, scenes lit by their lights have none
+	color sky(const ray& r) const {
+		if (!m_sky)
+			return color(0, 0, 0);
 		vec3 unit_direction = unit_vector(r.direction());
 		auto t = 0.5 * (unit_direction.y() + 1.0);
 		return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
 	}
 
+	static double power_heuristic(double pdf, double other_pdf) {
+		return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+	}
+
+	// Light given off by what a ray from origin hit. scatter_pdf is the density the
+	// previous bounce picked the ray with; if it is not 0 that bounce also sampled
+	// the lights, and the two estimates are weighted against each other.
+	color emission(const hit_record& rec, const point3& origin, double scatter_pdf) const {
+		color emitted = rec.mat_ptr->emitted();
+		if (scatter_pdf > 0)
+			emitted *= power_heuristic(scatter_pdf, m_lights.pdf(origin, rec));
+		return emitted;
+	}
+
+	// Next event estimation at a diffuse bounce: light arriving at rec straight from
+	// a sampled point of one of the lights, if nothing in world is in the way. world
+	// is what the path itself is traced through.
+	color sample_direct_light(const hittable& world, const hit_record& rec, int depth, uint64_t& ray_count) const {
+		thread_sampler().start_light(depth);
+		const double pick = sample_1d();
+		double u, v;
+		thread_sampler().get_2d(u, v);
+
+		int index;
+		vec3 direction;
+		double light_pdf;
+		if (!m_lights.sample(rec.p, pick, u, v, index, direction, light_pdf))
+			return color(0, 0, 0);
+		const double scatter_pdf = rec.mat_ptr->scattering_pdf(rec, direction);
+		if (scatter_pdf <= 0)
+			return color(0, 0, 0);
+
+		hit_record light_rec;
+		++ray_count;
+		++thread_counters().shadow_rays;
+		if (!world.hit(ray(rec.p, direction), 0.001, infinity, light_rec) || light_rec.mat_ptr != m_lights[index].mat_ptr ||
+			!light_list::on_surface(m_lights[index], light_rec.p))
+			return color(0, 0, 0);
+
+		const double weight = power_heuristic(light_pdf, scatter_pdf) / light_pdf;
+		return rec.mat_ptr->scattering(rec, direction) * light_rec.mat_ptr->emitted() * weight;
+	}
+
 };
\ No newline at end of file
@@ -0,0 +1,100 @@
+#ifndef RNG_H
+#define RNG_H
+
+// Small, fast pseudo random generators
+// Every render thread owns its own generator (see thread_rng() in rtweekend.h),
+// so there is no shared state between threads. A generator is re-keyed by
+// (seed, pixel, sample) before each camera sample, which makes the random
+// sequence of a path independent of which thread traces it.
+
+#include <cstdint>
+
+// SplitMix64 finalizer, used to turn keys into well distributed seeds
+inline uint64_t mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline uint64_t hash_key(uint64_t seed, uint64_t a, uint64_t b) {
+    return mix64(mix64(mix64(seed) ^ a) ^ b);
+}
+
+// PCG32 (XSH-RR variant) by Melissa O'Neill, 64 bits of state, selectable stream
+class pcg32 {
+    public:
+        pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+
+        void seed(uint64_t init_state, uint64_t stream) {
+            state = 0;
+            inc = (stream << 1u) | 1u;
+            next_u32();
+            state += init_state;
+            next_u32();
+        }
+
+        uint32_t next_u32() {
+            uint64_t old_state = state;
+            state = old_state * 6364136223846793005ULL + inc;
+            uint32_t xorshifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+            uint32_t rot = static_cast<uint32_t>(old_state >> 59u);
+            return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31u));
+        }
+
+        // Returns a random real in [0,1).
+        double next_double() {
+            return next_u32() * (1.0 / 4294967296.0);
+        }
+
+    private:
+        uint64_t state;
+        uint64_t inc;
+};
+
+// xoshiro256+ by Blackman and Vigna, 256 bits of state, 53 bit doubles
+class xoshiro256plus {
+    public:
+        xoshiro256plus() { seed(0, 0); }
+
+        void seed(uint64_t init_state, uint64_t stream) {
+            uint64_t x = init_state ^ mix64(stream);
+            for (int i = 0; i < 4; i++) {
+                x = mix64(x);
+                s[i] = x;
+            }
+        }
+
+        uint64_t next_u64() {
+            const uint64_t result = s[0] + s[3];
+            const uint64_t t = s[1] << 17;
+            s[2] ^= s[0];
+            s[3] ^= s[1];
+            s[1] ^= s[2];
+            s[0] ^= s[3];
+            s[2] ^= t;
+            s[3] = (s[3] << 45) | (s[3] >> 19);
+            return result;
+        }
+
+        uint32_t next_u32() {
+            return static_cast<uint32_t>(next_u64() >> 32);
+        }
+
+        // Returns a random real in [0,1).
+        double next_double() {
+            return (next_u64() >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+    private:
+        uint64_t s[4];
+};
+
+// Generator used by random_double(), pick another one at build time with GHD_RNG_XOSHIRO
+#ifdef GHD_RNG_XOSHIRO
+using rng_engine = xoshiro256plus;
+#else
+using rng_engine = pcg32;
+#endif
+
+#endif
@@ -12,6 +12,7 @@
 #include <memory>
 #include <cstdlib>
 
+#include "rng.h"
 
 
 // Usings
@@ -31,9 +32,22 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// Per-thread generator, no locking or shared state between render threads
+inline rng_engine& thread_rng() {
+    thread_local rng_engine engine;
+    return engine;
+}
+
+// Re-keys the calling thread's generator. The renderer calls this before every
+// camera sample with the pixel index and sample index, so results do not depend
+// on thread scheduling.
+inline void seed_random(uint64_t seed, uint64_t pixel, uint64_t sample) {
+    thread_rng().seed(hash_key(seed, pixel, sample), pixel);
+}
+
 inline double random_double() {
     // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    return thread_rng().next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -0,0 +1,381 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+// Samplers hand out the random numbers of a path dimension by dimension, keyed by
+// (seed, pixel, sample index). The independent sampler is the plain generator of
+// rng.h. The others are low discrepancy: the samples a pixel receives over the
+// iterations fill each dimension (pair) more evenly than independent numbers do,
+// so the noise drops faster per sample.
+//
+// Dimensions are laid out at fixed positions so that the same dimension means the
+// same thing in every sample of a pixel: 0-1 pixel jitter, 2-3 lens, then
+// sampler_bounce_dimensions per bounce (scattering, light sampling, Russian roulette).
+
+#include "rtweekend.h"
+
+#include <vector>
+
+enum class sampler_type {
+    independent, // random_double()
+    sobol,       // Sobol (0,2) pairs, hash-based Owen scrambling, shuffled per pixel
+    halton,      // Halton, Owen scrambled per pixel and dimension
+    blue_noise   // Owen scrambled Sobol shared by all pixels, rotated by a blue noise mask
+};
+const int sampler_type_count = static_cast<int>(sampler_type::blue_noise) + 1;
+
+inline const char* sampler_name(sampler_type type) {
+    switch (type) {
+    case sampler_type::sobol: return "sobol";
+    case sampler_type::halton: return "halton";
+    case sampler_type::blue_noise: return "bluenoise";
+    default: return "independent";
+    }
+}
+
+// Returns false if the name is unknown
+inline bool sampler_from_string(const std::string& name, sampler_type& type) {
+    for (sampler_type t : { sampler_type::independent, sampler_type::sobol, sampler_type::halton, sampler_type::blue_noise }) {
+        if (name == sampler_name(t)) {
+            type = t;
+            return true;
+        }
+    }
+    return false;
+}
+
+const int sampler_camera_dimensions = 4;
+const int sampler_bounce_dimensions = 7;
+const int sampler_light_dimension = 3;    // within a bounce: light pick, then the direction
+const int sampler_roulette_dimension = 6; // within a bounce
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Owen scrambling of the bits of x, most significant first (Burley 2020, "Practical
+// Hash-based Owen Scrambling"): a random flip of every bit that only depends on the
+// bits above it, so nets stay nets.
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// First two dimensions of the Sobol sequence, together a (0,2) sequence in base 2
+inline uint32_t sobol_dimension0(uint32_t index) {
+    return reverse_bits(index);
+}
+
+inline uint32_t sobol_dimension1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1)
+            result ^= v;
+    }
+    return result;
+}
+
+inline double u32_to_unit(uint32_t x) {
+    return x * (1.0 / 4294967296.0);
+}
+
+// Digits of index in base b mirrored around the decimal point (the radical
+// inverse), with Owen scrambling: every digit goes through a random permutation
+// of [0, base) that depends on the digits before it, so the stratification of the
+// sequence is kept but the strong correlation between the raw sequences of two
+// large bases is not. Each permutation is digit -> (a * digit + c) mod base with
+// a != 0, a bijection since base is prime. The zero digits past the last digit of
+// index are scrambled too, down to 2^-32. Base 2 is owen_scramble() on the bits.
+inline double owen_scrambled_radical_inverse(uint32_t base, uint32_t index, uint64_t seed) {
+    if (base == 2)
+        return u32_to_unit(owen_scramble(reverse_bits(index), static_cast<uint32_t>(seed)));
+
+    const double inverse_base = 1.0 / base;
+    double result = 0.0, scale = inverse_base;
+    uint64_t node = seed; // identifies the digits so far, i.e. the node of the digit tree
+    while (scale * base > 1.0 / 4294967296.0) {
+        // a in [1, base) and c in [0, base) from the two halves of the hash
+        const uint64_t h = mix64(node);
+        const uint32_t c = static_cast<uint32_t>(((h >> 32) * base) >> 32);
+        if (index == 0) {
+            // A zero digit goes to c, no division needed
+            result += c * scale;
+            node = h;
+        }
+        else {
+            const uint32_t digit = index % base;
+            index /= base;
+            const uint32_t a = 1 + static_cast<uint32_t>(((h & 0xffffffffu) * (base - 1)) >> 32);
+            result += ((a * digit + c) % base) * scale;
+            node = h + digit;
+        }
+        scale *= inverse_base;
+    }
+    return result < 1.0 ? result : 0.99999999999999989;
+}
+
+// Halton bases, one prime per dimension
+struct prime_table {
+    std::vector<uint32_t> primes;
+
+    prime_table() {
+        for (uint32_t n = 2; primes.size() < 1024; n++) {
+            bool prime = true;
+            for (uint32_t p : primes) {
+                if (p * p > n) break;
+                if (n % p == 0) { prime = false; break; }
+            }
+            if (prime) primes.push_back(n);
+        }
+    }
+
+    static const prime_table& get() {
+        static const prime_table table;
+        return table;
+    }
+};
+
+// Tileable blue noise mask: every value in [0,1) once, with neighbouring values far
+// apart. Built on first use with void and cluster (Ulichney 1993).
+struct blue_noise_mask {
+    static const int size = 64;
+    static const int count = size * size;
+    float values[count];
+
+    blue_noise_mask() {
+        // Gaussian energy of one pixel over the torus
+        std::vector<double> kernel(count);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                int dx = x <= size / 2 ? x : size - x;
+                int dy = y <= size / 2 ? y : size - y;
+                kernel[y * size + x] = exp(-(dx * dx + dy * dy) / (2.0 * 1.9 * 1.9));
+            }
+        }
+
+        std::vector<char> on(count, 0);
+        std::vector<double> energy(count, 0.0);
+        auto toggle = [&](int p, bool set) {
+            on[p] = set ? 1 : 0;
+            const int px = p % size, py = p / size;
+            const double sign = set ? 1.0 : -1.0;
+            for (int y = 0; y < size; y++) {
+                const double* row = &kernel[((y - py + size) % size) * size];
+                for (int x = 0; x < size; x++)
+                    energy[y * size + x] += sign * row[(x - px + size) % size];
+            }
+        };
+        // Tightest cluster: the set pixel with the most energy, largest void: the
+        // empty pixel with the least
+        auto extreme = [&](bool set) {
+            int best = -1;
+            for (int p = 0; p < count; p++) {
+                if (on[p] == (set ? 1 : 0) && (best < 0 || (set ? energy[p] > energy[best] : energy[p] < energy[best])))
+                    best = p;
+            }
+            return best;
+        };
+
+        // Initial pattern: a tenth of the pixels at random, then moved from the
+        // tightest cluster to the largest void until that changes nothing
+        pcg32 rng;
+        rng.seed(0x626c7565u, 1);
+        const int initial = count / 10;
+        for (int placed = 0; placed < initial;) {
+            int p = static_cast<int>(rng.next_u32() % count);
+            if (!on[p]) {
+                toggle(p, true);
+                placed++;
+            }
+        }
+        while (true) {
+            int cluster = extreme(true);
+            toggle(cluster, false);
+            int gap = extreme(false);
+            toggle(gap, true);
+            if (gap == cluster)
+                break;
+        }
+        const std::vector<char> pattern = on;
+        const std::vector<double> pattern_energy = energy;
+
+        // Ranks below the initial pattern: remove the tightest clusters
+        for (int rank = initial - 1; rank >= 0; rank--) {
+            int p = extreme(true);
+            toggle(p, false);
+            values[p] = static_cast<float>((rank + 0.5) / count);
+        }
+        // Ranks above: fill the largest voids
+        on = pattern;
+        energy = pattern_energy;
+        for (int rank = initial; rank < count; rank++) {
+            int p = extreme(false);
+            toggle(p, true);
+            values[p] = static_cast<float>((rank + 0.5) / count);
+        }
+    }
+
+    double at(int x, int y) const {
+        return values[(y & (size - 1)) * size + (x & (size - 1))];
+    }
+
+    static const blue_noise_mask& get() {
+        static const blue_noise_mask mask;
+        return mask;
+    }
+};
+
+// Sampler state of one path: which pixel, which sample and the next dimension
+class pixel_sampler {
+    public:
+        void start(sampler_type sampler_kind, uint64_t seed, int x, int y, int width, int sample_index) {
+            type = sampler_kind;
+            key = mix64(seed ^ 0x73616d706c6572ULL);
+            pixel_x = x;
+            pixel_y = y;
+            pixel = static_cast<uint64_t>(y) * width + x;
+            index = static_cast<uint32_t>(sample_index);
+            dimension = 0;
+        }
+
+        // Moves to the first dimension of the bounce
+        void start_bounce(int depth) {
+            dimension = sampler_camera_dimensions + depth * sampler_bounce_dimensions;
+        }
+
+        // Moves to the light sampling dimensions of the bounce
+        void start_light(int depth) {
+            dimension = sampler_camera_dimensions + depth * sampler_bounce_dimensions + sampler_light_dimension;
+        }
+
+        // Moves to the Russian roulette dimension of the bounce
+        void start_roulette(int depth) {
+            dimension = sampler_camera_dimensions + depth * sampler_bounce_dimensions + sampler_roulette_dimension;
+        }
+
+        double get_1d() {
+            if (type == sampler_type::independent)
+                return random_double();
+            double u, v;
+            sample(dimension, u, v, true);
+            dimension++;
+            return u;
+        }
+
+        void get_2d(double& u, double& v) {
+            if (type == sampler_type::independent) {
+                u = random_double();
+                v = random_double();
+                return;
+            }
+            sample(dimension, u, v, false);
+            dimension += 2;
+        }
+
+    private:
+        sampler_type type = sampler_type::independent;
+        uint64_t key = 0;
+        uint64_t pixel = 0;
+        int pixel_x = 0, pixel_y = 0;
+        uint32_t index = 0;
+        int dimension = 0;
+
+        uint32_t dimension_seed(int d, uint64_t salt) const {
+            return static_cast<uint32_t>(hash_key(key, salt, static_cast<uint64_t>(d)));
+        }
+
+        // u (and v unless one_d) of dimension d
+        void sample(int d, double& u, double& v, bool one_d) const {
+            switch (type) {
+            case sampler_type::sobol: {
+                // Every dimension (pair) gets its own shuffle of the pixel's sample
+                // order and its own scrambling, Sobol (0,2) nets are only good in pairs
+                const uint32_t shuffled = owen_scramble(index, dimension_seed(d, pixel * 3));
+                u = u32_to_unit(owen_scramble(sobol_dimension0(shuffled), dimension_seed(d, pixel * 3 + 1)));
+                v = one_d ? 0.0 : u32_to_unit(owen_scramble(sobol_dimension1(shuffled), dimension_seed(d, pixel * 3 + 2)));
+                break;
+            }
+            case sampler_type::halton: {
+                const std::vector<uint32_t>& primes = prime_table::get().primes;
+                u = halton(primes, d, 0);
+                v = one_d ? 0.0 : halton(primes, d + 1, 1);
+                break;
+            }
+            case sampler_type::blue_noise: {
+                // The same points for every pixel, shifted on the torus by the mask
+                // at an offset that depends on the dimension. Neighbouring pixels get
+                // very different shifts, so what error is left is high frequency.
+                const uint32_t shuffled = owen_scramble(index, dimension_seed(d, 0));
+                u = u32_to_unit(owen_scramble(sobol_dimension0(shuffled), dimension_seed(d, 1)));
+                v = u32_to_unit(owen_scramble(sobol_dimension1(shuffled), dimension_seed(d, 2)));
+                const uint32_t offset = dimension_seed(d, 3);
+                const blue_noise_mask& mask = blue_noise_mask::get();
+                u = rotate(u, mask.at(pixel_x + static_cast<int>(offset & 63), pixel_y + static_cast<int>((offset >> 6) & 63)));
+                v = one_d ? 0.0 : rotate(v, mask.at(pixel_x + static_cast<int>((offset >> 12) & 63), pixel_y + static_cast<int>((offset >> 18) & 63)));
+                break;
+            }
+            default:
+                u = random_double();
+                v = one_d ? 0.0 : random_double();
+                break;
+            }
+        }
+
+        // Every pixel and dimension gets its own scrambling
+        double halton(const std::vector<uint32_t>& primes, int d, uint64_t component) const {
+            const uint64_t scramble = hash_key(key, pixel, static_cast<uint64_t>(d) * 2 + component);
+            // Past the last prime the dimension is padded with random numbers
+            if (d >= static_cast<int>(primes.size()))
+                return u32_to_unit(static_cast<uint32_t>(scramble));
+            return owen_scrambled_radical_inverse(primes[d], index, scramble);
+        }
+
+        // Toroidal shift, stays in [0,1)
+        static double rotate(double x, double shift) {
+            x += shift;
+            x = x >= 1.0 ? x - 1.0 : x;
+            return x < 1.0 ? x : 0.99999999999999989;
+        }
+};
+
+// Per-thread sampler, set up by the renderer before every camera sample like thread_rng()
+inline pixel_sampler& thread_sampler() {
+    thread_local pixel_sampler sampler;
+    return sampler;
+}
+
+inline double sample_1d() {
+    return thread_sampler().get_1d();
+}
+
+// The warps of vec3.h fed by the calling thread's sampler
+
+// Concentric, the polar mapping would lose much of the lens samples' stratification
+inline vec3 sample_in_unit_disk() {
+    double u, v;
+    thread_sampler().get_2d(u, v);
+    return concentric_disk_from_square(u, v);
+}
+
+inline vec3 sample_unit_vector() {
+    double u, v;
+    thread_sampler().get_2d(u, v);
+    return sphere_from_square(u, v);
+}
+
+inline vec3 sample_in_unit_sphere() {
+    double u, v;
+    thread_sampler().get_2d(u, v);
+    return ball_from_cube(u, v, thread_sampler().get_1d());
+}
+
+#endif
@@ -0,0 +1,427 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+// Scenes from files instead of code. A scene is written as text:
+//
+//     # comment
+//     camera <lookfrom x y z> <lookat x y z> <vup x y z> <vfov> <aperture> <focus_dist>
+//     sky on|off
+//     material <name> lambertian <r g b>
+//     material <name> metal <r g b> <fuzz>
+//     material <name> dielectric <index_of_refraction>
+//     material <name> light <r g b>
+//     sphere <x y z> <radius> <material name>
+//
+// and compiled (GHDscene) to a binary image laid out the way sphere_soa uses it:
+// the sphere arrays padded and in BVH leaf order, the BVH nodes and the materials,
+// each section 64 byte aligned. A binary file is memory mapped and the renderer
+// intersects the mapped arrays and nodes directly, so opening it costs little more
+// than creating the materials, whatever the number of spheres. Images are in the
+// byte order of the machine that wrote them, the header rejects anything else.
+//
+// load_scene_file() takes either form, text is compiled in memory.
+
+#include "rtweekend.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "bvh.h"
+#include "mapped_file.h"
+#include "../primitives/sphere_soa.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+static const char scene_file_magic[8] = { 'G', 'H', 'D', 'S', 'C', 'N', '0', '1' };
+static const uint32_t scene_file_version = 1;
+static const uint32_t scene_byte_order_mark = 0x01020304;
+static const size_t scene_section_alignment = 64;
+
+enum class scene_material_type : uint32_t {
+    lambertian,
+    metal,
+    dielectric,
+    light
+};
+
+// lambertian and light: color. metal: color, fuzz. dielectric: index of refraction.
+struct scene_material_record {
+    scene_material_type type;
+    uint32_t reserved;
+    double params[4];
+};
+
+struct scene_camera {
+    double lookfrom[3];
+    double lookat[3];
+    double vup[3];
+    double vfov;
+    double aperture;
+    double focus_dist;
+};
+
+struct scene_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t node_size;      // sizeof(bvh_node) of the writer
+    uint32_t sphere_padding; // sphere_soa::padding of the writer
+    uint32_t has_camera;
+    uint32_t sky;
+    uint64_t file_size;
+    uint64_t material_count;
+    uint64_t sphere_count;
+    uint64_t node_count;
+    // Byte offsets from the start of the file
+    uint64_t material_offset;
+    uint64_t cx_offset, cy_offset, cz_offset, radius_offset;
+    uint64_t material_id_offset;
+    uint64_t node_offset;
+    scene_camera camera;
+};
+
+static_assert(std::is_trivially_copyable<scene_file_header>::value, "scene_file_header is written as bytes");
+static_assert(std::is_trivially_copyable<bvh_node>::value, "bvh_node is written as bytes");
+
+// A parsed text scene, spheres in file order
+struct scene_description {
+    std::vector<scene_material_record> materials;
+    std::vector<double> cx, cy, cz, radius;
+    std::vector<int> material_ids;
+    scene_camera camera = {};
+    bool has_camera = false;
+    bool sky = true;
+};
+
+// What the renderer takes from a scene file
+struct loaded_scene {
+    hittable_list world;
+    scene_camera camera = {};
+    bool has_camera = false;
+    bool sky = true;
+    size_t sphere_count = 0;
+};
+
+inline bool parse_scene_text(std::istream& in, const std::string& path, scene_description& scene) {
+    std::unordered_map<std::string, int> material_names;
+    std::string line;
+    size_t line_number = 0;
+
+    auto fail = [&](const std::string& message) {
+        std::cerr << path << ":" << line_number << ": " << message << "\n";
+        return false;
+    };
+
+    while (std::getline(in, line)) {
+        line_number++;
+        const size_t comment = line.find('#');
+        if (comment != std::string::npos)
+            line.resize(comment);
+
+        std::istringstream fields(line);
+        std::string keyword;
+        if (!(fields >> keyword))
+            continue;
+
+        if (keyword == "camera") {
+            scene_camera& c = scene.camera;
+            if (!(fields >> c.lookfrom[0] >> c.lookfrom[1] >> c.lookfrom[2] >> c.lookat[0] >> c.lookat[1] >> c.lookat[2]
+                         >> c.vup[0] >> c.vup[1] >> c.vup[2] >> c.vfov >> c.aperture >> c.focus_dist))
+                return fail("camera expects lookfrom, lookat, vup, vfov, aperture and focus_dist");
+            scene.has_camera = true;
+        }
+        else if (keyword == "sky") {
+            std::string value;
+            fields >> value;
+            if (value != "on" && value != "off")
+                return fail("sky expects on or off");
+            scene.sky = value == "on";
+        }
+        else if (keyword == "material") {
+            std::string name, type;
+            if (!(fields >> name >> type))
+                return fail("material expects a name and a type");
+            if (material_names.count(name))
+                return fail("material " + name + " is already defined");
+
+            scene_material_record record = {};
+            double* p = record.params;
+            bool valid;
+            if (type == "lambertian") {
+                record.type = scene_material_type::lambertian;
+                valid = static_cast<bool>(fields >> p[0] >> p[1] >> p[2]);
+            }
+            else if (type == "metal") {
+                record.type = scene_material_type::metal;
+                valid = static_cast<bool>(fields >> p[0] >> p[1] >> p[2] >> p[3]);
+            }
+            else if (type == "dielectric") {
+                record.type = scene_material_type::dielectric;
+                valid = static_cast<bool>(fields >> p[0]);
+            }
+            else if (type == "light") {
+                record.type = scene_material_type::light;
+                valid = static_cast<bool>(fields >> p[0] >> p[1] >> p[2]);
+            }
+            else {
+                return fail("unknown material type " + type);
+            }
+            if (!valid)
+                return fail("missing or invalid parameters for " + type + " material " + name);
+
+            material_names[name] = static_cast<int>(scene.materials.size());
+            scene.materials.push_back(record);
+        }
+        else if (keyword == "sphere") {
+            double x, y, z, r;
+            std::string name;
+            if (!(fields >> x >> y >> z >> r >> name))
+                return fail("sphere expects a center, a radius and a material");
+            auto found = material_names.find(name);
+            if (found == material_names.end())
+                return fail("unknown material " + name);
+            if (scene.cx.size() >= static_cast<size_t>(INT_MAX - sphere_soa::padding))
+                return fail("too many spheres");
+
+            scene.cx.push_back(x);
+            scene.cy.push_back(y);
+            scene.cz.push_back(z);
+            scene.radius.push_back(r);
+            scene.material_ids.push_back(found->second);
+        }
+        else {
+            return fail("unknown keyword " + keyword);
+        }
+
+        std::string extra;
+        if (fields >> extra)
+            return fail("unexpected " + extra);
+    }
+
+    return true;
+}
+
+inline bool parse_scene_text(const std::string& path, scene_description& scene) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Could not open " << path << "\n";
+        return false;
+    }
+    return parse_scene_text(in, path, scene);
+}
+
+// The binary image of the scene. Builds the BVH the way sphere_soa::build does, so a
+// compiled scene renders exactly like the same spheres added in code.
+inline std::vector<char> compile_scene(const scene_description& scene) {
+    const size_t count = scene.cx.size();
+    std::vector<aabb> boxes(count);
+    for (size_t i = 0; i < count; i++) {
+        double r = fabs(scene.radius[i]);
+        boxes[i] = aabb(point3(scene.cx[i] - r, scene.cy[i] - r, scene.cz[i] - r),
+                        point3(scene.cx[i] + r, scene.cy[i] + r, scene.cz[i] + r));
+    }
+    bvh_tree tree;
+    tree.build(boxes, sphere_soa::max_leaf_size, 0.25);
+    std::vector<aabb>().swap(boxes);
+
+    scene_file_header header = {};
+    memcpy(header.magic, scene_file_magic, sizeof(header.magic));
+    header.version = scene_file_version;
+    header.byte_order = scene_byte_order_mark;
+    header.node_size = sizeof(bvh_node);
+    header.sphere_padding = sphere_soa::padding;
+    header.has_camera = scene.has_camera;
+    header.sky = scene.sky;
+    header.camera = scene.camera;
+    header.material_count = scene.materials.size();
+    header.sphere_count = count;
+    header.node_count = tree.nodes.size();
+
+    // Lay the sections out one after the other
+    size_t end = sizeof(header);
+    auto section = [&end](size_t bytes) {
+        end = (end + scene_section_alignment - 1) / scene_section_alignment * scene_section_alignment;
+        const size_t offset = end;
+        end += bytes;
+        return static_cast<uint64_t>(offset);
+    };
+    const size_t padded = count + sphere_soa::padding;
+    header.material_offset = section(scene.materials.size() * sizeof(scene_material_record));
+    header.cx_offset = section(padded * sizeof(double));
+    header.cy_offset = section(padded * sizeof(double));
+    header.cz_offset = section(padded * sizeof(double));
+    header.radius_offset = section(padded * sizeof(double));
+    header.material_id_offset = section(padded * sizeof(int));
+    header.node_offset = section(tree.nodes.size() * sizeof(bvh_node));
+    header.file_size = end;
+
+    // Zero filled, which is also the padding after the last sphere
+    std::vector<char> image(end, 0);
+    memcpy(image.data(), &header, sizeof(header));
+    if (!scene.materials.empty())
+        memcpy(image.data() + header.material_offset, scene.materials.data(), scene.materials.size() * sizeof(scene_material_record));
+    if (!tree.nodes.empty())
+        memcpy(image.data() + header.node_offset, tree.nodes.data(), tree.nodes.size() * sizeof(bvh_node));
+
+    auto reorder = [&](const std::vector<double>& values, uint64_t offset) {
+        double* ordered = reinterpret_cast<double*>(image.data() + offset);
+        for (size_t i = 0; i < count; i++)
+            ordered[i] = values[tree.prim_indices[i]];
+    };
+    reorder(scene.cx, header.cx_offset);
+    reorder(scene.cy, header.cy_offset);
+    reorder(scene.cz, header.cz_offset);
+    reorder(scene.radius, header.radius_offset);
+    int* ids = reinterpret_cast<int*>(image.data() + header.material_id_offset);
+    for (size_t i = 0; i < count; i++)
+        ids[i] = scene.material_ids[tree.prim_indices[i]];
+
+    return image;
+}
+
+inline bool write_scene_image(const std::string& path, const std::vector<char>& image) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        std::cerr << "Could not open " << path << " for writing\n";
+        return false;
+    }
+    out.write(image.data(), static_cast<std::streamsize>(image.size()));
+    if (!out) {
+        std::cerr << "Could not write " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+inline bool is_scene_image(const char* data, size_t size) {
+    return size >= sizeof(scene_file_magic) && memcmp(data, scene_file_magic, sizeof(scene_file_magic)) == 0;
+}
+
+inline shared_ptr<material> make_scene_material(const scene_material_record& record) {
+    const double* p = record.params;
+    switch (record.type) {
+    case scene_material_type::lambertian: return make_shared<lambertian>(color(p[0], p[1], p[2]));
+    case scene_material_type::metal: return make_shared<metal>(color(p[0], p[1], p[2]), p[3]);
+    case scene_material_type::dielectric: return make_shared<dielectric>(p[0]);
+    case scene_material_type::light: return make_shared<diffuse_light>(color(p[0], p[1], p[2]));
+    }
+    return nullptr;
+}
+
+// Checks the image at data and points the scene at it without copying the spheres
+// or the BVH. storage owns data and is kept alive by the world.
+inline bool open_scene_image(const char* data, size_t size, shared_ptr<const void> storage,
+                             const std::string& path, loaded_scene& scene) {
+    auto fail = [&path](const std::string& message) {
+        std::cerr << path << ": " << message << "\n";
+        return false;
+    };
+
+    scene_file_header header;
+    if (size < sizeof(header) || !is_scene_image(data, size))
+        return fail("not a scene file");
+    memcpy(&header, data, sizeof(header));
+    if (header.version != scene_file_version)
+        return fail("unsupported scene file version " + std::to_string(header.version));
+    if (header.byte_order != scene_byte_order_mark || header.node_size != sizeof(bvh_node) ||
+        header.sphere_padding != static_cast<uint32_t>(sphere_soa::padding))
+        return fail("written by an incompatible build, compile it again from its text");
+    if (header.file_size != size)
+        return fail("truncated");
+
+    // Every count is bounded by the file size before it is multiplied
+    const uint64_t count = header.sphere_count;
+    if (count > size || header.material_count > size || header.node_count > size || count > INT_MAX - sphere_soa::padding)
+        return fail("corrupt header");
+    const uint64_t padded = count + sphere_soa::padding;
+    auto section_fits = [size](uint64_t offset, uint64_t bytes) {
+        return offset % 8 == 0 && offset <= size && bytes <= size - offset;
+    };
+    if (!section_fits(header.material_offset, header.material_count * sizeof(scene_material_record)) ||
+        !section_fits(header.cx_offset, padded * sizeof(double)) ||
+        !section_fits(header.cy_offset, padded * sizeof(double)) ||
+        !section_fits(header.cz_offset, padded * sizeof(double)) ||
+        !section_fits(header.radius_offset, padded * sizeof(double)) ||
+        !section_fits(header.material_id_offset, padded * sizeof(int)) ||
+        !section_fits(header.node_offset, header.node_count * sizeof(bvh_node)))
+        return fail("corrupt section table");
+
+    const scene_material_record* records = reinterpret_cast<const scene_material_record*>(data + header.material_offset);
+    const int* ids = reinterpret_cast<const int*>(data + header.material_id_offset);
+    const bvh_node* nodes = reinterpret_cast<const bvh_node*>(data + header.node_offset);
+
+    // Indices are checked once here, so traversal and shading can trust them
+    std::vector<shared_ptr<material>> materials;
+    materials.reserve(header.material_count);
+    for (uint64_t i = 0; i < header.material_count; i++) {
+        shared_ptr<material> m = make_scene_material(records[i]);
+        if (!m)
+            return fail("unknown material type");
+        materials.push_back(m);
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        if (ids[i] < 0 || static_cast<uint64_t>(ids[i]) >= header.material_count)
+            return fail("material index out of range");
+    }
+    if ((count == 0) != (header.node_count == 0))
+        return fail("corrupt BVH");
+    // Children come after their parent, so one pass also bounds the depth the
+    // fixed size traversal stacks can hold
+    std::vector<uint8_t> depth(header.node_count, 0);
+    for (uint64_t i = 0; i < header.node_count; i++) {
+        const bvh_node& node = nodes[i];
+        const bool valid = node.is_leaf()
+            ? node.left_first >= 0 && static_cast<uint64_t>(node.left_first) + node.count <= count
+            : node.count == 0 && static_cast<uint64_t>(node.left_first) > i && static_cast<uint64_t>(node.left_first) + 1 < header.node_count;
+        if (!valid || node.axis < 0 || node.axis > 2 || depth[i] >= bvh_tree::max_depth - 1)
+            return fail("corrupt BVH");
+        if (!node.is_leaf()) {
+            depth[node.left_first] = std::max(depth[node.left_first], static_cast<uint8_t>(depth[i] + 1));
+            depth[node.left_first + 1] = std::max(depth[node.left_first + 1], static_cast<uint8_t>(depth[i] + 1));
+        }
+    }
+
+    scene.world.clear();
+    if (count > 0) {
+        const sphere_arrays arrays = {
+            reinterpret_cast<const double*>(data + header.cx_offset),
+            reinterpret_cast<const double*>(data + header.cy_offset),
+            reinterpret_cast<const double*>(data + header.cz_offset),
+            reinterpret_cast<const double*>(data + header.radius_offset)
+        };
+        auto spheres = make_shared<sphere_soa>();
+        spheres->attach(arrays, ids, count, nodes, header.node_count, materials, storage);
+        scene.world.add(spheres);
+    }
+    scene.camera = header.camera;
+    scene.has_camera = header.has_camera != 0;
+    scene.sky = header.sky != 0;
+    scene.sphere_count = count;
+    return true;
+}
+
+// Maps a compiled scene, or parses and compiles a text one
+inline bool load_scene_file(const std::string& path, loaded_scene& scene) {
+    auto file = make_shared<mapped_file>();
+    if (!file->open(path))
+        return false;
+    if (is_scene_image(file->data(), file->size()))
+        return open_scene_image(file->data(), file->size(), file, path, scene);
+    file->close();
+
+    scene_description description;
+    if (!parse_scene_text(path, description))
+        return false;
+    auto image = make_shared<std::vector<char>>(compile_scene(description));
+    return open_scene_image(image->data(), image->size(), image, path, scene);
+}
+
+#endif
@@ -1,8 +1,25 @@
+#pragma once
+
 #include <vector>
 #include "hittable_list.h"
 #include "material.h"
 #include "../primitives/sphere.h"
+#include "../primitives/triangle_mesh.h"
+#include "../primitives/sphere_soa.h"
+#include "../primitives/instance.h"
+#include "mesh_loader.h"
+
 
+// What a scene builder returns: the objects, and whether rays that leave them see
+// the sky gradient. Scenes lit only by their own lights turn the sky off, so that
+// the light sampling sees every light there is.
+struct built_scene {
+    built_scene() {}
+    built_scene(const hittable_list& world, bool sky = true) : world(world), sky(sky) {}
+
+    hittable_list world;
+    bool sky = true;
+};
 
 // Scenes
 std::vector<std::vector<double>> generate_spheres(double scale)
@@ -416,7 +433,7 @@ std::vector<std::vector<double>> generate_spheres(double scale)
     return spheres;
 }
 
-hittable_list GHD_scene()
+built_scene GHD_scene()
 {
     hittable_list world;
     // Ground
@@ -462,7 +479,7 @@ hittable_list GHD_scene()
     return world;
 }
 
-hittable_list random_scene()
+built_scene random_scene()
 {
     hittable_list world;
 
@@ -517,7 +534,7 @@ hittable_list random_scene()
     return world;
 }
 
-hittable_list floor_sphere_scene()
+built_scene floor_sphere_scene()
 {
     hittable_list world;
     auto material_ground = make_shared<metal>(color(0.8, 0.8, 0.8), 0.35);
@@ -527,7 +544,7 @@ hittable_list floor_sphere_scene()
     return world;
 }
 
-hittable_list three_spheres_scene()
+built_scene three_spheres_scene()
 {
     hittable_list world;
     auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
@@ -541,7 +558,7 @@ hittable_list three_spheres_scene()
     return world;
 }
 
-hittable_list three_spheres_scene2()
+built_scene three_spheres_scene2()
 {
     hittable_list world;
     auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
@@ -555,7 +572,7 @@ hittable_list three_spheres_scene2()
     return world;
 }
 
-hittable_list three_spheres_scene3()
+built_scene three_spheres_scene3()
 {
     hittable_list world;
     auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
@@ -569,7 +586,7 @@ hittable_list three_spheres_scene3()
     return world;
 }
 
-hittable_list fov_scene()
+built_scene fov_scene()
 {
     auto R = cos(pi / 4);
     hittable_list world;
@@ -579,3 +596,216 @@ hittable_list fov_scene()
     world.add(make_shared<sphere>(point3(R, 0, -1), R, material_right));
     return world;
 }
+
+// Lit only by two emissive spheres, the sky is black
+built_scene lights_scene()
+{
+    hittable_list world;
+    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+
+    // Two rows of small diffuse spheres
+    for (int a = -5; a <= 5; a++)
+    {
+        auto albedo = a % 2 == 0 ? color(0.7, 0.2, 0.2) : color(0.2, 0.6, 0.3);
+        world.add(make_shared<sphere>(point3(a, 0.25, 2.2), 0.25, make_shared<lambertian>(albedo)));
+        world.add(make_shared<sphere>(point3(a, 0.25, -2.2), 0.25, make_shared<lambertian>(color(0.7, 0.7, 0.7))));
+    }
+
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, make_shared<metal>(color(0.7, 0.6, 0.5), 0.0)));
+
+    // A small bright light overhead and a dimmer, larger blue one between the spheres
+    world.add(make_shared<sphere>(point3(1, 4, 1), 0.3, make_shared<diffuse_light>(color(60, 54, 45))));
+    world.add(make_shared<sphere>(point3(-2, 0.5, 1.2), 0.4, make_shared<diffuse_light>(color(1, 2, 6))));
+    return built_scene(world, false);
+}
+
+// Torus around the y axis with smooth normals, rings x sides quads
+shared_ptr<triangle_mesh> torus_mesh(const point3& center, double major_radius, double minor_radius, int rings, int sides)
+{
+    auto mesh = make_shared<triangle_mesh>();
+    for (int i = 0; i < rings; i++)
+    {
+        const double phi = 2.0 * pi * i / rings;
+        const vec3 radial(cos(phi), 0.0, sin(phi));
+        for (int j = 0; j < sides; j++)
+        {
+            const double theta = 2.0 * pi * j / sides;
+            const vec3 normal = cos(theta) * radial + vec3(0.0, sin(theta), 0.0);
+            mesh->add_vertex(center + major_radius * radial + minor_radius * normal, normal);
+        }
+    }
+    for (int i = 0; i < rings; i++)
+    {
+        for (int j = 0; j < sides; j++)
+        {
+            const uint32_t a = i * sides + j;
+            const uint32_t b = ((i + 1) % rings) * sides + j;
+            const uint32_t c = ((i + 1) % rings) * sides + (j + 1) % sides;
+            const uint32_t d = i * sides + (j + 1) % sides;
+            mesh->add_triangle(a, d, c);
+            mesh->add_triangle(a, c, b);
+        }
+    }
+    return mesh;
+}
+
+// Flat shaded regular icosahedron
+shared_ptr<triangle_mesh> icosahedron_mesh(const point3& center, double radius)
+{
+    auto mesh = make_shared<triangle_mesh>();
+    const double g = (1.0 + sqrt(5.0)) / 2.0;
+    const double s = radius / sqrt(1.0 + g * g);
+    const double corners[12][3] = {
+        {-1, g, 0}, {1, g, 0}, {-1, -g, 0}, {1, -g, 0},
+        {0, -1, g}, {0, 1, g}, {0, -1, -g}, {0, 1, -g},
+        {g, 0, -1}, {g, 0, 1}, {-g, 0, -1}, {-g, 0, 1}
+    };
+    const uint32_t faces[20][3] = {
+        {0, 11, 5}, {0, 5, 1}, {0, 1, 7}, {0, 7, 10}, {0, 10, 11},
+        {1, 5, 9}, {5, 11, 4}, {11, 10, 2}, {10, 7, 6}, {7, 1, 8},
+        {3, 9, 4}, {3, 4, 2}, {3, 2, 6}, {3, 6, 8}, {3, 8, 9},
+        {4, 9, 5}, {2, 4, 11}, {6, 2, 10}, {8, 6, 7}, {9, 8, 1}
+    };
+    for (const auto& corner : corners)
+        mesh->add_vertex(center + s * vec3(corner[0], corner[1], corner[2]));
+    for (const auto& face : faces)
+        mesh->add_triangle(face[0], face[1], face[2]);
+    return mesh;
+}
+
+// Scales and moves the mesh so its largest extent is size and it stands on y = 0 at
+// (x, z) of position
+void fit_mesh(triangle_mesh& mesh, const point3& position, double size)
+{
+    aabb box;
+    for (const point3& v : mesh.vertices)
+        box.expand(v);
+    const vec3 extent = box.max() - box.min();
+    const double largest = fmax(extent.x(), fmax(extent.y(), extent.z()));
+    const double scale = largest > 0.0 ? size / largest : 1.0;
+    const point3 base(0.5 * (box.min().x() + box.max().x()), box.min().y(), 0.5 * (box.min().z() + box.max().z()));
+    for (point3& v : mesh.vertices)
+        v = position + scale * (v - base);
+}
+
+// Loads an OBJ or PLY file for mesh_scene(), sized and placed where its built-in
+// meshes stand. Returns null and prints why if it cannot be loaded.
+shared_ptr<triangle_mesh> load_scene_mesh(const std::string& mesh_file)
+{
+    auto mesh = make_shared<triangle_mesh>();
+    if (!load_mesh(mesh_file, *mesh))
+        return nullptr;
+    if (mesh->triangle_count() == 0)
+    {
+        std::cerr << mesh_file << " has no triangles\n";
+        return nullptr;
+    }
+    fit_mesh(*mesh, point3(0, 0, 0), 2.5);
+    mesh->set_material(make_shared<lambertian>(color(0.7, 0.6, 0.5)));
+    mesh->build();
+    return mesh;
+}
+
+// Triangle meshes on a floor. A mesh from load_scene_mesh() replaces the built-in
+// meshes.
+built_scene mesh_scene(const shared_ptr<triangle_mesh>& loaded_mesh = nullptr)
+{
+    hittable_list world;
+    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+
+    if (loaded_mesh)
+    {
+        world.add(loaded_mesh);
+        return world;
+    }
+
+    auto torus = torus_mesh(point3(0, 0.4, 0), 1.0, 0.4, 96, 48);
+    torus->set_material(make_shared<metal>(color(0.8, 0.6, 0.2), 0.05));
+    auto left = icosahedron_mesh(point3(-0.5, 0.8, -2.3), 0.8);
+    left->set_material(make_shared<lambertian>(color(0.4, 0.2, 0.1)));
+    auto right = icosahedron_mesh(point3(0.5, 0.8, 2.3), 0.8);
+    right->set_material(make_shared<dielectric>(1.5));
+    for (const auto& mesh : { torus, left, right })
+    {
+        mesh->build();
+        world.add(mesh);
+    }
+    return world;
+}
+
+// A field of copies of three assets, a torus, an icosahedron and a cluster of
+// spheres, each built once. The copies differ only in transform and material, so
+// the scene's memory grows by one instance_set entry per copy.
+built_scene instances_scene(int copies_per_side = 150)
+{
+    hittable_list world;
+    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+
+    // Assets, about one unit in radius and resting on y = 0
+    auto default_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    auto torus = torus_mesh(point3(0, 0.4, 0), 1.0, 0.4, 48, 24);
+    torus->set_material(default_material);
+    torus->build();
+    auto gem = icosahedron_mesh(point3(0, 1, 0), 1.0);
+    gem->set_material(default_material);
+    gem->build();
+    auto cluster = make_shared<sphere_soa>();
+    cluster->add(point3(0, 0.5, 0), 0.5, default_material);
+    for (int k = 0; k < 6; k++)
+    {
+        const double angle = 2.0 * pi * k / 6;
+        cluster->add(point3(0.7 * cos(angle), 0.3, 0.7 * sin(angle)), 0.3, default_material);
+    }
+    cluster->build();
+
+    auto field = make_shared<instance_set>();
+    const int assets[] = { field->add_geometry(torus), field->add_geometry(gem), field->add_geometry(cluster) };
+
+    std::vector<int> materials;
+    for (int m = 0; m < 12; m++)
+        materials.push_back(field->add_material(make_shared<lambertian>(color::random() * color::random())));
+    for (int m = 0; m < 3; m++)
+        materials.push_back(field->add_material(make_shared<metal>(color::random(0.5, 1), random_double(0, 0.5))));
+    materials.push_back(field->add_material(make_shared<dielectric>(1.5)));
+
+    // Small copies on a jittered grid, turned around y and tilted a little
+    const double extent = 12.0;
+    const double spacing = 2.0 * extent / copies_per_side;
+    const double scale = 0.35 * spacing;
+    for (int a = 0; a < copies_per_side; a++)
+    {
+        for (int b = 0; b < copies_per_side; b++)
+        {
+            point3 position(-extent + (a + 0.2 + 0.6 * random_double()) * spacing, 0.0,
+                            -extent + (b + 0.2 + 0.6 * random_double()) * spacing);
+            if ((position - point3(4, 0, 0)).length() < 1.5 || (position - point3(0, 0, 0)).length() < 1.5 ||
+                (position - point3(-4, 0, 0)).length() < 1.5)
+                continue;
+
+            const int asset = static_cast<int>(3 * random_double());
+            const int material = materials[static_cast<int>(materials.size() * random_double())];
+            const double size = scale * random_double(0.6, 1.0);
+            const vec3 tilt_axis(random_double(-1, 1), 0.0, random_double(-1, 1));
+            const affine_transform turn = affine_transform::rotation(vec3(0, 1, 0), random_double(0, 360));
+            const affine_transform tilt = affine_transform::rotation(tilt_axis.length_squared() > 0.0 ? tilt_axis : vec3(1, 0, 0), random_double(0, 15));
+            const affine_transform place = affine_transform::translation(position);
+            field->add(assets[asset], place * tilt * turn * affine_transform::scaling(size), material);
+        }
+    }
+
+    // One large copy of each asset
+    field->add(assets[1], affine_transform::translation(vec3(0, 0, 0)), materials.back());
+    field->add(assets[2], affine_transform::translation(vec3(-4, 0, 0)) * affine_transform::scaling(1.2),
+               field->add_material(make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+    field->add(assets[0], affine_transform::translation(vec3(4, 0.2, 0)) * affine_transform::rotation(vec3(1, 0, 0), 20),
+               field->add_material(make_shared<metal>(color(0.7, 0.6, 0.5), 0.0)));
+
+    field->build();
+    world.add(field);
+    return world;
+}
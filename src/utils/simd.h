@@ -0,0 +1,114 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Runtime detection of the x86 vector instruction sets used by the batch
+// intersection kernels. Kernels are compiled for every level with per-function
+// target attributes and one of them is picked at runtime.
+
+#include <string>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GHD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC accepts intrinsics for any instruction set without target attributes
+#if defined(GHD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define GHD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define GHD_TARGET(isa)
+#endif
+
+// The batch kernels and their scalar references are compiled between
+// GHD_NO_CONTRACT_BEGIN and GHD_NO_CONTRACT_END, without FMA contraction, so that
+// every level rounds exactly like the scalar code. On Clang the rest of the renderer
+// keeps the compiler's default. GCC has no production pragma for this (optimize()
+// is a debugging aid and blocks inlining), CMakeLists.txt passes -ffp-contract=off
+// to the sources that include the kernels instead.
+#if defined(__clang__)
+#define GHD_NO_CONTRACT_BEGIN _Pragma("float_control(push)") _Pragma("clang fp contract(off)")
+#define GHD_NO_CONTRACT_END _Pragma("float_control(pop)")
+#else
+#define GHD_NO_CONTRACT_BEGIN
+#define GHD_NO_CONTRACT_END
+#endif
+
+enum class simd_level {
+    scalar,
+    sse2,
+    avx2,
+    avx512
+};
+
+inline const char* simd_level_name(simd_level level) {
+    switch (level) {
+    case simd_level::sse2: return "sse2";
+    case simd_level::avx2: return "avx2";
+    case simd_level::avx512: return "avx512";
+    default: return "scalar";
+    }
+}
+
+// Returns false if the name is unknown
+inline bool simd_level_from_string(const std::string& name, simd_level& level) {
+    for (simd_level l : { simd_level::scalar, simd_level::sse2, simd_level::avx2, simd_level::avx512 }) {
+        if (name == simd_level_name(l)) {
+            level = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Widest instruction set supported by both the CPU and the OS
+inline simd_level detect_simd_level() {
+#if defined(GHD_X86)
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    bool sse2 = (info[3] & (1 << 26)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    bool ymm_enabled = (xcr0 & 0x6) == 0x6;
+    bool zmm_enabled = (xcr0 & 0xe6) == 0xe6;
+    bool avx2 = false, avx512 = false;
+    if (max_leaf >= 7) {
+        __cpuidex(info, 7, 0);
+        avx2 = avx && ymm_enabled && (info[1] & (1 << 5)) != 0;
+        avx512 = zmm_enabled && (info[1] & (1 << 16)) != 0;
+    }
+    if (avx512) return simd_level::avx512;
+    if (avx2) return simd_level::avx2;
+    if (sse2) return simd_level::sse2;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return simd_level::avx512;
+    if (__builtin_cpu_supports("avx2")) return simd_level::avx2;
+    if (__builtin_cpu_supports("sse2")) return simd_level::sse2;
+#endif
+#endif
+    return simd_level::scalar;
+}
+
+// Level used by the kernels. Defaults to the detected one capped at AVX2: with
+// leaves of at most 8 spheres AVX-512 measured slower than AVX2 in GHDbench, so it
+// has to be asked for with set_simd_level(). Raising the level above what the CPU
+// supports is ignored.
+inline simd_level& active_simd_level() {
+    static simd_level level = detect_simd_level() == simd_level::avx512 ? simd_level::avx2 : detect_simd_level();
+    return level;
+}
+
+inline void set_simd_level(simd_level level) {
+    if (static_cast<int>(level) > static_cast<int>(detect_simd_level()))
+        level = detect_simd_level();
+    active_simd_level() = level;
+}
+
+#endif
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "image.h"
+
+// OpenGL texture that displays a GHDImage in the viewport. Only the GUI uses this.
+// The texture storage is allocated once per image size. Updates go through a ring
+// of pixel buffer objects: the changed tiles are copied into a mapped buffer and
+// glTexSubImage2D sources them from it, so the copy to the GPU happens
+// asynchronously instead of stalling the GUI thread.
+class GHDTexture {
+private:
+    static const int pbo_count = 3;
+
+    GLuint textureId = 0;
+    bool textureInitialized = false;
+    int width = 0;
+    int height = 0;
+
+    GLuint pbos[pbo_count] = {};
+    // Signalled once the GPU has consumed the uploads sourced from the buffer
+    GLsync fences[pbo_count] = {};
+    int nextPbo = 0;
+
+    // (Re)allocates the texture and the buffers for a new image size
+    void allocate(int w, int h) {
+        if (!textureInitialized) {
+            glGenTextures(1, &textureId);
+            glBindTexture(GL_TEXTURE_2D, textureId);
+
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+            glGenBuffers(pbo_count, pbos);
+            textureInitialized = true;
+        }
+
+        width = w;
+        height = h;
+        glBindTexture(GL_TEXTURE_2D, textureId);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+        // A whole image fits in every buffer
+        for (int i = 0; i < pbo_count; i++) {
+            release_fence(i);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[i]);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, static_cast<GLsizeiptr>(width) * height * 4, nullptr, GL_STREAM_DRAW);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    void release_fence(int i) {
+        if (fences[i]) {
+            glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+    }
+
+public:
+    GHDTexture() {}
+    GHDTexture(const GHDTexture&) = delete;
+    GHDTexture& operator=(const GHDTexture&) = delete;
+
+    // Uploads the whole image
+    void upload(const GHDImage& image) {
+        upload(image, std::vector<Tile>{ Tile{ 0, 0, image.get_width(), image.get_height() } });
+    }
+
+    // Uploads only the given tiles of the image. A change of size uploads everything.
+    void upload(const GHDImage& image, const std::vector<Tile>& tiles) {
+        if (image.get_width() <= 0 || image.get_height() <= 0)
+            return;
+        if (!textureInitialized || image.get_width() != width || image.get_height() != height) {
+            allocate(image.get_width(), image.get_height());
+            upload(image);
+            return;
+        }
+        if (tiles.empty())
+            return;
+
+        // With a ring of buffers this wait almost never blocks
+        const int pbo = nextPbo;
+        nextPbo = (nextPbo + 1) % pbo_count;
+        if (fences[pbo]) {
+            glClientWaitSync(fences[pbo], GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000));
+            release_fence(pbo);
+        }
+
+        size_t bytes = 0;
+        for (const Tile& tile : tiles)
+            bytes += static_cast<size_t>(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * 4;
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[pbo]);
+        unsigned char* mapped = static_cast<unsigned char*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+        if (!mapped) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            return;
+        }
+
+        // Tiles are packed one after the other, each with its own row length
+        const unsigned char* pixels = image.data();
+        size_t offset = 0;
+        for (const Tile& tile : tiles) {
+            const size_t row_bytes = static_cast<size_t>(tile.x1 - tile.x0) * 4;
+            for (int row = tile.y0; row < tile.y1; row++) {
+                memcpy(mapped + offset, pixels + (static_cast<size_t>(row) * width + tile.x0) * 4, row_bytes);
+                offset += row_bytes;
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        glBindTexture(GL_TEXTURE_2D, textureId);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        offset = 0;
+        for (const Tile& tile : tiles) {
+            const int tile_width = tile.x1 - tile.x0;
+            const int tile_height = tile.y1 - tile.y0;
+            glTexSubImage2D(GL_TEXTURE_2D, 0, tile.x0, tile.y0, tile_width, tile_height, GL_RGBA, GL_UNSIGNED_BYTE,
+                reinterpret_cast<const void*>(offset));
+            offset += static_cast<size_t>(tile_width) * tile_height * 4;
+        }
+        fences[pbo] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    GLuint get_texture_id() const {
+        return textureId;
+    }
+
+    void* get_imgui_texture_id() const {
+        return reinterpret_cast<void*>(static_cast<intptr_t>(textureId));
+    }
+
+    ~GHDTexture() {
+        if (textureInitialized) {
+            for (int i = 0; i < pbo_count; i++)
+                release_fence(i);
+            glDeleteBuffers(pbo_count, pbos);
+            glDeleteTextures(1, &textureId);
+        }
+    }
+};
+
+// Example usage:
+// GHDTexture tex;
+// tex.upload(img);                           // whole image
+// tex.upload(img, frame.changed_tiles(v));   // only the tiles changed since version v
+// ImGui::Image(tex.get_imgui_texture_id(), ImVec2(img.get_width(), img.get_height()));
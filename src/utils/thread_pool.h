@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Per-worker counters, accumulated until reset_stats()
+struct WorkerStats {
+	uint64_t tasks = 0;   // tasks executed by the worker
+	uint64_t steals = 0;  // of which were stolen from another worker
+	double busy_ms = 0.0; // time spent inside tasks
+};
+
+// Fixed size pool of persistent threads with work-stealing.
+// parallel_for() hands every worker a contiguous block of the task range in its
+// own deque. A worker pops from the front of its deque and, once it runs dry,
+// steals from the back of the others, so neighbouring tasks tend to stay on the
+// same thread while skewed workloads still balance out.
+// The calling thread takes part as worker 0.
+class ThreadPool {
+public:
+	explicit ThreadPool(int thread_count)
+		: m_queues(thread_count > 0 ? thread_count : 1), m_stats(m_queues.size()) {
+		for (int w = 1; w < get_thread_count(); ++w)
+			m_threads.emplace_back([this, w]() { this->worker_loop(w); });
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (auto& thread : m_threads)
+			thread.join();
+	}
+
+	int get_thread_count() const { return static_cast<int>(m_queues.size()); }
+
+	// Runs task(index, worker) for every index in [0, count) and returns once all are done
+	void parallel_for(int count, const std::function<void(int, int)>& task) {
+		auto start = std::chrono::steady_clock::now();
+
+		// Deal out contiguous blocks so each worker starts on neighbouring tasks
+		int workers = get_thread_count();
+		for (int w = 0; w < workers; ++w) {
+			WorkQueue& queue = m_queues[w];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			int begin = static_cast<int>(static_cast<int64_t>(count) * w / workers);
+			int end = static_cast<int>(static_cast<int64_t>(count) * (w + 1) / workers);
+			for (int i = begin; i < end; ++i)
+				queue.tasks.push_back(i);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_task = &task;
+			m_pending_workers = workers - 1;
+			++m_generation;
+		}
+		m_wake.notify_all();
+
+		run_tasks(0);
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_done.wait(lock, [this]() { return m_pending_workers == 0; });
+			m_task = nullptr;
+		}
+
+		m_wall_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	const std::vector<WorkerStats>& get_stats() const { return m_stats; }
+
+	// Wall clock time spent in parallel_for since the last reset_stats()
+	double get_wall_ms() const { return m_wall_ms; }
+
+	// Fraction of the parallel_for wall time the worker spent running tasks
+	double get_utilization(int worker) const {
+		return m_wall_ms > 0.0 ? m_stats[worker].busy_ms / m_wall_ms : 0.0;
+	}
+
+	void reset_stats() {
+		for (auto& stats : m_stats)
+			stats = WorkerStats();
+		m_wall_ms = 0.0;
+	}
+
+private:
+	struct WorkQueue {
+		std::mutex mutex;
+		std::deque<int> tasks;
+	};
+
+	std::vector<WorkQueue> m_queues;
+	std::vector<WorkerStats> m_stats;
+	std::vector<std::thread> m_threads;
+	double m_wall_ms = 0.0;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	const std::function<void(int, int)>* m_task = nullptr;
+	uint64_t m_generation = 0;
+	int m_pending_workers = 0;
+	bool m_stop = false;
+
+	void worker_loop(int worker) {
+		uint64_t seen_generation = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wake.wait(lock, [this, seen_generation]() { return m_stop || m_generation != seen_generation; });
+				if (m_stop)
+					return;
+				seen_generation = m_generation;
+			}
+
+			run_tasks(worker);
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (--m_pending_workers == 0)
+					m_done.notify_one();
+			}
+		}
+	}
+
+	void run_tasks(int worker) {
+		const std::function<void(int, int)>& task = *m_task;
+		WorkerStats& stats = m_stats[worker];
+		int index;
+		bool stolen;
+		while (next_task(worker, index, stolen)) {
+			auto start = std::chrono::steady_clock::now();
+			task(index, worker);
+			stats.busy_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			stats.tasks++;
+			if (stolen)
+				stats.steals++;
+		}
+	}
+
+	// Own deque first (front), then steal from the back of the others
+	bool next_task(int worker, int& index, bool& stolen) {
+		{
+			WorkQueue& queue = m_queues[worker];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (!queue.tasks.empty()) {
+				index = queue.tasks.front();
+				queue.tasks.pop_front();
+				stolen = false;
+				return true;
+			}
+		}
+
+		int workers = get_thread_count();
+		for (int offset = 1; offset < workers; ++offset) {
+			WorkQueue& victim = m_queues[(worker + offset) % workers];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tasks.empty()) {
+				index = victim.tasks.back();
+				victim.tasks.pop_back();
+				stolen = true;
+				return true;
+			}
+		}
+		return false;
+	}
+};
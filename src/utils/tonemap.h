@@ -0,0 +1,257 @@
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+// Resolve of the accumulation buffer: divides the pixel sums by their sample
+// counts, applies a tonemapper and quantizes to 8 bits, in one pass over a row
+// span. The default gamma 2 tonemapper also has SSE2 and AVX2 kernels that resolve
+// 4 pixels per step, picked with active_simd_level().
+
+#include "rtweekend.h"
+#include "simd.h"
+#include "raw_image.h"
+
+#include <string>
+#include <type_traits>
+
+enum class tonemapper {
+    gamma2, // sqrt, what write_color does
+    srgb,   // sRGB transfer function
+    aces    // ACES filmic fit (Narkowicz 2015) followed by the sRGB transfer function
+};
+
+inline const char* tonemapper_name(tonemapper op) {
+    switch (op) {
+    case tonemapper::srgb: return "srgb";
+    case tonemapper::aces: return "aces";
+    default: return "gamma2";
+    }
+}
+
+// Returns false if the name is unknown
+inline bool tonemapper_from_string(const std::string& name, tonemapper& op) {
+    for (tonemapper t : { tonemapper::gamma2, tonemapper::srgb, tonemapper::aces }) {
+        if (name == tonemapper_name(t)) {
+            op = t;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The sRGB curve quantized to 8 bits only changes at 255 linear values. They are
+// computed once with the inverse curve, after that encoding a value is a binary search.
+struct srgb_table {
+    double thresholds[256];
+
+    srgb_table() {
+        thresholds[0] = -infinity;
+        for (int k = 1; k < 256; k++) {
+            double y = k / 256.0;
+            thresholds[k] = y <= 0.04045 ? y / 12.92 : pow((y + 0.055) / 1.055, 2.4);
+        }
+    }
+
+    unsigned char encode(double x) const {
+        int b = 0;
+        for (int step = 128; step > 0; step >>= 1)
+            b += x >= thresholds[b + step] ? step : 0;
+        return static_cast<unsigned char>(b);
+    }
+
+    static const srgb_table& get() {
+        static const srgb_table table;
+        return table;
+    }
+};
+
+// A tonemapper turns an averaged linear value into a display byte
+
+struct gamma2_op {
+    // NaN, e.g. the sqrt of a negative sum, maps to 0 like the SIMD kernels' max
+    static unsigned char to_byte(double x) {
+        x = sqrt(x);
+        return static_cast<unsigned char>(256 * (x > 0.0 ? (x < 0.999 ? x : 0.999) : 0.0));
+    }
+};
+
+struct srgb_op {
+    static unsigned char to_byte(double x) { return srgb_table::get().encode(x); }
+};
+
+struct aces_op {
+    static unsigned char to_byte(double x) {
+        x = x * (2.51 * x + 0.03) / (x * (2.43 * x + 0.59) + 0.14);
+        return srgb_table::get().encode(x);
+    }
+};
+
+GHD_NO_CONTRACT_BEGIN
+
+// r, g, b: channel sums of the first pixel (see RawImage::channel), counts: samples
+// per pixel, out: RGBA bytes, all for count consecutive pixels
+template <typename Op>
+inline void resolve_span(const accum_t* r, const accum_t* g, const accum_t* b, const int* counts, unsigned char* out, int count) {
+    for (int k = 0; k < count; k++) {
+        const double scale = 1.0 / (counts[k] > 1 ? counts[k] : 1);
+        const int s = k * accum_pixel_stride;
+        out[4 * k] = Op::to_byte(scale * r[s]);
+        out[4 * k + 1] = Op::to_byte(scale * g[s]);
+        out[4 * k + 2] = Op::to_byte(scale * b[s]);
+        out[4 * k + 3] = 255;
+    }
+}
+
+typedef void (*resolve_kernel)(const accum_t* r, const accum_t* g, const accum_t* b, const int* counts, unsigned char* out, int count);
+
+#if defined(GHD_X86)
+
+// The kernels round exactly like resolve_span<gamma2_op>, NaN and negative sums
+// included, and resolve 4 pixels per step. Each channel of the 4 pixels comes from
+// vector loads of the accumulation buffer, whatever its type and layout; a tail of
+// fewer than 4 pixels goes through resolve_span<gamma2_op>.
+
+// Channel sums of pixels [0, 4) as doubles: sums[c][0] holds pixels 0 and 1 of
+// channel c, sums[c][1] pixels 2 and 3. When interleaved, g and b follow r.
+// T is accum_t, a template parameter so that only its branch is compiled.
+template <typename T>
+GHD_TARGET("sse2")
+inline void load_channel_sums4(const T* r, const T* g, const T* b, __m128d (&sums)[3][2]) {
+    if constexpr (std::is_same<T, float>::value && accum_pixel_stride == 1) {
+        const __m128 planes[3] = { _mm_loadu_ps(r), _mm_loadu_ps(g), _mm_loadu_ps(b) };
+        for (int c = 0; c < 3; c++) {
+            sums[c][0] = _mm_cvtps_pd(planes[c]);
+            sums[c][1] = _mm_cvtps_pd(_mm_movehl_ps(planes[c], planes[c]));
+        }
+    }
+    else if constexpr (std::is_same<T, float>::value) {
+        // r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3
+        const __m128 v0 = _mm_loadu_ps(r), v1 = _mm_loadu_ps(r + 4), v2 = _mm_loadu_ps(r + 8);
+        const __m128 red = _mm_shuffle_ps(v0, _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+        const __m128 green = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0, 0, 1, 1)),
+                                            _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 blue = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1, 1, 2, 2)),
+                                           _mm_shuffle_ps(v2, v2, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 planes[3] = { red, green, blue };
+        for (int c = 0; c < 3; c++) {
+            sums[c][0] = _mm_cvtps_pd(planes[c]);
+            sums[c][1] = _mm_cvtps_pd(_mm_movehl_ps(planes[c], planes[c]));
+        }
+    }
+    else if constexpr (accum_pixel_stride == 1) {
+        const T* planes[3] = { r, g, b };
+        for (int c = 0; c < 3; c++) {
+            sums[c][0] = _mm_loadu_pd(planes[c]);
+            sums[c][1] = _mm_loadu_pd(planes[c] + 2);
+        }
+    }
+    else {
+        // r0 g0 | b0 r1 | g1 b1, then the same for pixels 2 and 3
+        for (int half = 0; half < 2; half++) {
+            const T* p = r + 6 * half;
+            const __m128d v0 = _mm_loadu_pd(p), v1 = _mm_loadu_pd(p + 2), v2 = _mm_loadu_pd(p + 4);
+            sums[0][half] = _mm_shuffle_pd(v0, v1, 2);
+            sums[1][half] = _mm_shuffle_pd(v0, v2, 1);
+            sums[2][half] = _mm_shuffle_pd(v1, v2, 2);
+        }
+    }
+}
+
+// 1 / max(count, 1) of pixels [0, 4), pixels 0 and 1 in scales[0]
+GHD_TARGET("sse2")
+inline void load_scales4(const int* counts, __m128d (&scales)[2]) {
+    const __m128i one = _mm_set1_epi32(1);
+    __m128i n = _mm_loadu_si128(reinterpret_cast<const __m128i*>(counts));
+    const __m128i above_one = _mm_cmpgt_epi32(n, one);
+    n = _mm_or_si128(_mm_and_si128(above_one, n), _mm_andnot_si128(above_one, one));
+    scales[0] = _mm_div_pd(_mm_set1_pd(1.0), _mm_cvtepi32_pd(n));
+    scales[1] = _mm_div_pd(_mm_set1_pd(1.0), _mm_cvtepi32_pd(_mm_srli_si128(n, 8)));
+}
+
+// Interleaves 4 bytes per channel, as 32-bit lanes in [0, 255], into RGBA with
+// alpha 255 and stores the 4 pixels
+GHD_TARGET("sse2")
+inline void store_rgba4(__m128i red, __m128i green, __m128i blue, unsigned char* out) {
+    const __m128i rg = _mm_packs_epi32(red, green);                   // r0..r3 g0..g3
+    const __m128i ba = _mm_packs_epi32(blue, _mm_set1_epi32(255));    // b0..b3 a0..a3
+    const __m128i rg_pairs = _mm_unpacklo_epi16(rg, _mm_srli_si128(rg, 8)); // r0 g0 r1 g1 ...
+    const __m128i ba_pairs = _mm_unpacklo_epi16(ba, _mm_srli_si128(ba, 8)); // b0 a0 b1 a1 ...
+    const __m128i rgba = _mm_packus_epi16(_mm_unpacklo_epi32(rg_pairs, ba_pairs), _mm_unpackhi_epi32(rg_pairs, ba_pairs));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), rgba);
+}
+
+GHD_TARGET("sse2")
+inline void resolve_span_gamma2_sse2(const accum_t* r, const accum_t* g, const accum_t* b, const int* counts, unsigned char* out, int count) {
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d upper = _mm_set1_pd(0.999);
+    const __m128d to_byte = _mm_set1_pd(256.0);
+
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+        const int s = k * accum_pixel_stride;
+        __m128d sums[3][2], scales[2];
+        load_channel_sums4(r + s, g + s, b + s, sums);
+        load_scales4(counts + k, scales);
+
+        __m128i bytes[3];
+        for (int c = 0; c < 3; c++) {
+            __m128i halves[2];
+            for (int h = 0; h < 2; h++) {
+                // max before min: a NaN (the sqrt of a negative sum) becomes 0
+                __m128d x = _mm_sqrt_pd(_mm_mul_pd(scales[h], sums[c][h]));
+                x = _mm_mul_pd(to_byte, _mm_min_pd(_mm_max_pd(x, zero), upper));
+                halves[h] = _mm_cvttpd_epi32(x);
+            }
+            bytes[c] = _mm_unpacklo_epi64(halves[0], halves[1]);
+        }
+        store_rgba4(bytes[0], bytes[1], bytes[2], out + 4 * k);
+    }
+
+    const int s = k * accum_pixel_stride;
+    resolve_span<gamma2_op>(r + s, g + s, b + s, counts + k, out + 4 * k, count - k);
+}
+
+GHD_TARGET("avx2")
+inline void resolve_span_gamma2_avx2(const accum_t* r, const accum_t* g, const accum_t* b, const int* counts, unsigned char* out, int count) {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d upper = _mm256_set1_pd(0.999);
+    const __m256d to_byte = _mm256_set1_pd(256.0);
+    const __m128i one = _mm_set1_epi32(1);
+
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+        const int s = k * accum_pixel_stride;
+        __m128d sums[3][2];
+        load_channel_sums4(r + s, g + s, b + s, sums);
+        const __m128i n = _mm_max_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(counts + k)), one);
+        const __m256d scale = _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_cvtepi32_pd(n));
+
+        __m128i bytes[3];
+        for (int c = 0; c < 3; c++) {
+            __m256d x = _mm256_sqrt_pd(_mm256_mul_pd(scale, _mm256_set_m128d(sums[c][1], sums[c][0])));
+            x = _mm256_mul_pd(to_byte, _mm256_min_pd(_mm256_max_pd(x, zero), upper));
+            bytes[c] = _mm256_cvttpd_epi32(x);
+        }
+        store_rgba4(bytes[0], bytes[1], bytes[2], out + 4 * k);
+    }
+
+    const int s = k * accum_pixel_stride;
+    resolve_span<gamma2_op>(r + s, g + s, b + s, counts + k, out + 4 * k, count - k);
+}
+
+#endif
+
+GHD_NO_CONTRACT_END
+
+inline resolve_kernel select_resolve_kernel(tonemapper op, simd_level level) {
+#if defined(GHD_X86)
+    if (op == tonemapper::gamma2 && level >= simd_level::avx2) return resolve_span_gamma2_avx2;
+    if (op == tonemapper::gamma2 && level >= simd_level::sse2) return resolve_span_gamma2_sse2;
+#endif
+    switch (op) {
+    case tonemapper::srgb: return resolve_span<srgb_op>;
+    case tonemapper::aces: return resolve_span<aces_op>;
+    default: return resolve_span<gamma2_op>;
+    }
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+// Affine transform: a 3x3 linear part and a translation, stored as a 3x4 matrix
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+class affine_transform {
+    public:
+        // Identity
+        affine_transform() {
+            for (int r = 0; r < 3; r++)
+                for (int c = 0; c < 4; c++)
+                    m[r][c] = r == c ? 1.0 : 0.0;
+        }
+
+        static affine_transform translation(const vec3& offset) {
+            affine_transform t;
+            for (int r = 0; r < 3; r++)
+                t.m[r][3] = offset[r];
+            return t;
+        }
+
+        static affine_transform scaling(const vec3& factors) {
+            affine_transform t;
+            for (int r = 0; r < 3; r++)
+                t.m[r][r] = factors[r];
+            return t;
+        }
+
+        static affine_transform scaling(double factor) { return scaling(vec3(factor, factor, factor)); }
+
+        // Rotation by angle degrees around the axis through the origin, counter-clockwise
+        // looking down the axis
+        static affine_transform rotation(const vec3& axis, double degrees) {
+            const vec3 a = unit_vector(axis);
+            const double radians = degrees_to_radians(degrees);
+            const double c = cos(radians);
+            const double s = sin(radians);
+            const double k = 1.0 - c;
+            affine_transform t;
+            t.m[0][0] = c + a.x() * a.x() * k;
+            t.m[0][1] = a.x() * a.y() * k - a.z() * s;
+            t.m[0][2] = a.x() * a.z() * k + a.y() * s;
+            t.m[1][0] = a.y() * a.x() * k + a.z() * s;
+            t.m[1][1] = c + a.y() * a.y() * k;
+            t.m[1][2] = a.y() * a.z() * k - a.x() * s;
+            t.m[2][0] = a.z() * a.x() * k - a.y() * s;
+            t.m[2][1] = a.z() * a.y() * k + a.x() * s;
+            t.m[2][2] = c + a.z() * a.z() * k;
+            return t;
+        }
+
+        point3 point(const point3& p) const {
+            return point3(
+                m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+        }
+
+        vec3 vector(const vec3& v) const {
+            return vec3(
+                m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+        }
+
+        // The linear part transposed times v. A normal is carried from object to world
+        // space by the transposed world to object transform.
+        vec3 transposed_vector(const vec3& v) const {
+            return vec3(
+                m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+        }
+
+        // The ray with origin and direction transformed. The direction is not
+        // normalized, so distances along the ray stay the same.
+        ray apply(const ray& r) const { return ray(point(r.origin()), vector(r.direction())); }
+
+        // Box around the transformed corners of box
+        aabb apply(const aabb& box) const {
+            aabb result;
+            for (int corner = 0; corner < 8; corner++) {
+                const point3 p(
+                    corner & 1 ? box.maximum.x() : box.minimum.x(),
+                    corner & 2 ? box.maximum.y() : box.minimum.y(),
+                    corner & 4 ? box.maximum.z() : box.minimum.z());
+                result.expand(point(p));
+            }
+            return result;
+        }
+
+        // Only for invertible transforms
+        affine_transform inverse() const {
+            const double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+            const double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+            const double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+            const double inv_det = 1.0 / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+            affine_transform t;
+            t.m[0][0] = c00 * inv_det;
+            t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+            t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+            t.m[1][0] = c01 * inv_det;
+            t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+            t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+            t.m[2][0] = c02 * inv_det;
+            t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+            t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+            const vec3 offset = t.vector(vec3(m[0][3], m[1][3], m[2][3]));
+            for (int r = 0; r < 3; r++)
+                t.m[r][3] = -offset[r];
+            return t;
+        }
+
+    public:
+        double m[3][4];
+};
+
+// a * b applies b first
+inline affine_transform operator*(const affine_transform& a, const affine_transform& b) {
+    affine_transform t;
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 4; c++) {
+            t.m[r][c] = a.m[r][0] * b.m[0][c] + a.m[r][1] * b.m[1][c] + a.m[r][2] * b.m[2][c];
+            if (c == 3)
+                t.m[r][c] += a.m[r][3];
+        }
+    }
+    return t;
+}
+
+#endif
@@ -2,127 +2,240 @@
 #define VEC3_H
 
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 
 using std::sqrt;
 
-class vec3 {
+// Scalar of the math core, picked at build time (cmake -DGHD_PRECISION=float|double).
+// float halves the size of vectors, rays, hit records and BVH boxes, and the SIMD
+// lanes they need; double is the reference.
+#if defined(GHD_SINGLE_PRECISION)
+typedef float real;
+#else
+typedef double real;
+#endif
+
+template <typename T>
+class vec3_t {
     public:
-        vec3() : e{0,0,0} {}
-        vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+        typedef T value_type;
 
-        double x() const { return e[0]; }
-        double y() const { return e[1]; }
-        double z() const { return e[2]; }
+        vec3_t() : e{0,0,0} {}
+        vec3_t(T e0, T e1, T e2) : e{e0, e1, e2} {}
+        // Between precisions only on request, it rounds
+        template <typename U>
+        explicit vec3_t(const vec3_t<U>& v) : e{static_cast<T>(v.e[0]), static_cast<T>(v.e[1]), static_cast<T>(v.e[2])} {}
 
-        vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-        double operator[](int i) const { return e[i]; }
-        double& operator[](int i) { return e[i]; }
+        T x() const { return e[0]; }
+        T y() const { return e[1]; }
+        T z() const { return e[2]; }
 
-        vec3& operator+=(const vec3 &v) {
+        vec3_t operator-() const { return vec3_t(-e[0], -e[1], -e[2]); }
+        T operator[](int i) const { return e[i]; }
+        T& operator[](int i) { return e[i]; }
+
+        vec3_t& operator+=(const vec3_t &v) {
             e[0] += v.e[0];
             e[1] += v.e[1];
             e[2] += v.e[2];
             return *this;
         }
 
-        vec3& operator*=(const double t) {
+        vec3_t& operator*=(const T t) {
             e[0] *= t;
             e[1] *= t;
             e[2] *= t;
             return *this;
         }
 
-        vec3& operator/=(const double t) {
+        vec3_t& operator/=(const T t) {
             return *this *= 1/t;
         }
 
-        double length() const {
+        T length() const {
             return sqrt(length_squared());
         }
 
-        double length_squared() const {
+        T length_squared() const {
             return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
         }
 
-        inline static vec3 random() {
-        return vec3(random_double(), random_double(), random_double());
+        inline static vec3_t random() {
+        return vec3_t(random_double(), random_double(), random_double());
         }
 
-        inline static vec3 random(double min, double max) {
-            return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
+        inline static vec3_t random(double min, double max) {
+            return vec3_t(random_double(min,max), random_double(min,max), random_double(min,max));
         }
 
         bool near_zero() const {
         // Return true if the vector is close to zero in all dimensions.
-        const auto s = 1e-8;
+        const T s = static_cast<T>(1e-8);
         return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
         }
 
     public:
-        double e[3];
+        T e[3];
 };
 
 // Type aliases for vec3
+using vec3 = vec3_t<real>;
 using point3 = vec3;   // 3D point
 using color = vec3;    // RGB color
 
-// vec3 Utility Functions
+// vec3 Utility Functions. Scalars are taken as the vector's own type (a non-deduced
+// parameter), so 2.0 * v works for float vectors too.
 
-inline std::ostream& operator<<(std::ostream &out, const vec3 &v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream &out, const vec3_t<T> &v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vec3 operator+(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template <typename T>
+inline vec3_t<T> operator+(const vec3_t<T> &u, const vec3_t<T> &v) {
+    return vec3_t<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline vec3 operator-(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template <typename T>
+inline vec3_t<T> operator-(const vec3_t<T> &u, const vec3_t<T> &v) {
+    return vec3_t<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline vec3 operator*(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template <typename T>
+inline vec3_t<T> operator*(const vec3_t<T> &u, const vec3_t<T> &v) {
+    return vec3_t<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3 &v) {
-    return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
+template <typename T>
+inline vec3_t<T> operator*(typename vec3_t<T>::value_type t, const vec3_t<T> &v) {
+    return vec3_t<T>(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vec3 operator*(const vec3 &v, double t) {
+template <typename T>
+inline vec3_t<T> operator*(const vec3_t<T> &v, typename vec3_t<T>::value_type t) {
     return t * v;
 }
 
-inline vec3 operator/(vec3 v, double t) {
+template <typename T>
+inline vec3_t<T> operator/(vec3_t<T> v, typename vec3_t<T>::value_type t) {
     return (1/t) * v;
 }
 
-inline double dot(const vec3 &u, const vec3 &v) {
+template <typename T>
+inline T dot(const vec3_t<T> &u, const vec3_t<T> &v) {
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
 }
 
-inline vec3 cross(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-                u.e[2] * v.e[0] - u.e[0] * v.e[2],
-                u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+template <typename T>
+inline vec3_t<T> cross(const vec3_t<T> &u, const vec3_t<T> &v) {
+    return vec3_t<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                     u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                     u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline vec3 unit_vector(vec3 v) {
+template <typename T>
+inline vec3_t<T> unit_vector(vec3_t<T> v) {
     return v / v.length();
 }
 
-vec3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vec3::random(-1,1);
-        if (p.length_squared() >= 1) continue;
-        return p;
+// Closed-form warps from uniform numbers in [0,1) to the shapes the renderer
+// samples. Each takes a fixed number of inputs (2 for a disk or direction, 3 for a
+// ball) and has no data-dependent loop, so a sampler can hand them fixed sample
+// dimensions and the code stays branch free.
+
+// Sine and cosine of the angle 2 pi t, for t in [-1, 2). Taylor polynomials on
+// [-pi/4, pi/4] and a quadrant swap by table, good to about 2e-9, which is plenty
+// for picking a direction and much cheaper than libm.
+inline void sincos_turns(double t, double& s, double& c) {
+    // Quadrant q: s = sa * sin_sa[q] + ca * sin_ca[q], c = sa * cos_sa[q] + ca * cos_ca[q]
+    static const double sin_sa[4] = { 1, 0, -1, 0 };
+    static const double sin_ca[4] = { 0, 1, 0, -1 };
+    static const double cos_sa[4] = { 0, -1, 0, 1 };
+    static const double cos_ca[4] = { 1, 0, -1, 0 };
+
+    const double x = 4 * t;
+    const int q = static_cast<int>(x + 4.5) - 4; // nearest quadrant, rounds like floor
+    const double a = (x - q) * (pi / 2);
+    const double a2 = a * a;
+    const double sa = a * (1 + a2 * (-1.0 / 6 + a2 * (1.0 / 120 + a2 * (-1.0 / 5040 + a2 * (1.0 / 362880)))));
+    const double ca = 1 + a2 * (-1.0 / 2 + a2 * (1.0 / 24 + a2 * (-1.0 / 720 + a2 * (1.0 / 40320 + a2 * (-1.0 / 3628800)))));
+    const int quadrant = q & 3;
+    s = sa * sin_sa[quadrant] + ca * sin_ca[quadrant];
+    c = sa * cos_sa[quadrant] + ca * cos_ca[quadrant];
+}
+
+// Cube root of w in [0,1]: an exponent estimate from the bits and three Newton steps
+inline double cbrt_unit(double w) {
+    w = w > 1e-300 ? w : 1e-300;
+    uint64_t bits;
+    memcpy(&bits, &w, sizeof(bits));
+    bits = bits / 3 + 0x2a9f7893782da1ceULL;
+    double y;
+    memcpy(&y, &bits, sizeof(y));
+    for (int k = 0; k < 3; k++)
+        y = y - (y * y * y - w) / (3 * y * y);
+    return y;
+}
+
+// Uniform on the unit sphere: z is uniform in [-1,1] (Archimedes), phi around it
+inline vec3 sphere_from_square(double u, double v) {
+    const double z = 1 - 2 * u;
+    const double r2 = 1 - z * z;
+    const double r = std::sqrt(r2 > 0.0 ? r2 : 0.0);
+    double s, c;
+    sincos_turns(v, s, c);
+    return vec3(r * c, r * s, z);
+}
+
+// Uniform in the unit ball: a direction and a radius with density r^2
+inline vec3 ball_from_cube(double u, double v, double w) {
+    return cbrt_unit(w) * sphere_from_square(u, v);
+}
+
+// Uniform in the unit disk (z = 0), concentric mapping (Shirley and Chiu 1997):
+// squares around the center go to rings, so strata of the square stay compact in
+// the disk. Use it for low discrepancy points.
+inline vec3 concentric_disk_from_square(double u, double v) {
+    const double a = 2 * u - 1, b = 2 * v - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+    // Angle in turns, r may be negative and then points the other way
+    double r, t;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        t = 0.125 * (b / a);
+    } else {
+        r = b;
+        t = 0.25 - 0.125 * (a / b);
     }
+    double s, c;
+    sincos_turns(t, s, c);
+    return vec3(r * c, r * s, 0);
+}
+
+// Uniform in the unit disk (z = 0), polar mapping. It stretches strata near the
+// center, but has no octant select or division, so it is the cheaper choice for
+// independent random numbers.
+inline vec3 disk_from_square(double u, double v) {
+    const double r = std::sqrt(u);
+    double s, c;
+    sincos_turns(v, s, c);
+    return vec3(r * c, r * s, 0);
+}
+
+vec3 random_in_unit_sphere() {
+    const double u = random_double();
+    const double v = random_double();
+    return ball_from_cube(u, v, random_double());
 }
 
 vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+    const double u = random_double();
+    return sphere_from_square(u, random_double());
 }
 
 vec3 reflect(const vec3& v, const vec3& n) {
@@ -137,11 +250,8 @@ vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
 }
 
 vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
+    const double u = random_double();
+    return disk_from_square(u, random_double());
 }
 
 #endif
\ No newline at end of file
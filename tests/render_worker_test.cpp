@@ -0,0 +1,72 @@
+// RenderWorker::restart() in a tight loop must not leave the renderer cancelled:
+// after the last restart of every round the frame has to converge to the image a
+// plain Renderer renders with the same settings.
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include "utils/render_worker.h"
+
+static RenderSettings test_settings(int samples_per_pixel, double aperture) {
+    RenderSettings settings;
+    settings.width = 24;
+    settings.height = 16;
+    settings.samples_per_pixel = samples_per_pixel;
+    settings.max_depth = 4;
+    settings.scene_name = SceneName::THREE_SPHERES;
+    settings.aperture = aperture;
+    return settings;
+}
+
+// Waits for the worker to publish the last iteration of settings
+static bool wait_converged(RenderWorker& worker, const RenderSettings& settings, const GHDImage& reference) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (worker.acquire_frame()) {
+            // Frames of the other settings have another spp
+            const RenderFrame& frame = worker.get_frame();
+            if (frame.samples_per_pixel == settings.samples_per_pixel && frame.iteration == settings.samples_per_pixel) {
+                const size_t size = static_cast<size_t>(settings.width) * settings.height * 4;
+                if (memcmp(frame.image.data(), reference.data(), size) != 0) {
+                    fprintf(stderr, "Converged frame differs from the reference render\n");
+                    return false;
+                }
+                return true;
+            }
+        }
+        std::this_thread::yield();
+    }
+    fprintf(stderr, "The render did not converge after the restarts\n");
+    return false;
+}
+
+int main() {
+    const RenderSettings settings = test_settings(4, 0.1);
+
+    Renderer reference(settings.width, settings.height, settings.samples_per_pixel, settings.max_depth);
+    reference.set_verbose(false);
+    reference.set_thread_count(2);
+    reference.set_scene_name(settings.scene_name);
+    reference.set_camera_aperture(settings.aperture);
+    reference.reset();
+    for (int iteration = 1; iteration <= settings.samples_per_pixel; ++iteration) {
+        reference.set_current_iteration(iteration);
+        reference.render();
+    }
+
+    Renderer renderer(settings.width, settings.height, settings.samples_per_pixel, settings.max_depth);
+    renderer.set_verbose(false);
+    renderer.set_thread_count(2);
+    RenderWorker worker(renderer, settings);
+    for (int round = 0; round < 200; ++round) {
+        for (int i = 0; i < 50; ++i)
+            worker.restart(test_settings(i % 2 ? 5 : 6, i % 2 ? 0.2 : 0.0));
+        worker.restart(settings);
+        if (!wait_converged(worker, settings, reference.get_image())) {
+            fprintf(stderr, "Failed in round %d\n", round);
+            return 1;
+        }
+    }
+    printf("Converged after every round of restarts\n");
+    return 0;
+}
@@ -0,0 +1,59 @@
+// The gamma 2 SIMD resolve kernels must give the same bytes as resolve_span<gamma2_op>,
+// for NaN, infinite, negative and zero sums and counts too, at every span length and
+// offset. Built once per accumulation layout (GHD_ACCUM_DOUBLE, GHD_ACCUM_PLANAR).
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+#include "utils/tonemap.h"
+
+int main() {
+    const int pixel_count = 1024;
+    std::mt19937 engine(7);
+    std::uniform_real_distribution<double> uniform(-0.5, 4.0);
+    const accum_t special[] = {
+        std::numeric_limits<accum_t>::quiet_NaN(), -std::numeric_limits<accum_t>::quiet_NaN(),
+        std::numeric_limits<accum_t>::infinity(), -std::numeric_limits<accum_t>::infinity(),
+        accum_t(-1), accum_t(-0.0), accum_t(0), accum_t(1e-30), accum_t(0.998), accum_t(0.999), accum_t(1e30)
+    };
+    const int special_count = sizeof(special) / sizeof(special[0]);
+
+    // Every sixth value is special, the rest are ordinary sums
+    std::vector<accum_t> sums(3 * pixel_count);
+    for (size_t i = 0; i < sums.size(); i++)
+        sums[i] = i % 6 == 0 ? special[(i / 6) % special_count] : static_cast<accum_t>(uniform(engine));
+    std::vector<int> counts(pixel_count);
+    for (int k = 0; k < pixel_count; k++)
+        counts[k] = k % 13 == 0 ? (k % 2 ? 0 : -3) : 1 + static_cast<int>(engine() % 5000);
+
+    auto channel = [&](int c, int index) {
+        return accum_pixel_stride == 1 ? &sums[static_cast<size_t>(c) * pixel_count + index] : &sums[static_cast<size_t>(index) * 3 + c];
+    };
+
+    std::vector<unsigned char> expected(4 * pixel_count), actual(4 * pixel_count);
+    int failures = 0;
+    for (simd_level level : { simd_level::sse2, simd_level::avx2 }) {
+        if (static_cast<int>(level) > static_cast<int>(detect_simd_level()))
+            continue;
+        const resolve_kernel kernel = select_resolve_kernel(tonemapper::gamma2, level);
+        for (int first : { 0, 1, 3, 5 }) {
+            for (int count = 0; first + count <= pixel_count; count += count < 16 ? 1 : 61) {
+                resolve_span<gamma2_op>(channel(0, first), channel(1, first), channel(2, first), &counts[first], expected.data(), count);
+                memset(actual.data(), 0, actual.size());
+                kernel(channel(0, first), channel(1, first), channel(2, first), &counts[first], actual.data(), count);
+                if (memcmp(expected.data(), actual.data(), 4 * static_cast<size_t>(count)) != 0) {
+                    fprintf(stderr, "%s differs from the scalar resolve at pixels [%d, %d)\n", simd_level_name(level), first, first + count);
+                    failures++;
+                }
+            }
+        }
+    }
+
+    if (failures)
+        return 1;
+    printf("SIMD resolve matches the scalar resolve (%s, %s)\n", sizeof(accum_t) == 4 ? "float" : "double",
+           accum_pixel_stride == 1 ? "planar" : "interleaved");
+    return 0;
+}